@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "deque.h"
+
+/*
+ * Chase-Lev deque, following the C11 formulation from "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013),
+ * written with the GCC __atomic builtins since we build as C99.
+ */
+
+#define LOAD(p, order) __atomic_load_n((p), __ATOMIC_##order)
+#define STORE(p, v, order) __atomic_store_n((p), (v), __ATOMIC_##order)
+#define FENCE(order) __atomic_thread_fence(__ATOMIC_##order)
+
+void deque_init(work_deque_t *dq) {
+    memset(dq, 0, sizeof(work_deque_t));
+}
+
+int deque_push(work_deque_t *dq, void *item) {
+    long b = LOAD(&dq->bottom, RELAXED);
+    long t = LOAD(&dq->top, ACQUIRE);
+
+    if (b - t >= DEQUE_SIZE) {
+        return -1;
+    }
+    STORE(&dq->items[b & (DEQUE_SIZE - 1)], item, RELAXED);
+    /* A release store rather than a release fence: same code on x86,
+     * and visible to thread sanitizers, which do not model fences. */
+    STORE(&dq->bottom, b + 1, RELEASE);
+    return 0;
+}
+
+void *deque_take(work_deque_t *dq) {
+    long b = LOAD(&dq->bottom, RELAXED) - 1;
+    long t;
+    void *item = NULL;
+
+    STORE(&dq->bottom, b, RELAXED);
+    FENCE(SEQ_CST);
+    t = LOAD(&dq->top, RELAXED);
+
+    if (t <= b) {
+        item = LOAD(&dq->items[b & (DEQUE_SIZE - 1)], RELAXED);
+        if (t == b) {
+            /* Last item: race against the thieves for it. */
+            if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                item = NULL;
+            }
+            STORE(&dq->bottom, b + 1, RELAXED);
+        }
+    } else {
+        STORE(&dq->bottom, b + 1, RELAXED);
+    }
+    return item;
+}
+
+void *deque_steal(work_deque_t *dq) {
+    long t = LOAD(&dq->top, ACQUIRE);
+    long b;
+    void *item;
+
+    FENCE(SEQ_CST);
+    b = LOAD(&dq->bottom, ACQUIRE);
+    if (t >= b) {
+        return NULL;
+    }
+
+    item = LOAD(&dq->items[t & (DEQUE_SIZE - 1)], RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return item;
+}
+
+long deque_size(work_deque_t *dq) {
+    long t = LOAD(&dq->top, ACQUIRE);
+    long b = LOAD(&dq->bottom, ACQUIRE);
+    return b > t ? b - t : 0;
+}
+
+long deque_room(work_deque_t *dq) {
+    return DEQUE_SIZE - deque_size(dq);
+}
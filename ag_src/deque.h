@@ -0,0 +1,40 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stddef.h>
+
+/* Must be a power of two. */
+#define DEQUE_SIZE 1024
+
+#define DEQUE_CACHE_LINE 64
+
+/*
+ * Fixed size, lock-free work-stealing deque (Chase-Lev). Only the
+ * owner pushes and takes at the bottom; any other thread may steal
+ * from the top. top and bottom are padded apart so that thieves do
+ * not bounce the owner's cache line.
+ */
+typedef struct {
+    long top;
+    char pad_top[DEQUE_CACHE_LINE - sizeof(long)];
+    long bottom;
+    char pad_bottom[DEQUE_CACHE_LINE - sizeof(long)];
+    void *items[DEQUE_SIZE];
+} work_deque_t;
+
+void deque_init(work_deque_t *dq);
+
+/* Owner only. Returns -1 if the deque is full. */
+int deque_push(work_deque_t *dq, void *item);
+/* Owner only. Returns NULL if the deque is empty. */
+void *deque_take(work_deque_t *dq);
+
+/* Any thread. Returns NULL if the deque is empty or another thread won the race. */
+void *deque_steal(work_deque_t *dq);
+
+/* Approximate number of items, for any thread. */
+long deque_size(work_deque_t *dq);
+/* Free slots; exact for the owner. */
+long deque_room(work_deque_t *dq);
+
+#endif
@@ -0,0 +1,1326 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "simd.h"
+#include "util.h"
+
+/* Longest pattern, and largest program, compiled: anything bigger is left to PCRE. */
+#define DFA_MAX_QUERY 1024
+#define DFA_MAX_INSTS 4096
+/* Largest counted repetition, and deepest nesting of groups. */
+#define DFA_MAX_REPEAT 1000
+#define DFA_MAX_DEPTH 64
+/* Memory for the transitions of a cache, before it is flushed. */
+#define DFA_CACHE_BYTES (2 * 1024 * 1024)
+/* DFAs whose caches a thread keeps at once, e.g., for concurrent searches. */
+#define DFA_THREAD_SLOTS 4
+/* Skipping to where a match can start is turned off if, over 256 skips, it
+ * skips less than DFA_MIN_SKIP bytes on average; and tried again after
+ * DFA_SKIP_RETRY bytes. */
+#define DFA_MIN_SKIP 16
+#define DFA_SKIP_RETRY (1024 * 1024)
+
+/*
+ * Transitions hold the offset of the next state in the transition table
+ * (so 0 for the dead state), plus whether a match ends right before the
+ * byte, and whether the next state is idle: no match in progress, only
+ * the search for where one starts.
+ */
+#define DFA_DEAD 0
+#define DFA_MATCH 0x80000000u
+#define DFA_IDLE 0x40000000u
+#define DFA_UNKNOWN 0xFFFFFFFFu
+
+/* What lies on one side of a position: a word byte, a newline, or the edge of the subject. */
+#define F_WORD 1
+#define F_NL 2
+#define F_EDGE 4
+
+enum { I_SET, I_SPLIT, I_JMP, I_ASSERT, I_MATCH };
+enum { A_BOL, A_EOL, A_WORDB, A_NWORDB };
+enum { N_EMPTY, N_SET, N_ASSERT, N_CAT, N_ALT, N_REPEAT };
+
+typedef struct {
+    uint8_t op;
+    uint8_t assertion;
+    uint16_t set;
+    uint32_t x; /* Next instruction of a jump, or preferred one of a split */
+    uint32_t y;
+} inst_t;
+
+typedef struct {
+    inst_t *insts;
+    size_t len;
+    int full;
+} prog_t;
+
+typedef struct node {
+    int type;
+    int arg; /* Set or assertion */
+    int min;
+    int max; /* -1 if unbounded */
+    int lazy;
+    struct node *a;
+    struct node *b;
+} node_t;
+
+struct dfa {
+    uint64_t id;
+    uint8_t (*sets)[32];
+    size_t nsets;
+    /* Forward program: an unanchored, leftmost-first search. Reverse
+     * program: the pattern backwards, anchored, longest match. */
+    prog_t fwd;
+    prog_t rev;
+    /* Bytes that no instruction tells apart share a class; the last
+     * column of a state is the edge of the subject. */
+    uint8_t byte_class[256];
+    uint8_t class_byte[256];
+    size_t ncols;
+    size_t max_states;
+    /* Without assertions, what lies around a position does not matter. */
+    int has_assertions;
+    /* Bytes the first first_len bytes of a match can be, to skip to from an
+     * idle state; first_len is 0 if the pattern can match empty, or if the
+     * first byte can be too many. */
+    uint8_t first[3][256];
+    size_t first_len;
+    size_t first_count;
+    uint8_t first_byte;
+    int teddy;
+    teddy_masks_t masks;
+};
+
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+    uint8_t flags;
+} state_t;
+
+typedef struct {
+    state_t *states;
+    size_t nstates;
+    size_t states_cap;
+    uint32_t *trans;
+    uint32_t *kernels;
+    size_t kernels_len;
+    size_t kernels_cap;
+    uint32_t *hash; /* State index + 1, or 0 if free */
+    size_t hash_size;
+    /* Initial state for each context before the start, or DFA_UNKNOWN. */
+    uint32_t start[(F_WORD | F_NL | F_EDGE) + 1];
+} cache_t;
+
+typedef struct {
+    uint64_t id;
+    cache_t fwd;
+    cache_t rev;
+    /* Scratch for the epsilon closures. */
+    uint32_t *stack;
+    uint32_t *mark;
+    uint32_t *mark_next;
+    uint32_t *next;
+    uint32_t *saved;
+    size_t scratch_len;
+    uint32_t gen;
+    /* How far skips go, and if they are off, how many bytes until they are tried again. */
+    size_t skips;
+    size_t skipped;
+    size_t skip_off;
+} dfa_slot_t;
+
+static __thread dfa_slot_t dfa_slots[DFA_THREAD_SLOTS];
+static __thread unsigned dfa_slot_victim;
+static uint64_t dfa_next_id;
+
+typedef struct {
+    const char *p;
+    int icase;
+    int depth;
+    int fail;
+    dfa_t *dfa;
+} parser_t;
+
+static inline int set_has(const uint8_t *set, const int c) {
+    return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+static inline void set_add(uint8_t *set, const int c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+static int is_word_byte(const int c) {
+    return c < 128 && (isalnum(c) || c == '_');
+}
+
+static int byte_flags(const int c) {
+    return (is_word_byte(c) ? F_WORD : 0) | (c == '\n' ? F_NL : 0);
+}
+
+/* Context a byte (or the edge of the subject, if c < 0) gives to the positions next to it. */
+static int dfa_flags(const dfa_t *dfa, const int c) {
+    if (!dfa->has_assertions) {
+        return 0;
+    }
+    return c < 0 ? F_EDGE : byte_flags(c);
+}
+
+/*
+ * Parser
+ */
+
+static node_t *new_node(const int type, node_t *a, node_t *b) {
+    node_t *n = ag_calloc(1, sizeof(node_t));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+static void free_node(node_t *n) {
+    if (n == NULL) {
+        return;
+    }
+    free_node(n->a);
+    free_node(n->b);
+    free(n);
+}
+
+static node_t *set_node(parser_t *ps, uint8_t set[32]) {
+    node_t *n;
+    int c;
+
+    /* Without UTF, PCRE only folds ASCII letters. */
+    if (ps->icase) {
+        for (c = 'a'; c <= 'z'; c++) {
+            if (set_has(set, c) || set_has(set, c - 'a' + 'A')) {
+                set_add(set, c);
+                set_add(set, c - 'a' + 'A');
+            }
+        }
+    }
+    if (ps->dfa->nsets >= DFA_MAX_INSTS) {
+        ps->fail = 1;
+        return NULL;
+    }
+    ps->dfa->sets = ag_realloc(ps->dfa->sets, (ps->dfa->nsets + 1) * sizeof(*ps->dfa->sets));
+    memcpy(ps->dfa->sets[ps->dfa->nsets], set, 32);
+    n = new_node(N_SET, NULL, NULL);
+    n->arg = (int)ps->dfa->nsets++;
+    return n;
+}
+
+/* Adds the bytes of \d, \w, \s or their negations. Returns 0 if e is none of them. */
+static int class_escape(uint8_t set[32], const char e) {
+    uint8_t cls[32] = { 0 };
+    int c, i;
+
+    switch (tolower((unsigned char)e)) {
+        case 'd':
+            for (c = '0'; c <= '9'; c++) {
+                set_add(cls, c);
+            }
+            break;
+        case 'w':
+            for (c = 0; c < 128; c++) {
+                if (is_word_byte(c)) {
+                    set_add(cls, c);
+                }
+            }
+            break;
+        case 's':
+            for (c = 0; c < 128; c++) {
+                if (isspace(c)) {
+                    set_add(cls, c);
+                }
+            }
+            break;
+        default:
+            return 0;
+    }
+    for (i = 0; i < 32; i++) {
+        set[i] |= isupper((unsigned char)e) ? (uint8_t)~cls[i] : cls[i];
+    }
+    return 1;
+}
+
+static int hex_value(const char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Byte of the escape right after a backslash, moving past it; -1 if not a single byte we know. */
+static int char_escape(const char **pp, const int in_class) {
+    const char *p = *pp;
+    int c = -1;
+    int digits;
+
+    switch (*p) {
+        case 't':
+            c = '\t';
+            break;
+        case 'n':
+            c = '\n';
+            break;
+        case 'r':
+            c = '\r';
+            break;
+        case 'f':
+            c = '\f';
+            break;
+        case 'e':
+            c = 0x1B;
+            break;
+        case 'a':
+            c = 0x07;
+            break;
+        case 'b':
+            /* Backspace in a class, a word boundary elsewhere. */
+            c = in_class ? 0x08 : -1;
+            break;
+        case 'x':
+            if (p[1] == '{') {
+                for (c = 0, p += 2, digits = 0; hex_value(*p) >= 0 && digits < 2; p++, digits++) {
+                    c = c * 16 + hex_value(*p);
+                }
+                if (digits == 0 || *p != '}') {
+                    return -1;
+                }
+            } else {
+                for (c = 0, digits = 0; hex_value(p[1]) >= 0 && digits < 2; p++, digits++) {
+                    c = c * 16 + hex_value(p[1]);
+                }
+                if (digits == 0) {
+                    return -1;
+                }
+            }
+            break;
+        default:
+            if (*p != '\0' && !isalnum((unsigned char)*p)) {
+                c = (unsigned char)*p;
+            }
+            break;
+    }
+    if (c >= 0) {
+        *pp = p + 1;
+    }
+    return c;
+}
+
+static int posix_class(uint8_t set[32], const char *name, const size_t len) {
+    static const struct {
+        const char *name;
+        int (*is)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank }, { "cntrl", iscntrl },
+        { "digit", isdigit }, { "graph", isgraph }, { "lower", islower }, { "print", isprint },
+        { "punct", ispunct }, { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+    size_t i;
+    int c;
+
+    if (len == 4 && strncmp(name, "word", 4) == 0) {
+        return class_escape(set, 'w');
+    }
+    if (len == 5 && strncmp(name, "ascii", 5) == 0) {
+        for (c = 0; c < 128; c++) {
+            set_add(set, c);
+        }
+        return 1;
+    }
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (strlen(classes[i].name) == len && strncmp(name, classes[i].name, len) == 0) {
+            for (c = 0; c < 128; c++) {
+                if (classes[i].is(c)) {
+                    set_add(set, c);
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static node_t *parse_class(parser_t *ps) {
+    uint8_t set[32] = { 0 };
+    const char *p = ps->p + 1;
+    int negate = 0;
+    int first = 1;
+    int lo, hi, c, i;
+
+    if (*p == '^') {
+        negate = 1;
+        p++;
+    }
+    while (*p != ']' || first) {
+        first = 0;
+        if (*p == '\0') {
+            goto fail;
+        }
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            const char *end = strchr(p + 2, ']');
+            if (p[1] != ':' || end == NULL || end[-1] != ':' || !posix_class(set, p + 2, end - p - 3)) {
+                goto fail;
+            }
+            p = end + 1;
+            continue;
+        }
+        if (*p == '\\') {
+            if (class_escape(set, p[1])) {
+                p += 2;
+                /* A range from a class is an error, or a literal '-', depending on the version. */
+                if (*p == '-' && p[1] != ']') {
+                    goto fail;
+                }
+                continue;
+            }
+            p++;
+            lo = char_escape(&p, 1);
+            if (lo < 0) {
+                goto fail;
+            }
+        } else {
+            lo = (unsigned char)*p++;
+        }
+        hi = lo;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            if (*p == '\\') {
+                p++;
+                hi = char_escape(&p, 1);
+            } else if (*p == '[') {
+                hi = -1;
+            } else {
+                hi = (unsigned char)*p++;
+            }
+            if (hi < lo) {
+                goto fail;
+            }
+        }
+        for (c = lo; c <= hi; c++) {
+            set_add(set, c);
+        }
+    }
+    ps->p = p + 1;
+
+    if (negate) {
+        /* Folded first, so that [^a] excludes 'A' as well. */
+        node_t *n = set_node(ps, set);
+        for (i = 0; n != NULL && i < 32; i++) {
+            ps->dfa->sets[n->arg][i] = (uint8_t)~ps->dfa->sets[n->arg][i];
+        }
+        return n;
+    }
+    return set_node(ps, set);
+
+fail:
+    ps->fail = 1;
+    return NULL;
+}
+
+static node_t *parse_alt(parser_t *ps);
+
+static node_t *parse_atom(parser_t *ps) {
+    uint8_t set[32] = { 0 };
+    node_t *n;
+    int c;
+
+    switch (*ps->p) {
+        case '(':
+            /* Only plain and non-capturing groups: options, lookarounds, etc. are left to PCRE. */
+            if (ps->p[1] == '?' && ps->p[2] == ':') {
+                ps->p += 3;
+            } else if (ps->p[1] == '?' || ps->p[1] == '*') {
+                ps->fail = 1;
+                return NULL;
+            } else {
+                ps->p++;
+            }
+            if (++ps->depth > DFA_MAX_DEPTH) {
+                ps->fail = 1;
+                return NULL;
+            }
+            n = parse_alt(ps);
+            ps->depth--;
+            if (*ps->p != ')') {
+                ps->fail = 1;
+                return n;
+            }
+            ps->p++;
+            return n;
+        case '[':
+            return parse_class(ps);
+        case '.':
+            ps->p++;
+            memset(set, 0xFF, sizeof(set));
+            set['\n' >> 3] &= ~(1 << ('\n' & 7));
+            return set_node(ps, set);
+        case '^':
+        case '$':
+            n = new_node(N_ASSERT, NULL, NULL);
+            n->arg = *ps->p++ == '^' ? A_BOL : A_EOL;
+            ps->dfa->has_assertions = 1;
+            return n;
+        case '\\':
+            ps->p++;
+            if (*ps->p == 'b' || *ps->p == 'B') {
+                n = new_node(N_ASSERT, NULL, NULL);
+                n->arg = *ps->p++ == 'b' ? A_WORDB : A_NWORDB;
+                ps->dfa->has_assertions = 1;
+                return n;
+            }
+            if (class_escape(set, *ps->p)) {
+                ps->p++;
+                return set_node(ps, set);
+            }
+            c = char_escape(&ps->p, 0);
+            if (c < 0) {
+                ps->fail = 1;
+                return NULL;
+            }
+            set_add(set, c);
+            return set_node(ps, set);
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            ps->fail = 1;
+            return NULL;
+        default:
+            set_add(set, (unsigned char)*ps->p++);
+            return set_node(ps, set);
+    }
+}
+
+static int parse_number(const char **pp) {
+    int n = 0;
+
+    if (!isdigit((unsigned char)**pp)) {
+        return -1;
+    }
+    for (; isdigit((unsigned char)**pp); (*pp)++) {
+        n = n * 10 + (**pp - '0');
+        if (n > DFA_MAX_REPEAT) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+static int nullable(const node_t *n) {
+    switch (n->type) {
+        case N_SET:
+            return 0;
+        case N_CAT:
+            return nullable(n->a) && nullable(n->b);
+        case N_ALT:
+            return nullable(n->a) || nullable(n->b);
+        case N_REPEAT:
+            return n->min == 0 || nullable(n->a);
+        default:
+            return 1;
+    }
+}
+
+static node_t *parse_repeat(parser_t *ps) {
+    node_t *atom = parse_atom(ps);
+    node_t *n;
+    const char *p = ps->p;
+    int min, max;
+
+    if (ps->fail) {
+        return atom;
+    }
+    switch (*p) {
+        case '*':
+            min = 0;
+            max = -1;
+            p++;
+            break;
+        case '+':
+            min = 1;
+            max = -1;
+            p++;
+            break;
+        case '?':
+            min = 0;
+            max = 1;
+            p++;
+            break;
+        case '{':
+            p++;
+            min = parse_number(&p);
+            max = min;
+            if (*p == ',') {
+                p++;
+                max = *p == '}' ? -1 : parse_number(&p);
+            }
+            if (min < 0 || *p != '}' || (max != -1 && max < min)) {
+                /* Not a quantifier for PCRE, or a too large one. */
+                ps->fail = 1;
+                return atom;
+            }
+            p++;
+            break;
+        default:
+            return atom;
+    }
+
+    /* Repeated assertions, possessive quantifiers, and loops that may match empty
+     * (whose iterations PCRE stops in its own way) are left to PCRE. */
+    if (atom->type == N_ASSERT || *p == '+' || *p == '*' || *p == '{' ||
+        (max == -1 && nullable(atom))) {
+        ps->fail = 1;
+        return atom;
+    }
+    n = new_node(N_REPEAT, atom, NULL);
+    n->min = min;
+    n->max = max;
+    if (*p == '?') {
+        n->lazy = 1;
+        p++;
+    }
+    if (*p == '*' || *p == '+' || *p == '?' || *p == '{') {
+        ps->fail = 1;
+    }
+    ps->p = p;
+    return n;
+}
+
+static node_t *parse_concat(parser_t *ps) {
+    node_t *n = NULL;
+
+    while (*ps->p != '\0' && *ps->p != '|' && *ps->p != ')' && !ps->fail) {
+        node_t *atom = parse_repeat(ps);
+        n = n ? new_node(N_CAT, n, atom) : atom;
+    }
+    return n ? n : new_node(N_EMPTY, NULL, NULL);
+}
+
+static node_t *parse_alt(parser_t *ps) {
+    node_t *n = parse_concat(ps);
+
+    while (*ps->p == '|' && !ps->fail) {
+        ps->p++;
+        n = new_node(N_ALT, n, parse_concat(ps));
+    }
+    return n;
+}
+
+/*
+ * Compiler
+ */
+
+static uint32_t emit(prog_t *pg, const int op) {
+    if (pg->len >= DFA_MAX_INSTS) {
+        pg->full = 1;
+        return 0;
+    }
+    pg->insts[pg->len].op = op;
+    return pg->len++;
+}
+
+static void compile_node(prog_t *pg, const node_t *n, const int reverse) {
+    uint32_t split, end, i;
+    uint32_t *splits;
+    int k;
+
+    if (pg->full) {
+        return;
+    }
+    switch (n->type) {
+        case N_SET:
+            i = emit(pg, I_SET);
+            pg->insts[i].set = n->arg;
+            break;
+        case N_ASSERT:
+            i = emit(pg, I_ASSERT);
+            pg->insts[i].assertion = n->arg;
+            break;
+        case N_CAT:
+            compile_node(pg, reverse ? n->b : n->a, reverse);
+            compile_node(pg, reverse ? n->a : n->b, reverse);
+            break;
+        case N_ALT:
+            split = emit(pg, I_SPLIT);
+            compile_node(pg, n->a, reverse);
+            i = emit(pg, I_JMP);
+            pg->insts[split].x = split + 1;
+            pg->insts[split].y = pg->len;
+            compile_node(pg, n->b, reverse);
+            pg->insts[i].x = pg->len;
+            break;
+        case N_REPEAT:
+            for (k = 0; k < n->min && !pg->full; k++) {
+                compile_node(pg, n->a, reverse);
+            }
+            if (n->max == -1) {
+                split = emit(pg, I_SPLIT);
+                compile_node(pg, n->a, reverse);
+                i = emit(pg, I_JMP);
+                pg->insts[i].x = split;
+                pg->insts[split].x = n->lazy ? pg->len : split + 1;
+                pg->insts[split].y = n->lazy ? split + 1 : pg->len;
+                break;
+            }
+            /* x{2,4} is xx(x(x)?)?: skipping one copy skips the ones after it too. */
+            splits = ag_malloc((n->max - n->min + 1) * sizeof(uint32_t));
+            for (k = 0; k < n->max - n->min && !pg->full; k++) {
+                splits[k] = emit(pg, I_SPLIT);
+                compile_node(pg, n->a, reverse);
+            }
+            end = pg->len;
+            while (k-- > 0) {
+                pg->insts[splits[k]].x = n->lazy ? end : splits[k] + 1;
+                pg->insts[splits[k]].y = n->lazy ? splits[k] + 1 : end;
+            }
+            free(splits);
+            break;
+        default:
+            break;
+    }
+}
+
+static void compute_classes(dfa_t *dfa) {
+    uint64_t sig[256];
+    size_t nclasses = 0;
+    size_t i;
+    int c, d;
+
+    for (c = 0; c < 256; c++) {
+        sig[c] = 1469598103934665603ULL * (uint64_t)(dfa_flags(dfa, c) + 1);
+        for (i = 0; i < dfa->nsets; i++) {
+            sig[c] = (sig[c] ^ (uint64_t)set_has(dfa->sets[i], c)) * 1099511628211ULL;
+        }
+        for (d = 0; d < c; d++) {
+            if (sig[d] != sig[c] || dfa->class_byte[dfa->byte_class[d]] != d) {
+                continue;
+            }
+            /* Same signature: check that no set tells them apart. */
+            for (i = 0; i < dfa->nsets && set_has(dfa->sets[i], c) == set_has(dfa->sets[i], d); i++) {
+            }
+            if (i == dfa->nsets && dfa_flags(dfa, c) == dfa_flags(dfa, d)) {
+                break;
+            }
+        }
+        if (d < c) {
+            dfa->byte_class[c] = dfa->byte_class[d];
+        } else {
+            dfa->byte_class[c] = nclasses;
+            dfa->class_byte[nclasses++] = c;
+        }
+    }
+    dfa->ncols = nclasses + 1;
+    dfa->max_states = DFA_CACHE_BYTES / (dfa->ncols * sizeof(uint32_t));
+    if (dfa->max_states < 16) {
+        dfa->max_states = 16;
+    }
+}
+
+/*
+ * Collects the bytes that can come first, second and third in a match,
+ * assuming its assertions hold, for as many bytes as every match has.
+ */
+static void compute_first(dfa_t *dfa) {
+    uint32_t *stack = ag_malloc((2 * dfa->fwd.len + 1) * sizeof(uint32_t));
+    uint32_t *next = ag_malloc(dfa->fwd.len * sizeof(uint32_t));
+    uint8_t *seen = ag_malloc(dfa->fwd.len);
+    size_t sp = 0, next_len = 0;
+    size_t depth, i;
+    int matched = 0;
+    int c;
+
+    stack[sp++] = 3;
+    for (depth = 0; depth < 3 && !matched && sp > 0; depth++) {
+        uint8_t set[32] = { 0 };
+        memset(seen, 0, dfa->fwd.len);
+        next_len = 0;
+        while (sp > 0) {
+            const uint32_t pc = stack[--sp];
+            const inst_t *inst = &dfa->fwd.insts[pc];
+            if (seen[pc]) {
+                continue;
+            }
+            seen[pc] = 1;
+            switch (inst->op) {
+                case I_SET:
+                    for (i = 0; i < 32; i++) {
+                        set[i] |= dfa->sets[inst->set][i];
+                    }
+                    next[next_len++] = pc + 1;
+                    break;
+                case I_SPLIT:
+                    stack[sp++] = inst->x;
+                    stack[sp++] = inst->y;
+                    break;
+                case I_JMP:
+                    stack[sp++] = inst->x;
+                    break;
+                case I_ASSERT:
+                    stack[sp++] = pc + 1;
+                    break;
+                case I_MATCH:
+                    /* Matches can be this short. */
+                    matched = 1;
+                    break;
+            }
+        }
+        if (matched) {
+            break;
+        }
+        for (c = 0; c < 256; c++) {
+            dfa->first[depth][c] = set_has(set, c);
+        }
+        dfa->first_len = depth + 1;
+        memcpy(stack, next, next_len * sizeof(uint32_t));
+        sp = next_len;
+    }
+    free(stack);
+    free(next);
+    free(seen);
+
+    for (c = 0; dfa->first_len > 0 && c < 256; c++) {
+        if (dfa->first[0][c]) {
+            dfa->first_byte = c;
+            dfa->first_count++;
+        }
+    }
+    /* With that many, the scan would stop too often to pay off. */
+    if (dfa->first_count > 32) {
+        dfa->first_len = 0;
+    }
+
+    /* The first byte selects a bucket by its high nibble, so that the
+     * masks of the two nibbles do not match much more than it. */
+    if (dfa->first_len > 0 && (dfa->first_len > 1 || dfa->first_count > 1) && simd_teddy_available()) {
+        dfa->teddy = 1;
+        dfa->masks.len = dfa->first_len;
+        for (depth = 0; depth < dfa->first_len; depth++) {
+            for (c = 0; c < 256; c++) {
+                if (dfa->first[depth][c]) {
+                    const uint8_t bits = depth == 0 ? 1 << ((c >> 4) & 7) : 0xFF;
+                    dfa->masks.lo[depth][c & 0xF] |= bits;
+                    dfa->masks.hi[depth][c >> 4] |= bits;
+                }
+            }
+        }
+    }
+}
+
+dfa_t *dfa_compile(const char *query, const int case_insensitive) {
+    parser_t ps;
+    node_t *root;
+    dfa_t *dfa;
+    uint8_t any[32];
+    uint32_t i;
+
+    if (strlen(query) > DFA_MAX_QUERY) {
+        return NULL;
+    }
+    dfa = ag_calloc(1, sizeof(dfa_t));
+    memset(&ps, 0, sizeof(ps));
+    ps.p = query;
+    ps.icase = case_insensitive;
+    ps.dfa = dfa;
+    root = parse_alt(&ps);
+    if (ps.fail || *ps.p != '\0') {
+        free_node(root);
+        dfa_free(dfa);
+        return NULL;
+    }
+
+    /* Forward: .*?(pattern), so that earlier starts take priority. */
+    memset(any, 0xFF, sizeof(any));
+    dfa->sets = ag_realloc(dfa->sets, (dfa->nsets + 1) * sizeof(*dfa->sets));
+    memcpy(dfa->sets[dfa->nsets++], any, 32);
+    dfa->fwd.insts = ag_calloc(DFA_MAX_INSTS, sizeof(inst_t));
+    emit(&dfa->fwd, I_SPLIT);
+    i = emit(&dfa->fwd, I_SET);
+    dfa->fwd.insts[i].set = dfa->nsets - 1;
+    i = emit(&dfa->fwd, I_JMP);
+    dfa->fwd.insts[i].x = 0;
+    dfa->fwd.insts[0].x = 3;
+    dfa->fwd.insts[0].y = 1;
+    compile_node(&dfa->fwd, root, 0);
+    emit(&dfa->fwd, I_MATCH);
+
+    dfa->rev.insts = ag_calloc(DFA_MAX_INSTS, sizeof(inst_t));
+    compile_node(&dfa->rev, root, 1);
+    emit(&dfa->rev, I_MATCH);
+    free_node(root);
+
+    if (dfa->fwd.full || dfa->rev.full) {
+        dfa_free(dfa);
+        return NULL;
+    }
+    compute_classes(dfa);
+    compute_first(dfa);
+    dfa->id = __atomic_add_fetch(&dfa_next_id, 1, __ATOMIC_RELAXED);
+    log_debug("Regex compiled to a DFA program of %zu instructions, %zu byte classes.", dfa->fwd.len,
+              dfa->ncols - 1);
+    return dfa;
+}
+
+void dfa_free(dfa_t *dfa) {
+    if (dfa == NULL) {
+        return;
+    }
+    free(dfa->sets);
+    free(dfa->fwd.insts);
+    free(dfa->rev.insts);
+    free(dfa);
+}
+
+
+/*
+ * Matcher
+ */
+
+static void cache_free(cache_t *c) {
+    free(c->states);
+    free(c->trans);
+    free(c->kernels);
+    free(c->hash);
+    memset(c, 0, sizeof(cache_t));
+}
+
+/* Empties the cache, keeping only the dead state. */
+static void cache_reset(cache_t *c, const dfa_t *dfa) {
+    size_t i;
+
+    if (c->hash == NULL) {
+        c->hash_size = 64;
+        c->hash = ag_calloc(c->hash_size, sizeof(uint32_t));
+    } else {
+        memset(c->hash, 0, c->hash_size * sizeof(uint32_t));
+    }
+    if (c->states_cap == 0) {
+        c->states_cap = 16;
+        c->states = ag_malloc(c->states_cap * sizeof(state_t));
+        c->trans = ag_malloc(c->states_cap * dfa->ncols * sizeof(uint32_t));
+    }
+    c->nstates = 1;
+    c->kernels_len = 0;
+    c->states[DFA_DEAD].off = 0;
+    c->states[DFA_DEAD].len = 0;
+    c->states[DFA_DEAD].flags = 0;
+    for (i = 0; i < dfa->ncols; i++) {
+        c->trans[i] = DFA_DEAD;
+    }
+    for (i = 0; i < sizeof(c->start) / sizeof(c->start[0]); i++) {
+        c->start[i] = DFA_UNKNOWN;
+    }
+}
+
+static uint32_t hash_state(const uint32_t *kernel, const size_t len, const int flags) {
+    uint32_t h = 2166136261u ^ (uint32_t)flags;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ kernel[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Doubles the hash table, keeping it at most half full. */
+static void grow_hash(cache_t *c) {
+    const state_t *st;
+    size_t i, h;
+
+    free(c->hash);
+    c->hash_size *= 2;
+    c->hash = ag_calloc(c->hash_size, sizeof(uint32_t));
+    for (i = 1; i < c->nstates; i++) {
+        st = &c->states[i];
+        h = hash_state(c->kernels + st->off, st->len, st->flags) & (c->hash_size - 1);
+        while (c->hash[h]) {
+            h = (h + 1) & (c->hash_size - 1);
+        }
+        c->hash[h] = i + 1;
+    }
+}
+
+/* Index of the state, added if new; UINT32_MAX if the cache is full. */
+static uint32_t find_state(cache_t *c, const dfa_t *dfa, const uint32_t *kernel, const size_t len, const int flags) {
+    size_t h, i;
+    state_t *st;
+
+    if (len == 0) {
+        return DFA_DEAD;
+    }
+    for (h = hash_state(kernel, len, flags) & (c->hash_size - 1); c->hash[h]; h = (h + 1) & (c->hash_size - 1)) {
+        st = &c->states[c->hash[h] - 1];
+        if (st->len == len && st->flags == flags && memcmp(c->kernels + st->off, kernel, len * sizeof(uint32_t)) == 0) {
+            return c->hash[h] - 1;
+        }
+    }
+    if (c->nstates >= dfa->max_states) {
+        return UINT32_MAX;
+    }
+
+    if (c->nstates == c->states_cap) {
+        c->states_cap *= 2;
+        c->states = ag_realloc(c->states, c->states_cap * sizeof(state_t));
+        c->trans = ag_realloc(c->trans, c->states_cap * dfa->ncols * sizeof(uint32_t));
+    }
+    if (c->kernels_len + len > c->kernels_cap) {
+        c->kernels_cap = (c->kernels_len + len) * 2;
+        c->kernels = ag_realloc(c->kernels, c->kernels_cap * sizeof(uint32_t));
+    }
+    st = &c->states[c->nstates];
+    st->off = c->kernels_len;
+    st->len = len;
+    st->flags = flags;
+    memcpy(c->kernels + c->kernels_len, kernel, len * sizeof(uint32_t));
+    c->kernels_len += len;
+    for (i = 0; i < dfa->ncols; i++) {
+        c->trans[c->nstates * dfa->ncols + i] = DFA_UNKNOWN;
+    }
+    c->hash[h] = c->nstates + 1;
+    if (++c->nstates * 2 > c->hash_size) {
+        grow_hash(c);
+    }
+    return c->nstates - 1;
+}
+
+static int assertion_holds(const int assertion, const int before, const int after) {
+    switch (assertion) {
+        case A_BOL:
+            /* Not after a newline that ends the subject, as PCRE. */
+            return (before & F_EDGE) || ((before & F_NL) && !(after & F_EDGE));
+        case A_EOL:
+            return (after & (F_EDGE | F_NL)) != 0;
+        case A_WORDB:
+            return !(before & F_WORD) != !(after & F_WORD);
+        default:
+            return !(before & F_WORD) == !(after & F_WORD);
+    }
+}
+
+/*
+ * Follows the threads of kernel, in priority order, through the
+ * instructions that consume nothing, given what lies before and after
+ * the current position; then moves the ones that accept byte c (none if
+ * c < 0) into slot->next. Returns whether a thread reached MATCH: in a
+ * leftmost-first search, it wins over the threads after it, which are
+ * dropped.
+ */
+static int step(dfa_slot_t *slot, const dfa_t *dfa, const prog_t *pg, const int longest, const uint32_t *kernel,
+                const size_t len, const int before, const int after, const int c, size_t *next_len) {
+    size_t sp = 0;
+    size_t k;
+    int matched = 0;
+
+    if (++slot->gen == 0) {
+        memset(slot->mark, 0, slot->scratch_len * sizeof(uint32_t));
+        memset(slot->mark_next, 0, slot->scratch_len * sizeof(uint32_t));
+        slot->gen = 1;
+    }
+    *next_len = 0;
+    for (k = 0; k < len; k++) {
+        slot->stack[sp++] = kernel[k];
+        while (sp > 0) {
+            const uint32_t pc = slot->stack[--sp];
+            const inst_t *inst = &pg->insts[pc];
+            if (slot->mark[pc] == slot->gen) {
+                continue;
+            }
+            slot->mark[pc] = slot->gen;
+            switch (inst->op) {
+                case I_SET:
+                    if (c >= 0 && set_has(dfa->sets[inst->set], c) && slot->mark_next[pc + 1] != slot->gen) {
+                        slot->mark_next[pc + 1] = slot->gen;
+                        slot->next[(*next_len)++] = pc + 1;
+                    }
+                    break;
+                case I_SPLIT:
+                    slot->stack[sp++] = inst->y;
+                    slot->stack[sp++] = inst->x;
+                    break;
+                case I_JMP:
+                    slot->stack[sp++] = inst->x;
+                    break;
+                case I_ASSERT:
+                    if (assertion_holds(inst->assertion, before, after)) {
+                        slot->stack[sp++] = pc + 1;
+                    }
+                    break;
+                case I_MATCH:
+                    matched = 1;
+                    if (!longest) {
+                        return matched;
+                    }
+                    break;
+            }
+        }
+    }
+    return matched;
+}
+
+/*
+ * Computes and caches the transition of the state at offset *from on
+ * class cls. If the cache is full, it is flushed first, and *from moves
+ * to the new cache.
+ */
+static uint32_t transition(dfa_slot_t *slot, cache_t *c, const dfa_t *dfa, const prog_t *pg, const int reverse,
+                           uint32_t *from, const size_t cls) {
+    const int byte = cls < dfa->ncols - 1 ? dfa->class_byte[cls] : -1;
+    const int side = dfa_flags(dfa, byte);
+    const state_t *st = &c->states[*from / dfa->ncols];
+    const int flags = st->flags;
+    size_t next_len, len;
+    uint32_t to;
+    int matched;
+
+    /* Forward, the state holds what lies before the position and the byte what lies
+     * after it; backwards, the other way around. */
+    matched = step(slot, dfa, pg, reverse, c->kernels + st->off, st->len, reverse ? side : flags,
+                   reverse ? flags : side, byte, &next_len);
+    to = find_state(c, dfa, slot->next, next_len, side);
+    if (to == UINT32_MAX) {
+        log_debug("DFA cache full, flushing it.");
+        st = &c->states[*from / dfa->ncols];
+        len = st->len;
+        memcpy(slot->saved, c->kernels + st->off, len * sizeof(uint32_t));
+        cache_reset(c, dfa);
+        *from = find_state(c, dfa, slot->saved, len, flags) * dfa->ncols;
+        to = find_state(c, dfa, slot->next, next_len, side);
+    }
+
+    to *= dfa->ncols;
+    if (matched) {
+        to |= DFA_MATCH;
+    }
+    /* Only the thread looking for the start of a match is left. */
+    if (!reverse && dfa->first_len > 0 && !slot->skip_off && next_len == 1 && slot->next[0] == 2) {
+        to |= DFA_IDLE;
+    }
+    c->trans[*from + cls] = to;
+    return to;
+}
+
+/* Offset of the initial state, for the given context before (or after, backwards) it. */
+static uint32_t start_state(cache_t *c, const dfa_t *dfa, const int flags) {
+    const uint32_t kernel = 0;
+    uint32_t st;
+
+    if (c->start[flags] == DFA_UNKNOWN) {
+        st = find_state(c, dfa, &kernel, 1, flags);
+        if (st == UINT32_MAX) {
+            cache_reset(c, dfa);
+            st = find_state(c, dfa, &kernel, 1, flags);
+        }
+        c->start[flags] = st * dfa->ncols;
+    }
+    return c->start[flags];
+}
+
+/* Offset of the first position, from i on, that a match can start at; len if none. */
+static size_t skip_to_first(const dfa_t *dfa, const char *s, size_t i, const size_t len) {
+    const char *p;
+    unsigned buckets;
+    size_t k;
+
+    if (dfa->teddy) {
+        while ((p = simd_teddy_find(s + i, len - i, &dfa->masks, &buckets)) != NULL) {
+            i = p - s;
+            for (k = 0; k < dfa->first_len && dfa->first[k][(uint8_t)s[i + k]]; k++) {
+            }
+            if (k == dfa->first_len) {
+                return i;
+            }
+            i++;
+        }
+        return len;
+    }
+    if (dfa->first_count == 1) {
+        p = memchr(s + i, dfa->first_byte, len - i);
+        return p ? (size_t)(p - s) : len;
+    }
+    while (i < len && !dfa->first[0][(uint8_t)s[i]]) {
+        i++;
+    }
+    return i;
+}
+
+/* Same as skip_to_first(), keeping track of whether skipping pays off. */
+static size_t skip(dfa_slot_t *slot, const dfa_t *dfa, const char *s, const size_t i, const size_t len) {
+    const size_t next = skip_to_first(dfa, s, i, len);
+    size_t k;
+
+    slot->skipped += next - i;
+    if (++slot->skips == 256) {
+        if (slot->skipped < 256 * DFA_MIN_SKIP) {
+            log_debug("DFA skips too short, turning them off.");
+            slot->skip_off = DFA_SKIP_RETRY;
+            for (k = 0; k < slot->fwd.nstates * dfa->ncols; k++) {
+                if (slot->fwd.trans[k] != DFA_UNKNOWN) {
+                    slot->fwd.trans[k] &= ~DFA_IDLE;
+                }
+            }
+        }
+        slot->skips = 0;
+        slot->skipped = 0;
+    }
+    return next;
+}
+
+static dfa_slot_t *thread_slot(const dfa_t *dfa) {
+    dfa_slot_t *slot;
+    size_t need = dfa->fwd.len + 1;
+    int i;
+
+    for (i = 0; i < DFA_THREAD_SLOTS; i++) {
+        if (dfa_slots[i].id == dfa->id) {
+            return &dfa_slots[i];
+        }
+    }
+    slot = &dfa_slots[dfa_slot_victim++ % DFA_THREAD_SLOTS];
+    cache_free(&slot->fwd);
+    cache_free(&slot->rev);
+    slot->id = dfa->id;
+    slot->skips = 0;
+    slot->skipped = 0;
+    slot->skip_off = 0;
+    if (slot->scratch_len < need) {
+        slot->scratch_len = need;
+        /* Each instruction is expanded once per step, and pushes at most two others. */
+        slot->stack = ag_realloc(slot->stack, (2 * need + 1) * sizeof(uint32_t));
+        slot->next = ag_realloc(slot->next, need * sizeof(uint32_t));
+        slot->saved = ag_realloc(slot->saved, need * sizeof(uint32_t));
+        free(slot->mark);
+        free(slot->mark_next);
+        slot->mark = ag_calloc(need, sizeof(uint32_t));
+        slot->mark_next = ag_calloc(need, sizeof(uint32_t));
+        slot->gen = 0;
+    }
+    cache_reset(&slot->fwd, dfa);
+    cache_reset(&slot->rev, dfa);
+    return slot;
+}
+
+int dfa_match(const dfa_t *dfa, const char *s, const size_t len, const size_t start, size_t match[2]) {
+    dfa_slot_t *slot = thread_slot(dfa);
+    cache_t *c = &slot->fwd;
+    const uint8_t *u = (const uint8_t *)s;
+    const size_t edge = dfa->ncols - 1;
+    uint32_t st, tr;
+    size_t i = start;
+    size_t end = 0, begin, next_len;
+    int found = 0;
+
+    if (slot->skip_off == 1) {
+        /* Time to try skipping again: the cached transitions have to be marked anew. */
+        slot->skip_off = 0;
+        cache_reset(c, dfa);
+    }
+    if (dfa->first_len > 0 && !slot->skip_off) {
+        i = skip(slot, dfa, s, i, len);
+        if (i == len) {
+            return 0;
+        }
+    }
+    st = start_state(c, dfa, dfa_flags(dfa, i > 0 ? u[i - 1] : -1));
+    while (i < len) {
+        tr = c->trans[st + dfa->byte_class[u[i]]];
+        /* Anything but a plain transition to a live state: dead, unknown, match or idle. */
+        if (tr - 1 >= DFA_IDLE - 1) {
+            if (tr == DFA_UNKNOWN) {
+                tr = transition(slot, c, dfa, &dfa->fwd, 0, &st, dfa->byte_class[u[i]]);
+            }
+            if (tr & DFA_MATCH) {
+                found = 1;
+                end = i;
+            }
+            if (tr & DFA_IDLE) {
+                /* No match so far, and none in progress: skip to where one can start. */
+                i = skip(slot, dfa, s, i + 1, len);
+                if (i == len) {
+                    return 0;
+                }
+                st = start_state(c, dfa, dfa_flags(dfa, u[i - 1]));
+                continue;
+            }
+            tr &= ~DFA_MATCH;
+            if (tr == DFA_DEAD) {
+                break;
+            }
+        }
+        st = tr;
+        i++;
+    }
+    if (i == len) {
+        tr = c->trans[st + edge];
+        if (tr == DFA_UNKNOWN) {
+            tr = transition(slot, c, dfa, &dfa->fwd, 0, &st, edge);
+        }
+        if (tr & DFA_MATCH) {
+            found = 1;
+            end = len;
+        }
+    }
+    if (slot->skip_off) {
+        slot->skip_off = i - start >= slot->skip_off ? 1 : slot->skip_off - (i - start);
+    }
+    if (!found) {
+        return 0;
+    }
+
+    /* The leftmost-first match starts where the longest match of the reversed
+     * pattern, ending at end, does. */
+    c = &slot->rev;
+    begin = end;
+    st = start_state(c, dfa, dfa_flags(dfa, end < len ? u[end] : -1));
+    for (i = end; i > start; i--) {
+        tr = c->trans[st + dfa->byte_class[u[i - 1]]];
+        if (tr - 1 >= DFA_IDLE - 1) {
+            if (tr == DFA_UNKNOWN) {
+                tr = transition(slot, c, dfa, &dfa->rev, 1, &st, dfa->byte_class[u[i - 1]]);
+            }
+            if (tr & DFA_MATCH) {
+                begin = i;
+            }
+            tr &= ~DFA_MATCH;
+            if (tr == DFA_DEAD) {
+                break;
+            }
+        }
+        st = tr;
+    }
+    /* The match may also start at start itself, whatever the byte before it. */
+    if (i == start &&
+        step(slot, dfa, &dfa->rev, 1, c->kernels + c->states[st / dfa->ncols].off, c->states[st / dfa->ncols].len,
+             dfa_flags(dfa, start > 0 ? u[start - 1] : -1), c->states[st / dfa->ncols].flags, -1, &next_len)) {
+        begin = start;
+    }
+
+    match[0] = begin;
+    match[1] = end;
+    return 1;
+}
+
+void dfa_thread_cleanup(void) {
+    int i;
+
+    for (i = 0; i < DFA_THREAD_SLOTS; i++) {
+        dfa_slot_t *slot = &dfa_slots[i];
+        cache_free(&slot->fwd);
+        cache_free(&slot->rev);
+        free(slot->stack);
+        free(slot->mark);
+        free(slot->mark_next);
+        free(slot->next);
+        free(slot->saved);
+        memset(slot, 0, sizeof(dfa_slot_t));
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef DFA_H
+#define DFA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Linear-time regex engine, for the patterns it understands: literals,
+ * classes, '.', groups, alternations, greedy and lazy quantifiers and
+ * the ^, $, \b and \B assertions, with the same (non-UTF, multiline)
+ * semantics as PCRE. Anything else (back references, lookarounds,
+ * option settings, ...) is left to PCRE: dfa_compile() returns NULL.
+ *
+ * The pattern is compiled into a Pike VM program, and matched with a
+ * lazy DFA built from it on demand: a forward scan finds where the
+ * leftmost-first match ends, and a scan backwards from there finds
+ * where it starts. Each step costs at most one pass over the program,
+ * and only until its state is cached, so the time to find a match is
+ * linear in the bytes scanned, whatever the pattern and the input.
+ *
+ * Until a match is in progress, the scan skips to the bytes a match can
+ * start with (memchr(), or the Teddy kernel on up to their first three
+ * bytes), for as long as the skips are long enough to pay off.
+ *
+ * DFA states are cached per thread, and a cache that grows too large
+ * is flushed and built again.
+ */
+
+typedef struct dfa dfa_t;
+
+dfa_t *dfa_compile(const char *query, const int case_insensitive);
+void dfa_free(dfa_t *dfa);
+
+/* Same as re_match(), for a compiled DFA. */
+int dfa_match(const dfa_t *dfa, const char *s, const size_t len, const size_t start, size_t match[2]);
+
+/* Releases the DFA caches of the calling thread. */
+void dfa_thread_cleanup(void);
+
+#endif
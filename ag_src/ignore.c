@@ -201,8 +201,10 @@ static int ackmate_dir_match(const char *dir_name) {
     if (opts.ackmate_dir_filter == NULL) {
         return 0;
     }
-    /* we just care about the match, not where the matches are */
-    return pcre_exec(opts.ackmate_dir_filter, NULL, dir_name, strlen(dir_name), 0, 0, NULL, 0);
+    size_t match[2];
+    /* we just care about the match, not where the matches are. Same values as
+     * pcre_exec() with no ovector: 0 if it matches, -1 otherwise. */
+    return re_match(opts.ackmate_dir_filter, NULL, dir_name, strlen(dir_name), 0, match) ? 0 : -1;
 }
 
 /* This is the hottest code in Ag. 10-15% of all execution time is spent here */
@@ -285,7 +287,7 @@ static int path_ignore_search(const ignores *ig, const char *path, const char *f
 }
 
 /* This function is REALLY HOT. It gets called for every file */
-int filename_filter(const char *path, const struct dirent *dir, void *baton) {
+int filename_filter(const char *path, int dir_fd, struct dirent *dir, void *baton) {
     const char *filename = dir->d_name;
     if (!opts.search_hidden_files && filename[0] == '.') {
         return 0;
@@ -298,6 +300,9 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
         }
     }
 
+    /* From here on, the type of the entry is needed: tell it once, for the walker too. */
+    resolve_dirent_type(dir_fd, dir, opts.follow_symlinks);
+
     if (!opts.follow_symlinks && is_symlink(path, dir)) {
         log_debug("File %s ignored becaused it's a symlink", dir->d_name);
         return 0;
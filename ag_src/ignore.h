@@ -41,7 +41,7 @@ void add_ignore_pattern(ignores *ig, const char *pattern);
 
 void load_ignore_patterns(ignores *ig, const char *path);
 
-int filename_filter(const char *path, const struct dirent *dir, void *baton);
+int filename_filter(const char *path, int dir_fd, struct dirent *dir, void *baton);
 
 int is_empty(ignores *ig);
 
@@ -1,5 +1,4 @@
 #include <ctype.h>
-#include <pcre.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -28,20 +27,16 @@
 #include "search.h"
 #include "util.h"
 
-typedef struct {
-    pthread_t thread;
-    int id;
-} worker_t;
-
 int main(int argc, char **argv) {
     char **base_paths = NULL;
     char **paths = NULL;
     int i;
-    int pcre_opts = PCRE_MULTILINE;
+    int re_opts = RE_MULTILINE;
     int study_opts = 0;
     worker_t *workers = NULL;
     int workers_len;
     int num_cores;
+    search_ctx_t *ctx;
 
 #ifdef HAVE_PLEDGE
     if (pledge("stdio rpath proc exec", NULL) == -1) {
@@ -51,25 +46,19 @@ int main(int argc, char **argv) {
 
     set_log_level(LOG_LEVEL_WARN);
 
-    work_queue = NULL;
-    work_queue_tail = NULL;
+    ctx = ag_calloc(1, sizeof(search_ctx_t));
     root_ignores = init_ignore(NULL, "", 0);
     out_fd = stdout;
 
     parse_options(argc, argv, &base_paths, &paths);
-    log_debug("PCRE Version: %s", pcre_version());
+    log_debug("PCRE Version: %s", re_version());
     if (opts.stats) {
-        memset(&stats, 0, sizeof(stats));
-        gettimeofday(&(stats.time_start), NULL);
+        gettimeofday(&(ctx->stats.time_start), NULL);
     }
 
-#ifdef USE_PCRE_JIT
-    int has_jit = 0;
-    pcre_config(PCRE_CONFIG_JIT, &has_jit);
-    if (has_jit) {
-        study_opts |= PCRE_STUDY_JIT_COMPILE;
+    if (re_has_jit()) {
+        study_opts |= RE_STUDY_JIT;
     }
-#endif
 
 #ifdef _WIN32
     {
@@ -93,20 +82,26 @@ int main(int argc, char **argv) {
     }
 
     log_debug("Using %i workers", workers_len);
-    done_adding_files = FALSE;
+    stop_workers = FALSE;
     workers = ag_calloc(workers_len, sizeof(worker_t));
     if (pthread_cond_init(&files_ready, NULL)) {
         die("pthread_cond_init failed!");
     }
+    if (pthread_cond_init(&ctx->search_done, NULL)) {
+        die("pthread_cond_init failed!");
+    }
     if (pthread_mutex_init(&print_mtx, NULL)) {
         die("pthread_mutex_init failed!");
     }
-    if (opts.stats && pthread_mutex_init(&stats_mtx, NULL)) {
+    if (opts.stats && pthread_mutex_init(&ctx->stats_mtx, NULL)) {
         die("pthread_mutex_init failed!");
     }
     if (pthread_mutex_init(&work_queue_mtx, NULL)) {
         die("pthread_mutex_init failed!");
     }
+    if (init_work_queues(workers_len, TRUE)) {
+        die("Failed to allocate the work queues!");
+    }
 
     if (opts.casing == CASE_SMART) {
         opts.casing = is_lowercase(opts.query) ? CASE_INSENSITIVE : CASE_SENSITIVE;
@@ -120,10 +115,14 @@ int main(int argc, char **argv) {
                 *c = (char)tolower(*c);
             }
         }
-        generate_alpha_skip(opts.query, opts.query_len, alpha_skip_lookup, opts.casing == CASE_SENSITIVE);
-        find_skip_lookup = NULL;
-        generate_find_skip(opts.query, opts.query_len, &find_skip_lookup, opts.casing == CASE_SENSITIVE);
-        generate_hash(opts.query, opts.query_len, h_table, opts.casing == CASE_SENSITIVE);
+        generate_alpha_skip(opts.query, opts.query_len, ctx->alpha_skip_lookup, opts.casing == CASE_SENSITIVE);
+        ctx->find_skip_lookup = NULL;
+        generate_find_skip(opts.query, opts.query_len, &ctx->find_skip_lookup, opts.casing == CASE_SENSITIVE);
+        generate_hash(opts.query, opts.query_len, ctx->h_table, opts.casing == CASE_SENSITIVE);
+        ctx->case_mask = NULL;
+        if (opts.casing == CASE_INSENSITIVE) {
+            generate_case_mask(opts.query, opts.query_len, &ctx->case_mask);
+        }
         if (opts.word_regexp) {
             init_wordchar_table();
             opts.literal_starts_wordchar = is_wordchar(opts.query[0]);
@@ -131,7 +130,14 @@ int main(int argc, char **argv) {
         }
     } else {
         if (opts.casing == CASE_INSENSITIVE) {
-            pcre_opts |= PCRE_CASELESS;
+            re_opts |= RE_CASELESS;
+        }
+        ctx->re_literal = regex_literal(opts.query, opts.casing == CASE_INSENSITIVE, &ctx->re_literal_in_line);
+        if (ctx->re_literal) {
+            ctx->re_literal_len = strlen(ctx->re_literal);
+            if (opts.casing == CASE_INSENSITIVE) {
+                generate_case_mask(ctx->re_literal, ctx->re_literal_len, &ctx->case_mask);
+            }
         }
         if (opts.word_regexp) {
             char *word_regexp_query;
@@ -140,11 +146,18 @@ int main(int argc, char **argv) {
             opts.query = word_regexp_query;
             opts.query_len = strlen(opts.query);
         }
-        compile_study(&opts.re, &opts.re_extra, opts.query, pcre_opts, study_opts);
+        compile_study(&opts.re, &opts.re_extra, opts.query, re_opts, study_opts);
+        ctx->re_line_local = regex_line_local(opts.query);
+        /* PCRE still validates the regex: the DFA only takes the patterns it understands. */
+        ctx->dfa = dfa_compile(opts.query, opts.casing == CASE_INSENSITIVE);
     }
 
+    /* The search reads its own snapshot of the (now final) options. */
+    ctx->opts = opts;
+    ctx->root_ignores = root_ignores;
+
     if (opts.search_stream) {
-        search_stream(0, stdin, "");
+        search_stream(ctx, 0, stdin, "");
     } else {
         for (i = 0; i < workers_len; i++) {
             workers[i].id = i;
@@ -183,8 +196,7 @@ int main(int argc, char **argv) {
 #endif
         for (i = 0; paths[i] != NULL; i++) {
             log_debug("searching path %s for %s", paths[i], opts.query);
-            symhash = NULL;
-            ignores *ig = init_ignore(root_ignores, "", 0);
+            ignores *ig = init_ignore(ctx->root_ignores, "", 0);
             struct stat s = { .st_dev = 0 };
 #ifndef _WIN32
             /* The device is ignored if opts.one_dev is false, so it's fine
@@ -194,11 +206,12 @@ int main(int argc, char **argv) {
                 log_err("Failed to get device information for path %s. Skipping...", paths[i]);
             }
 #endif
-            search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
-            cleanup_ignore(ig);
+            search_dir(ctx, ig, base_paths[i], paths[i], 0, s.st_dev);
         }
+        /* Workers walk directories too, so wait for them before stopping. */
+        wait_search_done(ctx);
         pthread_mutex_lock(&work_queue_mtx);
-        done_adding_files = TRUE;
+        stop_workers = TRUE;
         pthread_cond_broadcast(&files_ready);
         pthread_mutex_unlock(&work_queue_mtx);
         for (i = 0; i < workers_len; i++) {
@@ -209,22 +222,25 @@ int main(int argc, char **argv) {
     }
 
     if (opts.stats) {
-        gettimeofday(&(stats.time_end), NULL);
-        double time_diff = ((long)stats.time_end.tv_sec * 1000000 + stats.time_end.tv_usec) -
-                           ((long)stats.time_start.tv_sec * 1000000 + stats.time_start.tv_usec);
+        gettimeofday(&(ctx->stats.time_end), NULL);
+        double time_diff = ((long)ctx->stats.time_end.tv_sec * 1000000 + ctx->stats.time_end.tv_usec) -
+                           ((long)ctx->stats.time_start.tv_sec * 1000000 + ctx->stats.time_start.tv_usec);
         time_diff /= 1000000;
         printf("%zu matches\n%zu files contained matches\n%zu files searched\n%zu bytes searched\n%f seconds\n",
-               stats.total_matches, stats.total_file_matches, stats.total_files, stats.total_bytes, time_diff);
-        pthread_mutex_destroy(&stats_mtx);
+               ctx->stats.total_matches, ctx->stats.total_file_matches, ctx->stats.total_files, ctx->stats.total_bytes, time_diff);
+        pthread_mutex_destroy(&ctx->stats_mtx);
     }
 
     if (opts.pager) {
         pclose(out_fd);
     }
+    opts.match_found = ctx->opts.match_found;
     cleanup_options();
     pthread_cond_destroy(&files_ready);
+    pthread_cond_destroy(&ctx->search_done);
     pthread_mutex_destroy(&work_queue_mtx);
     pthread_mutex_destroy(&print_mtx);
+    cleanup_work_queues();
     cleanup_ignore(root_ignores);
     free(workers);
     for (i = 0; paths[i] != NULL; i++) {
@@ -233,8 +249,14 @@ int main(int argc, char **argv) {
     }
     free(base_paths);
     free(paths);
-    if (find_skip_lookup) {
-        free(find_skip_lookup);
+    if (ctx->find_skip_lookup) {
+        free(ctx->find_skip_lookup);
+    }
+    if (ctx->case_mask) {
+        free(ctx->case_mask);
     }
+    free(ctx->re_literal);
+    dfa_free(ctx->dfa);
+    free(ctx);
     return !opts.match_found;
 }
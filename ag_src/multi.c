@@ -0,0 +1,289 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multi.h"
+#include "util.h"
+
+static int pattern_eq(const multi_pattern_t *mp, const char *s, const int id) {
+    const char *find = mp->patterns[id];
+    const size_t len = mp->lens[id];
+    size_t i;
+
+    if (!mp->case_insensitive) {
+        return memcmp(s, find, len) == 0;
+    }
+    for (i = 0; i < len; i++) {
+        if ((uint8_t)(s[i] | mp->case_masks[id][i]) != (uint8_t)find[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Whether pattern a is better than b when both match at the same offset. */
+static int pattern_wins(const multi_pattern_t *mp, const int a, const int b) {
+    if (mp->lens[a] != mp->lens[b]) {
+        return mp->lens[a] > mp->lens[b];
+    }
+    return a < b;
+}
+
+static void teddy_add(teddy_masks_t *t, const size_t k, const uint8_t c, const uint8_t bit) {
+    t->lo[k][c & 0xF] |= bit;
+    t->hi[k][c >> 4] |= bit;
+}
+
+static void compile_teddy(multi_pattern_t *mp) {
+    const size_t n = mp->npatterns;
+    int *ids = ag_malloc(n * sizeof(int));
+    size_t i, j, k;
+
+    mp->teddy = 1;
+    mp->masks.len = ag_min(mp->min_len, 3);
+
+    /* Patterns with similar fingerprints share a bucket, so that a candidate
+     * rarely needs to check more than a few of them. */
+    for (i = 0; i < n; i++) {
+        int id = (int)i;
+        for (j = i; j > 0 && memcmp(mp->patterns[ids[j - 1]], mp->patterns[id], mp->masks.len) > 0; j--) {
+            ids[j] = ids[j - 1];
+        }
+        ids[j] = id;
+    }
+
+    mp->bucket_ids = ag_malloc(n * sizeof(int));
+    for (i = 0, k = 0; i < 8; i++) {
+        const size_t end = (i + 1) * n / 8;
+        mp->bucket_start[i] = k;
+        for (; k < end; k++) {
+            const int id = ids[k];
+            for (j = k; j > mp->bucket_start[i] && pattern_wins(mp, id, mp->bucket_ids[j - 1]); j--) {
+                mp->bucket_ids[j] = mp->bucket_ids[j - 1];
+            }
+            mp->bucket_ids[j] = id;
+
+            for (j = 0; j < mp->masks.len; j++) {
+                const uint8_t c = (uint8_t)mp->patterns[id][j];
+                teddy_add(&mp->masks, j, c, 1 << i);
+                if (mp->case_insensitive && mp->case_masks[id][j]) {
+                    teddy_add(&mp->masks, j, c & ~mp->case_masks[id][j], 1 << i);
+                }
+            }
+        }
+    }
+    mp->bucket_start[8] = n;
+    free(ids);
+}
+
+static void compile_ac(multi_pattern_t *mp) {
+    size_t nc;
+    size_t total = 1;
+    uint32_t *fail;
+    uint32_t *queue;
+    size_t head, tail;
+    size_t i, j, c;
+
+    /* Bytes that appear in no pattern all behave the same, so they share class 0. */
+    mp->nclasses = 1;
+    for (i = 0; i < mp->npatterns; i++) {
+        total += mp->lens[i];
+        for (j = 0; j < mp->lens[i]; j++) {
+            const uint8_t b = (uint8_t)mp->patterns[i][j];
+            if (!mp->byte_class[b]) {
+                mp->byte_class[b] = mp->nclasses++;
+            }
+        }
+    }
+    if (mp->case_insensitive) {
+        for (c = 'a'; c <= 'z'; c++) {
+            mp->byte_class[c - ('a' - 'A')] = mp->byte_class[c];
+        }
+    }
+    nc = mp->nclasses;
+
+    /* Trie: 0 is the root, so it also stands for a missing edge. */
+    mp->next = ag_calloc(total * nc, sizeof(uint32_t));
+    mp->out_len = ag_calloc(total, sizeof(size_t));
+    mp->out_id = ag_calloc(total, sizeof(int));
+    mp->nstates = 1;
+    for (i = 0; i < mp->npatterns; i++) {
+        uint32_t state = 0;
+        for (j = 0; j < mp->lens[i]; j++) {
+            uint32_t *edge = &mp->next[state * nc + mp->byte_class[(uint8_t)mp->patterns[i][j]]];
+            if (!*edge) {
+                *edge = mp->nstates++;
+            }
+            state = *edge;
+        }
+        if (!mp->out_len[state]) {
+            mp->out_len[state] = mp->lens[i];
+            mp->out_id[state] = (int)i;
+        }
+    }
+
+    /* Failure links, breadth-first, turning the trie into a DFA. */
+    fail = ag_malloc(mp->nstates * sizeof(uint32_t));
+    queue = ag_malloc(mp->nstates * sizeof(uint32_t));
+    head = tail = 0;
+    for (c = 0; c < nc; c++) {
+        const uint32_t v = mp->next[c];
+        if (v) {
+            fail[v] = 0;
+            queue[tail++] = v;
+        }
+    }
+    while (head < tail) {
+        const uint32_t u = queue[head++];
+        if (!mp->out_len[u]) {
+            mp->out_len[u] = mp->out_len[fail[u]];
+            mp->out_id[u] = mp->out_id[fail[u]];
+        }
+        for (c = 0; c < nc; c++) {
+            uint32_t *edge = &mp->next[u * nc + c];
+            if (*edge) {
+                fail[*edge] = mp->next[fail[u] * nc + c];
+                queue[tail++] = *edge;
+            } else {
+                *edge = mp->next[fail[u] * nc + c];
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    mp->next = ag_realloc(mp->next, mp->nstates * nc * sizeof(uint32_t));
+}
+
+multi_pattern_t *multi_compile(char *const patterns[], const size_t npatterns, const int case_insensitive) {
+    multi_pattern_t *mp = ag_calloc(1, sizeof(multi_pattern_t));
+    size_t i;
+    char *c;
+
+    mp->npatterns = npatterns;
+    mp->case_insensitive = case_insensitive;
+    mp->patterns = ag_calloc(npatterns, sizeof(char *));
+    mp->lens = ag_malloc(npatterns * sizeof(size_t));
+    if (case_insensitive) {
+        mp->case_masks = ag_calloc(npatterns, sizeof(uint8_t *));
+    }
+    mp->min_len = SIZE_MAX;
+
+    for (i = 0; i < npatterns; i++) {
+        mp->lens[i] = strlen(patterns[i]);
+        if (mp->lens[i] == 0) {
+            multi_free(mp);
+            return NULL;
+        }
+        mp->patterns[i] = ag_strdup(patterns[i]);
+        if (case_insensitive) {
+            for (c = mp->patterns[i]; *c != '\0'; ++c) {
+                *c = (char)tolower(*c);
+            }
+            generate_case_mask(mp->patterns[i], mp->lens[i], &mp->case_masks[i]);
+        }
+        mp->min_len = ag_min(mp->min_len, mp->lens[i]);
+        mp->max_len = ag_max(mp->max_len, mp->lens[i]);
+    }
+
+    if (npatterns <= TEDDY_MAX_PATTERNS && simd_teddy_available()) {
+        compile_teddy(mp);
+    } else {
+        compile_ac(mp);
+    }
+    return mp;
+}
+
+void multi_free(multi_pattern_t *mp) {
+    size_t i;
+
+    if (mp == NULL) {
+        return;
+    }
+    for (i = 0; i < mp->npatterns; i++) {
+        free(mp->patterns[i]);
+        if (mp->case_masks) {
+            free(mp->case_masks[i]);
+        }
+    }
+    free(mp->patterns);
+    free(mp->lens);
+    free(mp->case_masks);
+    free(mp->next);
+    free(mp->out_len);
+    free(mp->out_id);
+    free(mp->bucket_ids);
+    free(mp);
+}
+
+static const char *teddy_strnstr(const multi_pattern_t *mp, const char *s, const size_t s_len, size_t *match_len,
+                                 int *pattern) {
+    const char *end = s + s_len;
+    const char *p = s;
+    unsigned buckets;
+
+    /* Candidates come in order, so the first one that verifies is the leftmost match. */
+    while ((p = simd_teddy_find(p, end - p, &mp->masks, &buckets)) != NULL) {
+        int best = -1;
+        while (buckets) {
+            const int b = __builtin_ctz(buckets);
+            size_t i;
+            buckets &= buckets - 1;
+            for (i = mp->bucket_start[b]; i < mp->bucket_start[b + 1]; i++) {
+                const int id = mp->bucket_ids[i];
+                if (best >= 0 && !pattern_wins(mp, id, best)) {
+                    break;
+                }
+                if (mp->lens[id] <= (size_t)(end - p) && pattern_eq(mp, p, id)) {
+                    best = id;
+                    break;
+                }
+            }
+        }
+        if (best >= 0) {
+            *match_len = mp->lens[best];
+            *pattern = best;
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+static const char *ac_strnstr(const multi_pattern_t *mp, const char *s, const size_t s_len, size_t *match_len,
+                              int *pattern) {
+    const size_t nc = mp->nclasses;
+    uint32_t state = 0;
+    size_t best_start = 0;
+    size_t best_len = 0;
+    size_t i;
+
+    for (i = 0; i < s_len; i++) {
+        state = mp->next[state * nc + mp->byte_class[(uint8_t)s[i]]];
+        if (mp->out_len[state]) {
+            const size_t len = mp->out_len[state];
+            const size_t start = i + 1 - len;
+            if (best_len == 0 || start < best_start || (start == best_start && len > best_len)) {
+                best_start = start;
+                best_len = len;
+                *pattern = mp->out_id[state];
+            }
+        }
+        /* Whatever ends from here on starts after the best match. */
+        if (best_len && i + 1 >= best_start + mp->max_len) {
+            break;
+        }
+    }
+    if (best_len == 0) {
+        return NULL;
+    }
+    *match_len = best_len;
+    return s + best_start;
+}
+
+const char *multi_strnstr(const multi_pattern_t *mp, const char *s, const size_t s_len, size_t *match_len, int *pattern) {
+    if (mp->teddy) {
+        return teddy_strnstr(mp, s, s_len, match_len, pattern);
+    }
+    return ac_strnstr(mp, s, s_len, match_len, pattern);
+}
@@ -0,0 +1,60 @@
+#ifndef MULTI_H
+#define MULTI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "simd.h"
+
+/*
+ * Multi-pattern literal search: finds, in a single pass, the leftmost
+ * occurrence of any pattern of a set of fixed strings. If several
+ * patterns match there, the longest one wins, and then the first one
+ * in the set.
+ *
+ * Small sets are searched with the Teddy prefilter, verifying each
+ * candidate against the patterns of its buckets. Larger sets, or any
+ * set if Teddy is not vectorized on this CPU, use an Aho-Corasick
+ * automaton compiled into a DFA over byte classes.
+ */
+
+/* Largest set searched with Teddy. */
+#define TEDDY_MAX_PATTERNS 32
+
+typedef struct {
+    char **patterns; /* Lowercase, if case_insensitive */
+    size_t *lens;
+    uint8_t **case_masks; /* Only if case_insensitive */
+    size_t npatterns;
+    size_t min_len;
+    size_t max_len;
+    int case_insensitive;
+
+    /* Aho-Corasick DFA: nstates rows of nclasses transitions. */
+    uint16_t byte_class[256];
+    size_t nclasses;
+    size_t nstates;
+    uint32_t *next;
+    /* Longest pattern that ends at each state, if out_len is not 0. */
+    size_t *out_len;
+    int *out_id;
+
+    /* Teddy: the patterns of bucket b are bucket_ids[bucket_start[b]] up to
+     * bucket_ids[bucket_start[b + 1]], longest first. */
+    int teddy;
+    teddy_masks_t masks;
+    size_t bucket_start[9];
+    int *bucket_ids;
+} multi_pattern_t;
+
+/* NULL if a pattern is empty. */
+multi_pattern_t *multi_compile(char *const patterns[], const size_t npatterns, const int case_insensitive);
+void multi_free(multi_pattern_t *mp);
+
+/*
+ * Returns the leftmost match in the first s_len bytes of s, and sets
+ * *match_len and *pattern (its index in the set); or returns NULL.
+ */
+const char *multi_strnstr(const multi_pattern_t *mp, const char *s, const size_t s_len, size_t *match_len, int *pattern);
+
+#endif
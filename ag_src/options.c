@@ -165,6 +165,7 @@ void init_options(void) {
     opts.print_all_paths = FALSE;
     opts.print_line_numbers = TRUE;
     opts.recurse_dirs = TRUE;
+    opts.binary_window = DEFAULT_BINARY_WINDOW;
     opts.color_path = ag_strdup(color_path);
     opts.color_match = ag_strdup(color_match);
     opts.color_line_number = ag_strdup(color_line_number);
@@ -180,25 +181,9 @@ void cleanup_options(void) {
         free(opts.query);
     }
 
-    pcre_free(opts.re);
-    if (opts.re_extra) {
-        /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
-        pcre_free(opts.re_extra);
-    }
-
-    if (opts.ackmate_dir_filter) {
-        pcre_free(opts.ackmate_dir_filter);
-    }
-    if (opts.ackmate_dir_filter_extra) {
-        pcre_free(opts.ackmate_dir_filter_extra);
-    }
-
-    if (opts.file_search_regex) {
-        pcre_free(opts.file_search_regex);
-    }
-    if (opts.file_search_regex_extra) {
-        pcre_free(opts.file_search_regex_extra);
-    }
+    re_free(opts.re, opts.re_extra);
+    re_free(opts.ackmate_dir_filter, opts.ackmate_dir_filter_extra);
+    re_free(opts.file_search_regex, opts.file_search_regex_extra);
 }
 
 void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
@@ -267,6 +252,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "ignore-case", no_argument, NULL, 'i' },
         { "ignore-dir", required_argument, NULL, 0 },
         { "invert-match", no_argument, NULL, 'v' },
+        { "io-uring", no_argument, &opts.io_uring, TRUE },
         /* deprecated for --numbers. Remove eventually. */
         { "line-numbers", no_argument, &opts.print_line_numbers, 2 },
         { "list-file-types", no_argument, &list_file_types, 1 },
@@ -603,16 +589,16 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     }
 
     if (file_search_regex) {
-        int pcre_opts = 0;
+        int re_opts = 0;
         if (opts.casing == CASE_INSENSITIVE || (opts.casing == CASE_SMART && is_lowercase(file_search_regex))) {
-            pcre_opts |= PCRE_CASELESS;
+            re_opts |= RE_CASELESS;
         }
         if (opts.word_regexp) {
             char *old_file_search_regex = file_search_regex;
             ag_asprintf(&file_search_regex, "\\b%s\\b", file_search_regex);
             free(old_file_search_regex);
         }
-        compile_study(&opts.file_search_regex, &opts.file_search_regex_extra, file_search_regex, pcre_opts, 0);
+        compile_study(&opts.file_search_regex, &opts.file_search_regex_extra, file_search_regex, re_opts, 0);
         free(file_search_regex);
     }
 
@@ -4,12 +4,13 @@
 #include <getopt.h>
 #include <sys/stat.h>
 
-#include <pcre.h>
+#include "re.h"
 
 #define DEFAULT_AFTER_LEN 2
 #define DEFAULT_BEFORE_LEN 2
 #define DEFAULT_CONTEXT_LEN 2
 #define DEFAULT_MAX_SEARCH_DEPTH 25
+#define DEFAULT_BINARY_WINDOW 512
 enum case_behavior {
     CASE_DEFAULT = 4, /* Changes to CASE_SMART at the end of option parsing */
     CASE_SENSITIVE = 1,
@@ -28,15 +29,15 @@ enum path_print_behavior {
 
 typedef struct {
     int ackmate;
-    pcre *ackmate_dir_filter;
-    pcre_extra *ackmate_dir_filter_extra;
+    re_t *ackmate_dir_filter;
+    re_extra_t *ackmate_dir_filter_extra;
     size_t after;
     size_t before;
     enum case_behavior casing;
     const char *file_search_string;
     int match_files;
-    pcre *file_search_regex;
-    pcre_extra *file_search_regex_extra;
+    re_t *file_search_regex;
+    re_extra_t *file_search_regex_extra;
     int color;
     char *color_line_number;
     char *color_match;
@@ -65,12 +66,13 @@ typedef struct {
     int print_line_numbers;
     int print_long_lines; /* TODO: support this in print.c */
     int passthrough;
-    pcre *re;
-    pcre_extra *re_extra;
+    re_t *re;
+    re_extra_t *re_extra;
     int recurse_dirs;
     int search_all_files;
     int skip_vcs_ignores;
     int search_binary_files;
+    size_t binary_window; /* how many leading bytes is_binary() looks at */
     int search_zip_files;
     int search_hidden_files;
     int search_stream; /* true if tail -F blah | ag */
@@ -84,6 +86,8 @@ typedef struct {
     int paths_len;
     int parallel;
     int use_thread_affinity;
+    int io_uring; /* load files with io_uring, where available */
+    int utf8;
     int vimgrep;
     size_t width;
     int word_regexp;
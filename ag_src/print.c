@@ -31,6 +31,10 @@ __thread struct print_context {
     size_t last_printed_match;
     int in_a_match;
     int printing_a_match;
+    /* Files searched in chunks: whether matches were printed for earlier chunks,
+     * and whether another chunk follows the one being printed. */
+    int continued;
+    int chunk_follows;
 } print_context;
 
 void print_init_context(void) {
@@ -47,6 +51,8 @@ void print_init_context(void) {
     print_context.last_printed_match = 0;
     print_context.in_a_match = FALSE;
     print_context.printing_a_match = FALSE;
+    print_context.continued = FALSE;
+    print_context.chunk_follows = FALSE;
 }
 
 void print_cleanup_context(void) {
@@ -145,18 +151,24 @@ void print_binary_file_matches(const char *path) {
     fprintf(out_fd, "Binary file %s matches.\n", path);
 }
 
-void print_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len) {
+void print_file_matches(const char *path, line_index_t *lines, const match_t matches[], const size_t matches_len) {
+    const char *buf = lines->buf;
+    const size_t buf_len = lines->buf_len;
     size_t cur_match = 0;
     ssize_t lines_to_print = 0;
     char sep = '-';
     size_t i, j;
     int blanks_between_matches = opts.context || opts.after || opts.before;
+    /* A chunk followed by another ends with a newline, not with an empty last line. */
+    size_t last = print_context.chunk_follows && buf_len > 0 && buf[buf_len - 1] == '\n' ? buf_len - 1 : buf_len;
 
     if (opts.ackmate || opts.vimgrep) {
         sep = ':';
     }
 
-    print_file_separator();
+    if (!print_context.continued) {
+        print_file_separator();
+    }
 
     if (opts.print_path == PATH_PRINT_DEFAULT) {
         opts.print_path = PATH_PRINT_TOP;
@@ -164,7 +176,7 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
         opts.print_path = PATH_PRINT_EACH_LINE;
     }
 
-    if (opts.print_path == PATH_PRINT_TOP) {
+    if (opts.print_path == PATH_PRINT_TOP && !print_context.continued) {
         if (opts.print_count) {
             print_path_count(path, opts.path_sep, matches_len);
         } else {
@@ -172,11 +184,30 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
         }
     }
 
-    for (i = 0; i <= buf_len && (cur_match < matches_len || print_context.lines_since_last_match <= opts.after); i++) {
+    for (i = 0; i <= last && (cur_match < matches_len || print_context.lines_since_last_match <= opts.after); i++) {
+        if (i == print_context.prev_line_offset && !print_context.in_a_match && cur_match < matches_len &&
+            print_context.lines_since_last_match > opts.after && matches[cur_match].start > i &&
+            memchr(buf + i, '\n', matches[cur_match].start - i) != NULL) {
+            /* Nothing is printed until the context before the line of the next match, so skip to it. */
+            size_t next_line = line_index_start(lines, matches[cur_match].start);
+            for (j = 0; j < opts.before && next_line > i; j++) {
+                next_line = line_index_start(lines, next_line - 1);
+            }
+            if (next_line > i) {
+                size_t skipped = line_index_number(lines, next_line) - line_index_number(lines, i);
+                print_context.line += skipped;
+                if (print_context.lines_since_last_match < INT_MAX) {
+                    print_context.lines_since_last_match = ag_min(print_context.lines_since_last_match + skipped, INT_MAX);
+                }
+                print_context.prev_line_offset = next_line;
+                print_context.line_preceding_current_match_offset = next_line;
+                i = next_line;
+            }
+        }
         if (cur_match < matches_len && i == matches[cur_match].start) {
             print_context.in_a_match = TRUE;
             /* We found the start of a match */
-            if (cur_match > 0 && blanks_between_matches && print_context.lines_since_last_match > (opts.before + opts.after + 1)) {
+            if ((cur_match > 0 || print_context.continued) && blanks_between_matches && print_context.lines_since_last_match > (opts.before + opts.after + 1)) {
                 fprintf(out_fd, "--\n");
             }
 
@@ -331,6 +362,54 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
     }
 }
 
+void print_chunk_matches(const char *path, line_index_t *lines, const match_t matches[], const size_t matches_len,
+                         const int last_chunk) {
+    const char *buf = lines->buf;
+    const size_t buf_len = lines->buf_len;
+    size_t skipped;
+    size_t start;
+    size_t end;
+    size_t j;
+
+    /* Without matches, a chunk may still hold the context after the last one. */
+    if (matches_len > 0 || (print_context.continued && print_context.lines_since_last_match <= opts.after)) {
+        print_context.chunk_follows = !last_chunk;
+        print_file_matches(path, lines, matches, matches_len);
+        print_context.chunk_follows = FALSE;
+        print_context.continued = TRUE;
+    }
+    if (last_chunk) {
+        return;
+    }
+
+    /* Walk whatever print_file_matches() skipped at the end of the chunk: count
+     * its lines, and keep the last ones as context for the next chunk. */
+    if (print_context.prev_line_offset < buf_len) {
+        /* In this order, so that the line of buf_len is the one kept by lines. */
+        skipped = line_index_number(lines, print_context.prev_line_offset);
+        skipped = line_index_number(lines, buf_len) - skipped;
+        if (print_context.lines_since_last_match < INT_MAX) {
+            print_context.lines_since_last_match = ag_min(print_context.lines_since_last_match + skipped, INT_MAX);
+        }
+        start = buf_len;
+        for (j = 0; j < opts.before && start > print_context.prev_line_offset; j++) {
+            start = line_index_start(lines, start - 1);
+        }
+        while (start < buf_len) {
+            end = line_index_end(lines, start);
+            print_context_append(buf + start, end - start);
+            start = end + 1;
+        }
+    }
+    /* The next chunk starts on a new line, unless a line did not fit in one. */
+    print_context.line = line_index_number(lines, buf_len);
+    print_context.prev_line_offset = 0;
+    print_context.line_preceding_current_match_offset = 0;
+    print_context.last_printed_match = 0;
+    print_context.in_a_match = FALSE;
+    print_context.printing_a_match = FALSE;
+}
+
 void print_line_number(size_t line, const char sep) {
     if (!opts.print_line_numbers) {
         return;
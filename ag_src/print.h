@@ -11,7 +11,15 @@ void print_path(const char *path, const char sep);
 void print_path_count(const char *path, const char sep, const size_t count);
 void print_line(const char *buf, size_t buf_pos, size_t prev_line_offset);
 void print_binary_file_matches(const char *path);
-void print_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len);
+void print_file_matches(const char *path, line_index_t *lines, const match_t matches[], const size_t matches_len);
+/*
+ * Prints the matches of one chunk of a file searched in chunks, lines
+ * holding the chunk and the number of the lines before it. Chunks are
+ * printed in order, so that line numbers and context carry over from one
+ * to the next.
+ */
+void print_chunk_matches(const char *path, line_index_t *lines, const match_t matches[], const size_t matches_len,
+                         const int last_chunk);
 void print_line_number(size_t line, const char sep);
 void print_column_number(const match_t matches[], size_t last_printed_match,
                          size_t prev_line_offset, const char sep);
@@ -0,0 +1,150 @@
+#include "re.h"
+#include "log.h"
+#include "util.h"
+
+#ifdef USE_PCRE2
+
+/* JIT stack of each thread: it starts small, and grows up to the maximum. */
+#define RE_JIT_STACK_START (32 * 1024)
+#define RE_JIT_STACK_MAX (8 * 1024 * 1024)
+
+static __thread struct {
+    pcre2_match_data *match_data;
+    pcre2_match_context *match_ctx;
+    pcre2_jit_stack *jit_stack;
+} re_thread;
+
+const char *re_version(void) {
+    static char version[32];
+    pcre2_config(PCRE2_CONFIG_VERSION, version);
+    return version;
+}
+
+int re_has_jit(void) {
+    uint32_t has_jit = 0;
+    pcre2_config(PCRE2_CONFIG_JIT, &has_jit);
+    return has_jit;
+}
+
+void compile_study(re_t **re, re_extra_t **re_extra, char *q, const int re_opts, const int study_opts) {
+    PCRE2_UCHAR re_err[256];
+    PCRE2_SIZE re_err_offset = 0;
+    int err_code;
+    int rc;
+
+    *re_extra = NULL;
+    *re = pcre2_compile((PCRE2_SPTR)q, PCRE2_ZERO_TERMINATED, re_opts, &err_code, &re_err_offset, NULL);
+    if (*re == NULL) {
+        pcre2_get_error_message(err_code, re_err, sizeof(re_err));
+        die("Bad regex! pcre2_compile() failed at position %zu: %s\nIf you meant to search for a literal string, run ag with -Q",
+            (size_t)re_err_offset,
+            (char *)re_err);
+    }
+    if (study_opts & RE_STUDY_JIT) {
+        rc = pcre2_jit_compile(*re, PCRE2_JIT_COMPLETE);
+        if (rc < 0) {
+            log_debug("pcre2_jit_compile failed (%d), matching without JIT.", rc);
+        }
+    }
+}
+
+void re_free(re_t *re, re_extra_t *re_extra) {
+    (void)re_extra;
+    pcre2_code_free(re);
+}
+
+int re_match(const re_t *re, const re_extra_t *re_extra, const char *s, const size_t len, const size_t start,
+             size_t match[2]) {
+    PCRE2_SIZE *ovector;
+    int rc;
+
+    (void)re_extra;
+    if (re_thread.match_data == NULL) {
+        re_thread.match_data = pcre2_match_data_create(1, NULL);
+        re_thread.match_ctx = pcre2_match_context_create(NULL);
+        if (re_thread.match_data == NULL || re_thread.match_ctx == NULL) {
+            die("Memory allocation failed.");
+        }
+        /* Without its own stack, the JIT falls back to 32K of the machine stack. */
+        re_thread.jit_stack = pcre2_jit_stack_create(RE_JIT_STACK_START, RE_JIT_STACK_MAX, NULL);
+        if (re_thread.jit_stack != NULL) {
+            pcre2_jit_stack_assign(re_thread.match_ctx, NULL, re_thread.jit_stack);
+        }
+    }
+
+    rc = pcre2_match(re, (PCRE2_SPTR)s, len, start, 0, re_thread.match_data, re_thread.match_ctx);
+    if (rc < 0) {
+        if (rc != PCRE2_ERROR_NOMATCH) {
+            log_debug("pcre2_match failed (%d).", rc);
+        }
+        return 0;
+    }
+    ovector = pcre2_get_ovector_pointer(re_thread.match_data);
+    match[0] = ovector[0];
+    match[1] = ovector[1];
+    return 1;
+}
+
+void re_thread_cleanup(void) {
+    pcre2_match_data_free(re_thread.match_data);
+    pcre2_match_context_free(re_thread.match_ctx);
+    pcre2_jit_stack_free(re_thread.jit_stack);
+    re_thread.match_data = NULL;
+    re_thread.match_ctx = NULL;
+    re_thread.jit_stack = NULL;
+}
+
+#else
+
+const char *re_version(void) {
+    return pcre_version();
+}
+
+int re_has_jit(void) {
+    int has_jit = 0;
+#ifdef USE_PCRE_JIT
+    pcre_config(PCRE_CONFIG_JIT, &has_jit);
+#endif
+    return has_jit;
+}
+
+void compile_study(re_t **re, re_extra_t **re_extra, char *q, const int re_opts, const int study_opts) {
+    const char *pcre_err = NULL;
+    int pcre_err_offset = 0;
+
+    *re = pcre_compile(q, re_opts, &pcre_err, &pcre_err_offset, NULL);
+    if (*re == NULL) {
+        die("Bad regex! pcre_compile() failed at position %i: %s\nIf you meant to search for a literal string, run ag with -Q",
+            pcre_err_offset,
+            pcre_err);
+    }
+    *re_extra = pcre_study(*re, study_opts, &pcre_err);
+    if (*re_extra == NULL) {
+        log_debug("pcre_study returned nothing useful. Error: %s", pcre_err);
+    }
+}
+
+void re_free(re_t *re, re_extra_t *re_extra) {
+    pcre_free(re);
+    if (re_extra) {
+        /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
+        pcre_free(re_extra);
+    }
+}
+
+int re_match(const re_t *re, const re_extra_t *re_extra, const char *s, const size_t len, const size_t start,
+             size_t match[2]) {
+    int offset_vector[3];
+
+    if (pcre_exec(re, re_extra, s, (int)len, (int)start, 0, offset_vector, 3) < 0) {
+        return 0;
+    }
+    match[0] = offset_vector[0];
+    match[1] = offset_vector[1];
+    return 1;
+}
+
+void re_thread_cleanup(void) {
+}
+
+#endif
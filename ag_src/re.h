@@ -0,0 +1,65 @@
+#ifndef RE_H
+#define RE_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Regex engine. Regexes are compiled and matched with the legacy PCRE
+ * library, or with PCRE2 if built with USE_PCRE2.
+ *
+ * PCRE2 matches with a match data block and a JIT stack of the calling
+ * thread, created on its first match, so workers never share them and
+ * complex patterns are not bound to the default 32K JIT stack. It also
+ * matches subjects larger than INT_MAX bytes, and can match as UTF-8
+ * (RE_UTF8) without failing on invalid sequences.
+ */
+#ifdef USE_PCRE2
+#ifndef PCRE2_CODE_UNIT_WIDTH
+#define PCRE2_CODE_UNIT_WIDTH 8
+#endif
+#include <pcre2.h>
+
+typedef pcre2_code re_t;
+typedef void re_extra_t; /* The JIT code lives in re_t */
+
+#define RE_CASELESS PCRE2_CASELESS
+#define RE_MULTILINE PCRE2_MULTILINE
+#define RE_UTF8 (PCRE2_UTF | PCRE2_MATCH_INVALID_UTF)
+#define RE_STUDY_JIT 1
+#define RE_MAX_SUBJECT SIZE_MAX
+#else
+#include <pcre.h>
+
+typedef pcre re_t;
+typedef pcre_extra re_extra_t;
+
+#define RE_CASELESS PCRE_CASELESS
+#define RE_MULTILINE PCRE_MULTILINE
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define RE_STUDY_JIT PCRE_STUDY_JIT_COMPILE
+#else
+#define RE_STUDY_JIT 0
+#endif
+#define RE_MAX_SUBJECT INT_MAX
+#endif
+
+const char *re_version(void);
+int re_has_jit(void);
+
+void compile_study(re_t **re, re_extra_t **re_extra, char *q, const int re_opts, const int study_opts);
+void re_free(re_t *re, re_extra_t *re_extra);
+
+/*
+ * Looks for re in the first len (at most RE_MAX_SUBJECT) bytes of s,
+ * from offset start on. Returns 1 and sets match[0] and match[1] to the
+ * offsets of the match, or returns 0.
+ */
+int re_match(const re_t *re, const re_extra_t *re_extra, const char *s, const size_t len, const size_t start,
+             size_t match[2]);
+
+/* Releases what re_match() allocated for the calling thread. */
+void re_thread_cleanup(void);
+
+#endif
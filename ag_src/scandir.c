@@ -1,10 +1,12 @@
 #include <dirent.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "scandir.h"
 #include "util.h"
 
 int ag_scandir(const char *dirname,
+               int dir_fd,
                struct dirent ***namelist,
                filter_fp filter,
                void *baton) {
@@ -14,8 +16,9 @@ int ag_scandir(const char *dirname,
     int names_len = 32;
     int results_len = 0;
 
-    dirp = opendir(dirname);
+    dirp = fdopendir(dir_fd);
     if (dirp == NULL) {
+        close(dir_fd);
         goto fail;
     }
 
@@ -25,7 +28,7 @@ int ag_scandir(const char *dirname,
     }
 
     while ((entry = readdir(dirp)) != NULL) {
-        if ((*filter)(dirname, entry, baton) == FALSE) {
+        if ((*filter)(dirname, dir_fd, entry, baton) == FALSE) {
             continue;
         }
         if (results_len >= names_len) {
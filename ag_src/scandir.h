@@ -10,9 +10,15 @@ typedef struct {
     const char *path_start;
 } scandir_baton_t;
 
-typedef int (*filter_fp)(const char *path, const struct dirent *, void *);
+/*
+ * The filter gets the descriptor of the directory, for fstatat(), and may
+ * fill in the type of an entry (see resolve_dirent_type()).
+ */
+typedef int (*filter_fp)(const char *path, int dir_fd, struct dirent *, void *);
 
+/* Lists dirname, already open as dir_fd, which is closed. */
 int ag_scandir(const char *dirname,
+               int dir_fd,
                struct dirent ***namelist,
                filter_fp filter,
                void *baton);
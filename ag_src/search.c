@@ -1,102 +1,229 @@
 #include "search.h"
 #include "print.h"
 #include "scandir.h"
+#include "simd.h"
 
 #include "../libag.h"
 
-work_queue_t *work_queue;
-work_queue_t *work_queue_tail;
-int done_adding_files;
 int stop_workers;
+int work_stealing;
 pthread_cond_t files_ready;
-pthread_mutex_t stats_mtx;
 pthread_mutex_t work_queue_mtx;
 
-pthread_barrier_t worker_done;
-pthread_barrier_t results_done;
+/* Searches with queued files, served in a round-robin fashion. */
+static search_ctx_t *active_searches;
+static search_ctx_t *active_searches_tail;
 
-symdir_t *symhash;
+/* Work stealing: one deque per worker, and the number of sleeping workers. */
+static work_deque_t *worker_deques;
+static int deques_len;
+static int idle_workers;
+/* Workers in the pool, for search_split(). */
+static int pool_workers;
 
-size_t alpha_skip_lookup[256];
-size_t *find_skip_lookup;
-uint8_t h_table[H_SIZE] __attribute__((aligned(64)));
+/* Big buffers are scanned for literals this many bytes at a time, checking for cancellation in between. */
+#define SEARCH_WINDOW (1024 * 1024)
 
-void search_buf(int worker_id, const char *buf, const size_t buf_len,
-                const char *dir_full_path) {
-    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
-    size_t buf_offset = 0;
+/* Whether the search was cancelled, spent its result budget or ran past its deadline. */
+int search_cancelled(search_ctx_t *ctx) {
+    struct timespec now;
 
-    if (opts.search_stream) {
-        binary = 0;
-    } else if (!opts.search_binary_files && opts.mmap) { /* if not using mmap, binary files have already been skipped */
-        binary = is_binary((const void *)buf, buf_len);
-        if (binary) {
-            log_debug("File %s is binary. Skipping...", dir_full_path);
-            return;
+    if (__atomic_load_n(&ctx->cancelled, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&ctx->budget_spent, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&ctx->deadline_passed, __ATOMIC_RELAXED)) {
+        return TRUE;
+    }
+    if (ctx->deadline == 0) {
+        return FALSE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((long long)now.tv_sec * 1000000000LL + now.tv_nsec < ctx->deadline) {
+        return FALSE;
+    }
+    log_debug("Search deadline reached, stopping.");
+    __atomic_store_n(&ctx->deadline_passed, 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+/* Matches still left in the search budget, SIZE_MAX if there is no limit. */
+static size_t matches_left(search_ctx_t *ctx) {
+    size_t taken;
+
+    if (ctx->max_matches == 0) {
+        return SIZE_MAX;
+    }
+    taken = __atomic_load_n(&ctx->nmatches, __ATOMIC_RELAXED);
+    return taken < ctx->max_matches ? ctx->max_matches - taken : 0;
+}
+
+/* The most matches worth finding in a file: what is left of the search budget, or
+ * of --max-count, whichever is less. */
+static size_t file_match_limit(search_ctx_t *ctx, size_t match_limit) {
+    if (ctx->opts.max_matches_per_file > 0) {
+        return ag_min(match_limit, ctx->opts.max_matches_per_file);
+    }
+    return match_limit;
+}
+
+/* Takes up to matches_len matches, and one file if new_file is set, from the search
+ * budget, and stops the search once it is spent. Returns how many matches may be kept. */
+static size_t take_budget(search_ctx_t *ctx, size_t matches_len, int new_file) {
+    size_t taken;
+    size_t granted = matches_len;
+
+    if (ctx->max_matches > 0) {
+        taken = __atomic_load_n(&ctx->nmatches, __ATOMIC_RELAXED);
+        do {
+            if (taken >= ctx->max_matches) {
+                return 0;
+            }
+            granted = ctx->max_matches - taken;
+            if (granted > matches_len) {
+                granted = matches_len;
+            }
+        } while (!__atomic_compare_exchange_n(&ctx->nmatches, &taken, taken + granted, 0,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (taken + granted == ctx->max_matches) {
+            log_debug("Match limit reached, stopping.");
+            __atomic_store_n(&ctx->budget_spent, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (ctx->max_files > 0 && new_file) {
+        taken = __atomic_fetch_add(&ctx->nfiles, 1, __ATOMIC_RELAXED);
+        if (taken >= ctx->max_files) {
+            return 0;
+        }
+        if (taken + 1 == ctx->max_files) {
+            log_debug("File limit reached, stopping.");
+            __atomic_store_n(&ctx->budget_spent, 1, __ATOMIC_RELAXED);
         }
     }
+    return granted;
+}
 
-    size_t matches_len = 0;
-    match_t *matches;
-    size_t matches_size;
-    size_t matches_spare;
+/* Finds the literal every match of the regex contains. */
+static const char *find_re_literal(const search_ctx_t *ctx, const char *s, const size_t s_len) {
+    if (ctx->opts.casing == CASE_SENSITIVE) {
+        return simd_strnstr(s, ctx->re_literal, s_len, ctx->re_literal_len);
+    }
+    return simd_strncasestr(s, ctx->re_literal, s_len, ctx->re_literal_len, ctx->case_mask);
+}
 
-    if (opts.invert_match) {
-        /* If we are going to invert the set of matches at the end, we will need
-         * one extra match struct, even if there are no matches at all. So make
-         * sure we have a nonempty array; and make sure we always have spare
-         * capacity for one extra.
-         */
-        matches_size = 100;
-        matches = ag_malloc(matches_size * sizeof(match_t));
-        matches_spare = 1;
-    } else {
-        matches_size = 0;
-        matches = NULL;
-        matches_spare = 0;
+/* Matches the query regex, with the DFA if there is one. */
+static int match_query(const search_ctx_t *ctx, const char *s, const size_t len, const size_t start,
+                       size_t match[2]) {
+    if (ctx->dfa) {
+        return dfa_match(ctx->dfa, s, len, start, match);
     }
+    return re_match(ctx->opts.re, ctx->opts.re_extra, s, len, start, match);
+}
+
+/*
+ * Finds the matches in buf past its first from bytes, up to match_limit of
+ * them, and returns how many: they go to *matches_p, grown as needed with
+ * matches_spare entries to spare.
+ */
+static size_t find_matches(search_ctx_t *ctx, const char *buf, const size_t buf_len, const size_t from,
+                           line_index_t *lines, match_t **matches_p, size_t *matches_size_p,
+                           const size_t matches_spare, const size_t match_limit, const char *dir_full_path) {
+    match_t *matches = *matches_p;
+    size_t matches_size = *matches_size_p;
+    size_t matches_len = 0;
+    size_t buf_offset = from;
 
-    if (!opts.literal && opts.query_len == 1 && opts.query[0] == '.') {
+    if (!ctx->opts.literal && ctx->opts.query_len == 1 && ctx->opts.query[0] == '.') {
         matches_size = 1;
         matches = matches == NULL ? ag_malloc(matches_size * sizeof(match_t)) : matches;
-        matches[0].start = 0;
+        matches[0].start = from;
         matches[0].end = buf_len;
         matches_len = 1;
-    } else if (opts.literal) {
-        const char *match_ptr = buf;
+    } else if (ctx->multi) {
+        const multi_pattern_t *mp = ctx->multi;
+        const char *match_ptr;
+        size_t match_len;
+        size_t scan_len;
+        int pattern;
+
+        while (buf_offset < buf_len) {
+            scan_len = buf_len - buf_offset;
+            if (scan_len > SEARCH_WINDOW + mp->max_len - 1) {
+                scan_len = SEARCH_WINDOW + mp->max_len - 1;
+            }
+            match_ptr = multi_strnstr(mp, buf + buf_offset, scan_len, &match_len, &pattern);
+
+            /* Only a match that starts in the first SEARCH_WINDOW bytes is sure to be the
+             * longest at its offset: anything later is searched again in the next window. */
+            if (scan_len < buf_len - buf_offset &&
+                (match_ptr == NULL || (size_t)(match_ptr - buf) - buf_offset >= SEARCH_WINDOW)) {
+                buf_offset += SEARCH_WINDOW;
+                if (search_cancelled(ctx)) {
+                    break;
+                }
+                continue;
+            }
+            if (match_ptr == NULL) {
+                break;
+            }
+
+            realloc_matches(&matches, &matches_size, matches_len + matches_spare);
+
+            matches[matches_len].start = match_ptr - buf;
+            matches[matches_len].end = matches[matches_len].start + match_len;
+            matches[matches_len].pattern = pattern;
+            buf_offset = matches[matches_len].end;
+            log_debug("Match found. File %s, offset %lu bytes, pattern %d.", dir_full_path, matches[matches_len].start, pattern);
+            matches_len++;
+
+            if (matches_len >= match_limit) {
+                break;
+            }
+        }
+    } else if (ctx->opts.literal) {
+        const char *match_ptr = buf + buf_offset;
+        const size_t window = SEARCH_WINDOW + ctx->opts.query_len;
+        size_t scan_len;
 
         while (buf_offset < buf_len) {
-/* hash_strnstr only for little-endian platforms that allow unaligned access */
-#if defined(__i386__) || defined(__x86_64__)
-            /* Decide whether to fall back on boyer-moore */
-            if ((size_t)opts.query_len < 2 * sizeof(uint16_t) - 1 || opts.query_len >= UCHAR_MAX) {
-                match_ptr = boyer_moore_strnstr(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, alpha_skip_lookup, find_skip_lookup, opts.casing == CASE_INSENSITIVE);
+            scan_len = buf_len - buf_offset;
+            if (scan_len > window) {
+                scan_len = window;
+            }
+            /* Vectorized, for any query length */
+            if (ctx->opts.casing == CASE_SENSITIVE) {
+                match_ptr = simd_strnstr(match_ptr, ctx->opts.query, scan_len, ctx->opts.query_len);
             } else {
-                match_ptr = hash_strnstr(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, h_table, opts.casing == CASE_SENSITIVE);
+                match_ptr = simd_strncasestr(match_ptr, ctx->opts.query, scan_len, ctx->opts.query_len, ctx->case_mask);
             }
-#else
-            match_ptr = boyer_moore_strnstr(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, alpha_skip_lookup, find_skip_lookup, opts.casing == CASE_INSENSITIVE);
-#endif
 
             if (match_ptr == NULL) {
-                break;
+                if (scan_len == buf_len - buf_offset) {
+                    break;
+                }
+                /* Nothing in this window: the next one overlaps it by query_len - 1 bytes. */
+                buf_offset += scan_len - ctx->opts.query_len + 1;
+                match_ptr = buf + buf_offset;
+                if (search_cancelled(ctx)) {
+                    break;
+                }
+                continue;
             }
 
-            if (opts.word_regexp) {
+            if (ctx->opts.word_regexp) {
                 const char *start = match_ptr;
-                const char *end = match_ptr + opts.query_len;
+                const char *end = match_ptr + ctx->opts.query_len;
 
                 /* Check whether both start and end of the match lie on a word
                  * boundary
                  */
                 if ((start == buf ||
-                     is_wordchar(*(start - 1)) != opts.literal_starts_wordchar) &&
+                     is_wordchar(*(start - 1)) != ctx->opts.literal_starts_wordchar) &&
                     (end == buf + buf_len ||
-                     is_wordchar(*end) != opts.literal_ends_wordchar)) {
+                     is_wordchar(*end) != ctx->opts.literal_ends_wordchar)) {
                     /* It's a match */
                 } else {
                     /* It's not a match */
-                    match_ptr += find_skip_lookup[0] - opts.query_len + 1;
+                    match_ptr += ctx->find_skip_lookup[0] - ctx->opts.query_len + 1;
                     buf_offset = match_ptr - buf;
                     continue;
                 }
@@ -105,23 +232,26 @@ void search_buf(int worker_id, const char *buf, const size_t buf_len,
             realloc_matches(&matches, &matches_size, matches_len + matches_spare);
 
             matches[matches_len].start = match_ptr - buf;
-            matches[matches_len].end = matches[matches_len].start + opts.query_len;
+            matches[matches_len].end = matches[matches_len].start + ctx->opts.query_len;
             buf_offset = matches[matches_len].end;
             log_debug("Match found. File %s, offset %lu bytes.", dir_full_path, matches[matches_len].start);
             matches_len++;
-            match_ptr += opts.query_len;
+            match_ptr += ctx->opts.query_len;
 
-            if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+            if (matches_len >= match_limit) {
                 break;
             }
         }
     } else {
-        int offset_vector[3];
-        if (opts.multiline) {
-            while (buf_offset < buf_len &&
-                   (pcre_exec(opts.re, opts.re_extra, buf, buf_len, buf_offset, 0, offset_vector, 3)) >= 0) {
-                log_debug("Regex match found. File %s, offset %i bytes.", dir_full_path, offset_vector[0]);
+        size_t offset_vector[2];
+        if (ctx->opts.multiline && !(ctx->re_literal && ctx->re_literal_in_line)) {
+            /* Every match contains the literal, so a buffer without it has none. */
+            if (ctx->re_literal && find_re_literal(ctx, buf + buf_offset, buf_len - buf_offset) == NULL) {
+                buf_offset = buf_len;
+            }
+            while (buf_offset < buf_len && !search_cancelled(ctx) &&
+                   match_query(ctx, buf, buf_len, buf_offset, offset_vector)) {
+                log_debug("Regex match found. File %s, offset %zu bytes.", dir_full_path, offset_vector[0]);
                 buf_offset = offset_vector[1];
                 if (offset_vector[0] == offset_vector[1]) {
                     ++buf_offset;
@@ -134,26 +264,88 @@ void search_buf(int worker_id, const char *buf, const size_t buf_len,
                 matches[matches_len].end = offset_vector[1];
                 matches_len++;
 
-                if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                    log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                if (matches_len >= match_limit) {
                     break;
                 }
             }
+        } else if (!ctx->opts.multiline && ctx->re_line_local && !ctx->re_literal) {
+            /* Matches must lie on a single line, but the regex still runs over the whole
+             * buffer rather than once per line: only the line of a match that spans
+             * lines (or of an empty match at the end of a line) is searched by itself. */
+            while (buf_offset < buf_len && !search_cancelled(ctx) &&
+                   match_query(ctx, buf, buf_len, buf_offset, offset_vector)) {
+                size_t match_start = offset_vector[0];
+                if (offset_vector[1] > match_start
+                        ? memchr(buf + match_start, '\n', offset_vector[1] - match_start) == NULL
+                        : match_start < buf_len && buf[match_start] != '\n') {
+                    log_debug("Regex match found. File %s, offset %zu bytes.", dir_full_path, match_start);
+                    buf_offset = offset_vector[1];
+                    if (offset_vector[0] == offset_vector[1]) {
+                        ++buf_offset;
+                        log_debug("Regex match is of length zero. Advancing offset one byte.");
+                    }
+
+                    realloc_matches(&matches, &matches_size, matches_len + matches_spare);
+
+                    matches[matches_len].start = offset_vector[0];
+                    matches[matches_len].end = offset_vector[1];
+                    matches_len++;
+
+                    if (matches_len >= match_limit) {
+                        break;
+                    }
+                    continue;
+                }
+
+                const char *line;
+                size_t line_start = line_index_start(lines, match_start);
+                size_t line_len = buf_getline(&line, lines, line_start);
+                size_t line_offset = buf_offset > line_start ? buf_offset - line_start : 0;
+                while (line_offset < line_len && match_query(ctx, line, line_len, line_offset, offset_vector)) {
+                    log_debug("Regex match found. File %s, offset %zu bytes.", dir_full_path,
+                              line_start + offset_vector[0]);
+                    line_offset = offset_vector[1];
+                    if (offset_vector[0] == offset_vector[1]) {
+                        ++line_offset;
+                        log_debug("Regex match is of length zero. Advancing offset one byte.");
+                    }
+
+                    realloc_matches(&matches, &matches_size, matches_len + matches_spare);
+
+                    matches[matches_len].start = offset_vector[0] + line_start;
+                    matches[matches_len].end = offset_vector[1] + line_start;
+                    matches_len++;
+
+                    if (matches_len >= match_limit) {
+                        goto multiline_done;
+                    }
+                }
+                buf_offset = line_start + line_len + 1;
+            }
         } else {
             while (buf_offset < buf_len) {
                 const char *line;
-                size_t line_len = buf_getline(&line, buf, buf_len, buf_offset);
-                if (!line) {
+                if (ctx->re_literal) {
+                    /* Matches lie on a single line and contain the literal, so skip
+                     * straight to the next line that has it. */
+                    line = find_re_literal(ctx, buf + buf_offset, buf_len - buf_offset);
+                    if (line == NULL) {
+                        break;
+                    }
+                    buf_offset = ag_max(buf_offset, line_index_start(lines, line - buf));
+                }
+                size_t line_len = buf_getline(&line, lines, buf_offset);
+                if (!line || search_cancelled(ctx)) {
                     break;
                 }
                 size_t line_offset = 0;
                 while (line_offset < line_len) {
-                    int rv = pcre_exec(opts.re, opts.re_extra, line, line_len, line_offset, 0, offset_vector, 3);
-                    if (rv < 0) {
+                    if (!match_query(ctx, line, line_len, line_offset, offset_vector)) {
                         break;
                     }
-                    size_t line_to_buf = buf_offset + line_offset;
-                    log_debug("Regex match found. File %s, offset %i bytes.", dir_full_path, offset_vector[0]);
+                    /* offset_vector is relative to the line, not to line_offset. */
+                    size_t line_to_buf = buf_offset;
+                    log_debug("Regex match found. File %s, offset %zu bytes.", dir_full_path, offset_vector[0]);
                     line_offset = offset_vector[1];
                     if (offset_vector[0] == offset_vector[1]) {
                         ++line_offset;
@@ -166,8 +358,7 @@ void search_buf(int worker_id, const char *buf, const size_t buf_len,
                     matches[matches_len].end = offset_vector[1] + line_to_buf;
                     matches_len++;
 
-                    if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                        log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                    if (matches_len >= match_limit) {
                         goto multiline_done;
                     }
                 }
@@ -177,126 +368,786 @@ void search_buf(int worker_id, const char *buf, const size_t buf_len,
     }
 
 multiline_done:
+    *matches_p = matches;
+    *matches_size_p = matches_size;
+    return matches_len;
+}
+
+/*
+ * Searches buf. binary_checked tells that the caller already found it not
+ * to be binary, while loading it; otherwise, binary files are skipped here.
+ */
+void search_buf(search_ctx_t *ctx, int worker_id, const char *buf, const size_t buf_len,
+                const char *dir_full_path, const int binary_checked) {
+    int binary = binary_checked ? 0 : -1; /* 1 = yes, 0 = no, -1 = don't know */
+
+    if (ctx->opts.search_stream) {
+        binary = 0;
+    } else if (!ctx->opts.search_binary_files && binary == -1) {
+        binary = is_binary((const void *)buf, buf_len, ctx->opts.binary_window);
+        if (binary) {
+            log_debug("File %s is binary. Skipping...", dir_full_path);
+            return;
+        }
+    }
+
+    size_t matches_len = 0;
+    match_t *matches;
+    size_t matches_size;
+    size_t matches_spare;
+    /* No point in finding more matches than the search can still keep. Inverted
+     * matches are only known at the end, so they are trimmed there instead. */
+    size_t match_limit = ctx->opts.invert_match ? SIZE_MAX : matches_left(ctx);
+
+    if (match_limit == 0) {
+        return;
+    }
+
+    /* Line numbers and bounds, for whichever of the steps below needs them. */
+    line_index_t lines;
+    line_index_init(&lines, buf, buf_len);
+
+    if (ctx->opts.invert_match) {
+        /* If we are going to invert the set of matches at the end, we will need
+         * one extra match struct, even if there are no matches at all. So make
+         * sure we have a nonempty array; and make sure we always have spare
+         * capacity for one extra.
+         */
+        matches_size = 100;
+        matches = ag_malloc(matches_size * sizeof(match_t));
+        matches_spare = 1;
+    } else {
+        matches_size = 0;
+        matches = NULL;
+        matches_spare = 0;
+    }
+
+    matches_len = find_matches(ctx, buf, buf_len, 0, &lines, &matches, &matches_size, matches_spare,
+                               file_match_limit(ctx, match_limit), dir_full_path);
+    if (ctx->opts.max_matches_per_file > 0 && matches_len >= ctx->opts.max_matches_per_file) {
+        log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+    }
+
+    if (ctx->opts.invert_match) {
+        matches_len = invert_matches(&lines, matches, matches_len);
+    }
 
-    if (opts.invert_match) {
-        matches_len = invert_matches(buf, buf_len, matches, matches_len);
+    if (matches_len > 0 && (ctx->max_matches > 0 || ctx->max_files > 0)) {
+        matches_len = take_budget(ctx, matches_len, TRUE);
     }
 
-    if (opts.stats) {
-        pthread_mutex_lock(&stats_mtx);
-        stats.total_bytes += buf_len;
-        stats.total_files++;
-        stats.total_matches += matches_len;
+    if (ctx->opts.stats) {
+        pthread_mutex_lock(&ctx->stats_mtx);
+        ctx->stats.total_bytes += buf_len;
+        ctx->stats.total_files++;
+        ctx->stats.total_matches += matches_len;
         if (matches_len > 0) {
-            stats.total_file_matches++;
+            ctx->stats.total_file_matches++;
         }
-        pthread_mutex_unlock(&stats_mtx);
+        pthread_mutex_unlock(&ctx->stats_mtx);
     }
 
-    if (matches_len > 0 || opts.print_all_paths) {
-        if (binary == -1 && !opts.print_filename_only) {
-            binary = is_binary((const void *)buf, buf_len);
+    if (matches_len > 0 || ctx->opts.print_all_paths) {
+        if (binary == -1 && !ctx->opts.print_filename_only) {
+            binary = is_binary((const void *)buf, buf_len, ctx->opts.binary_window);
         }
         if (!has_ag_init) {
             pthread_mutex_lock(&print_mtx);
         }
-        if (opts.print_filename_only) {
+        if (ctx->opts.print_filename_only) {
             /* If the --files-without-matches or -L option is passed we should
              * not print a matching line. This option currently sets
-             * opts.print_filename_only and opts.invert_match. Unfortunately
+             * ctx->opts.print_filename_only and ctx->opts.invert_match. Unfortunately
              * setting the latter has the side effect of making matches.len = 1
              * on a file-without-matches which is not desired behaviour. See
              * GitHub issue 206 for the consequences if this behaviour is not
              * checked. */
-            if (!opts.invert_match || matches_len < 2) {
-                if (opts.print_count) {
-                    print_path_count(dir_full_path, opts.path_sep, (size_t)matches_len);
+            if (!ctx->opts.invert_match || matches_len < 2) {
+                if (ctx->opts.print_count) {
+                    print_path_count(dir_full_path, ctx->opts.path_sep, (size_t)matches_len);
                 } else {
-                    print_path(dir_full_path, opts.path_sep);
+                    print_path(dir_full_path, ctx->opts.path_sep);
                 }
             }
         } else if (binary) {
             if (has_ag_init) {
-                add_local_result(worker_id, dir_full_path, matches,
-                    matches_len, buf, LIBAG_FLG_BINARY);
+                add_local_result(ctx, worker_id, dir_full_path, matches,
+                    matches_len, &lines, LIBAG_FLG_BINARY);
             } else {
                 print_binary_file_matches(dir_full_path);
             }
         } else {
             if (has_ag_init) {
-                add_local_result(worker_id, dir_full_path, matches,
-                    matches_len, buf, LIBAG_FLG_TEXT);
+                add_local_result(ctx, worker_id, dir_full_path, matches,
+                    matches_len, &lines, LIBAG_FLG_TEXT);
             } else {
-                print_file_matches(dir_full_path, buf, buf_len, matches, matches_len);
+                print_file_matches(dir_full_path, &lines, matches, matches_len);
             }
         }
         if (!has_ag_init) {
             pthread_mutex_unlock(&print_mtx);
         }
-        opts.match_found = 1;
-    } else if (opts.search_stream && opts.passthrough) {
+        ctx->opts.match_found = 1;
+    } else if (ctx->opts.search_stream && ctx->opts.passthrough) {
         fprintf(out_fd, "%s", buf);
     } else {
         log_debug("No match in %s", dir_full_path);
     }
 
-    if (matches_len == 0 && opts.search_stream) {
+    if (matches_len == 0 && ctx->opts.search_stream) {
         print_context_append(buf, buf_len - 1);
     }
 
-    if (matches_size > 0) {
-        free(matches);
+    if (matches_size > 0) {
+        free(matches);
+    }
+    line_index_free(&lines);
+}
+
+/* TODO: this will only match single lines. multi-line regexes silently don't match */
+void search_stream(search_ctx_t *ctx, int worker_id, FILE *stream, const char *path) {
+    char *line = NULL;
+    ssize_t line_len = 0;
+    size_t line_cap = 0;
+    size_t i;
+
+    print_init_context();
+
+    for (i = 1; (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
+        if (search_cancelled(ctx)) {
+            break;
+        }
+        opts.stream_line_num = i;
+        search_buf(ctx, worker_id, line, line_len, path, FALSE);
+        if (line[line_len - 1] == '\n') {
+            line_len--;
+        }
+        print_trailing_context(path, line, line_len);
+    }
+
+    free(line);
+    print_cleanup_context();
+}
+
+/*
+ * Buffer for the files we read() rather than mmap(), kept by each
+ * thread from one file to the next. Files of MMAP_MIN_SIZE and more,
+ * read only when mmap is disabled, get a buffer of their own.
+ */
+static __thread char *read_buf;
+static __thread size_t read_buf_size;
+
+/* A buffer for a file of len bytes, and a NUL after them. */
+static char *get_read_buf(const size_t len) {
+    if (len >= MMAP_MIN_SIZE) {
+        return ag_malloc(len + 1);
+    }
+    if (len + 1 > read_buf_size) {
+        free(read_buf);
+        read_buf_size = ag_max(len + 1, read_buf_size * 2);
+        read_buf_size = ag_min(read_buf_size, MMAP_MIN_SIZE);
+        read_buf = ag_malloc(read_buf_size);
+    }
+    return read_buf;
+}
+
+static void put_read_buf(char *buf) {
+    if (buf != read_buf) {
+        free(buf);
+    }
+}
+
+void search_thread_cleanup(void) {
+    free(read_buf);
+    read_buf = NULL;
+    read_buf_size = 0;
+}
+
+/* read() len bytes, or up to the end of the file; -1 on errors. */
+static ssize_t read_all(int fd, char *buf, const size_t len) {
+    size_t done = 0;
+    ssize_t rv;
+
+    while (done < len) {
+        rv = read(fd, buf + done, len - done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return -1;
+        }
+        if (rv == 0) {
+            break;
+        }
+        done += rv;
+    }
+    return done;
+}
+
+#ifndef _WIN32
+/* pread() len bytes at offset, or up to the end of the file; -1 on errors. */
+static ssize_t pread_all(int fd, char *buf, const size_t len, const off_t offset) {
+    size_t done = 0;
+    ssize_t rv;
+
+    while (done < len) {
+        rv = pread(fd, buf + done, len - done, offset + done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return -1;
+        }
+        if (rv == 0) {
+            break;
+        }
+        done += rv;
+    }
+    return done;
+}
+
+/*
+ * Where a part of a split file that is to start (or end) at pos really
+ * does: at the first line start at or past pos, or at pos itself if there
+ * is none in the SEARCH_CHUNK_OVERLAP bytes from there. The parts on both
+ * sides of pos work it out the same way. If lead_start is set, it gets
+ * where the lead of the part starts, as it would for a chunk: at the first
+ * line start in the SEARCH_CHUNK_OVERLAP bytes before the part. Returns -1
+ * on errors.
+ */
+static off_t part_boundary(int fd, const off_t pos, off_t *lead_start) {
+    const off_t from = pos > SEARCH_CHUNK_OVERLAP ? pos - 1 - SEARCH_CHUNK_OVERLAP : 0;
+    char *buf = ag_malloc(2 * SEARCH_CHUNK_OVERLAP + 1);
+    off_t boundary = pos;
+    const char *nl;
+    ssize_t len;
+    size_t at;
+
+    len = pread_all(fd, buf, 2 * SEARCH_CHUNK_OVERLAP + 1, from);
+    if (len < 0) {
+        free(buf);
+        return -1;
+    }
+
+    at = pos - 1 - from;
+    if ((size_t)len > at) {
+        nl = memchr(buf + at, '\n', ag_min(SEARCH_CHUNK_OVERLAP, len - at));
+        if (nl != NULL) {
+            boundary = from + (nl - buf) + 1;
+        }
+    }
+    if (lead_start != NULL) {
+        *lead_start = boundary > SEARCH_CHUNK_OVERLAP ? boundary : 0;
+        at = boundary - SEARCH_CHUNK_OVERLAP - from;
+        if (boundary > SEARCH_CHUNK_OVERLAP && (size_t)len > at) {
+            nl = memchr(buf + at, '\n', ag_min(SEARCH_CHUNK_OVERLAP, len - at));
+            if (nl != NULL) {
+                *lead_start = from + (nl - buf) + 1;
+            }
+        }
+    }
+    free(buf);
+    return boundary;
+}
+
+/*
+ * Searches a file larger than SEARCH_CHUNK_MIN, or a part of one, one chunk
+ * at a time, mapping (or, without mmap, reading) SEARCH_CHUNK bytes of it at
+ * once, laid out as:
+ *
+ *   | lead | chunk | overlap |
+ *
+ * Chunks start and end on line boundaries. Only the matches that start in
+ * the chunk are kept, but they are looked for over the overlap too, so that
+ * a match running past the end of the chunk is found whole (and the chunk
+ * then ends with the line the match ends on). The next chunk starts where
+ * this one ends, with the lines before it, up to SEARCH_CHUNK_OVERLAP bytes
+ * of them, kept as its lead: lookbehinds and context lines see them, and
+ * the matches of the next chunk are the ones a search of the whole file
+ * would find. Lines that do not fit in the overlap are split. A part starts
+ * with a lead too, and ends like a chunk.
+ *
+ * For a whole file, matches are printed chunk by chunk, with line numbers
+ * relative to the whole file, and compressed files are left to
+ * search_stream(): for these, nothing is searched and -1 is returned. For a
+ * part of a split file, they are kept in the part, see search_split().
+ */
+static int search_chunked(search_ctx_t *ctx, int worker_id, int fd, const off_t f_len, const char *path,
+                          split_file_t *split, file_part_t *part) {
+    const char *buf = NULL;
+    size_t buf_len = 0;    /* Bytes in buf */
+    char *read_chunk = NULL;
+    char *map = NULL;
+    size_t map_len = 0;
+    off_t map_offset;
+    off_t offset = 0;      /* Where buf starts in the file */
+    off_t start = 0;       /* Where the first chunk starts */
+    off_t end = f_len;     /* Where the last chunk ends */
+    size_t file_lines = 0; /* Lines before buf */
+    size_t end_lines = 0;  /* Lines before the end of the chunk */
+    size_t lead = 0;       /* Where the chunk starts in buf */
+    size_t chunk_end;
+    size_t search_len;
+    size_t to_read;
+    size_t keep_from;
+    size_t at;
+    size_t searched = 0;
+    size_t total = 0;      /* Matches kept so far */
+    size_t match_limit;
+    size_t matches_len;
+    size_t kept;
+    match_t *matches = NULL;
+    size_t matches_size = 0;
+    line_index_t lines;
+    line_index_t chunk_lines;
+    const char *nl;
+    ssize_t bytes_read;
+    int binary = 0;
+    int numbered = FALSE; /* Whether matches need line numbers */
+    int locked = FALSE;
+    int first = TRUE;
+    int at_eof = FALSE;
+    int last = FALSE;
+    int done = FALSE;
+    int rv = 0;
+    size_t i;
+
+    if (part != NULL) {
+        /* Told apart by search_split(), for all the parts at once. */
+        binary = split->binary;
+        numbered = has_ag_init;
+        if (part->start > 0) {
+            start = part_boundary(fd, part->start, &offset);
+        }
+        if (part->end < f_len) {
+            end = part_boundary(fd, part->end, NULL);
+        }
+        if (start < 0 || end < 0) {
+            log_err("Skipping part of %s: Error reading file: %s", path, strerror(errno));
+            return 0;
+        }
+        lead = start - offset;
+    }
+
+    if (!ctx->opts.mmap) {
+        read_chunk = ag_malloc(SEARCH_CHUNK + 1);
+        buf = read_chunk;
+#if HAVE_POSIX_FADVISE
+        posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    while (!last && !done && !search_cancelled(ctx)) {
+        /* -l: one part with matches is enough. */
+        if (split != NULL && !has_ag_init && !ctx->opts.print_count &&
+            __atomic_load_n(&split->found, __ATOMIC_RELAXED)) {
+            break;
+        }
+
+        if (ctx->opts.mmap) {
+            /* Map the next SEARCH_CHUNK bytes, from the page the lead starts on. */
+            if (map != NULL) {
+                munmap(map, map_len);
+            }
+            map_offset = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+            map_len = ag_min(SEARCH_CHUNK + (offset - map_offset), f_len - map_offset);
+            map = mmap(0, map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
+            if (map == MAP_FAILED) {
+                map = NULL;
+                log_err("Skipping the rest of %s: failed to load: %s.", path, strerror(errno));
+                break;
+            }
+#if HAVE_MADVISE
+            madvise(map, map_len, MADV_SEQUENTIAL);
+#endif
+            buf = map + (offset - map_offset);
+            buf_len = map_len - (offset - map_offset);
+            at_eof = offset + (off_t)buf_len >= f_len;
+        } else {
+            /* The file may have changed since fstat(): stop at whichever end comes first. */
+            to_read = ag_min(SEARCH_CHUNK - buf_len, f_len - offset - buf_len);
+            bytes_read = pread_all(fd, read_chunk + buf_len, to_read, offset + buf_len);
+            if (bytes_read < 0) {
+                log_err("Skipping the rest of %s: Error reading file: %s", path, strerror(errno));
+                break;
+            }
+            buf_len += bytes_read;
+            read_chunk[buf_len] = '\0';
+            at_eof = (size_t)bytes_read < to_read || offset + (off_t)buf_len >= f_len;
+        }
+        /* A part ends once its matches can no longer run past what is loaded. */
+        last = at_eof || offset + (off_t)buf_len >= end + SEARCH_CHUNK_OVERLAP;
+
+        if (part == NULL && offset == 0) {
+            if (ctx->opts.search_zip_files && is_zipped(buf, buf_len) != AG_NO_COMPRESSION) {
+                rv = -1;
+                goto cleanup;
+            }
+            binary = is_binary((const void *)buf, buf_len, ctx->opts.binary_window);
+            if (binary && !ctx->opts.search_binary_files) {
+                log_debug("File %s is binary. Skipping...", path);
+                goto cleanup;
+            }
+            numbered = !ctx->opts.print_filename_only && !binary;
+        }
+
+        /* Matches are looked for up to the last newline, and the chunk ends
+         * on the last one at least SEARCH_CHUNK_OVERLAP bytes before it. */
+        search_len = buf_len;
+        if (!at_eof) {
+            nl = memrchr(buf + lead, '\n', buf_len - lead);
+            if (nl != NULL) {
+                search_len = nl - buf + 1;
+            }
+        }
+        if (last) {
+            chunk_end = ag_min(buf_len, (size_t)(end - offset));
+            if (search_len < chunk_end) {
+                /* The part ends within a line longer than the overlap. */
+                search_len = buf_len;
+            }
+        } else {
+            nl = NULL;
+            if (search_len - lead > SEARCH_CHUNK_OVERLAP) {
+                nl = memrchr(buf + lead, '\n', search_len - SEARCH_CHUNK_OVERLAP - lead);
+            }
+            if (nl != NULL) {
+                chunk_end = nl - buf + 1;
+            } else {
+                log_debug("%s: line too long for a chunk, splitting it.", path);
+                search_len = buf_len;
+                chunk_end = buf_len - SEARCH_CHUNK_OVERLAP;
+            }
+        }
+
+        match_limit = matches_left(ctx);
+        if (ctx->opts.max_matches_per_file > 0) {
+            match_limit = ag_min(match_limit, ctx->opts.max_matches_per_file - total);
+        }
+        if (match_limit == 0) {
+            break;
+        }
+
+        line_index_init(&lines, buf, search_len);
+        lines.file_offset = offset;
+        lines.file_lines = file_lines;
+
+        matches_len = find_matches(ctx, buf, search_len, lead, &lines, &matches, &matches_size, 0, match_limit, path);
+
+        if (part != NULL && numbered) {
+            if (first) {
+                part->lead_lines = line_index_number(&lines, lead) - 1;
+            }
+            if (last) {
+                part->lines = line_index_number(&lines, chunk_end) - 1 - part->lead_lines;
+            }
+        }
+
+        /* Past the end of the file, matches (e.g. of $) belong to its last chunk. */
+        for (kept = 0; kept < matches_len && ((at_eof && chunk_end == buf_len) || matches[kept].start < chunk_end);
+             kept++) {
+            if (matches[kept].end < chunk_end) {
+                continue;
+            }
+            /* The chunk goes on to the end of the line of the last byte of the match, or, when
+             * printing, of the line after it if that byte is a newline: printing takes it too. */
+            at = matches[kept].end;
+            if (part != NULL && at > matches[kept].start) {
+                at--;
+            }
+            nl = memchr(buf + at, '\n', search_len - at);
+            chunk_end = nl != NULL ? (size_t)(nl - buf) + 1 : search_len;
+        }
+        /* Every match of the chunk was found, unless the limit stopped the search. */
+        if (kept > 0 && kept == match_limit) {
+            done = TRUE;
+            if (ctx->opts.max_matches_per_file > 0 && total + kept >= ctx->opts.max_matches_per_file) {
+                log_err("Too many matches in %s. Skipping the rest of this file.", path);
+            }
+        }
+        if (kept > 0 && (ctx->max_matches > 0 || ctx->max_files > 0)) {
+            i = take_budget(ctx, kept, total == 0);
+            if (i < kept) {
+                kept = i;
+                done = TRUE;
+            }
+        }
+        total += kept;
+        searched += chunk_end - lead;
+
+        if (part == NULL && kept > 0 && !locked) {
+            pthread_mutex_lock(&print_mtx);
+            locked = TRUE;
+        }
+        if (part != NULL) {
+            if (kept > 0) {
+                __atomic_store_n(&split->found, TRUE, __ATOMIC_RELAXED);
+            }
+            if (has_ag_init) {
+                add_part_result(ctx, worker_id, part, path, matches, kept, &lines,
+                    binary ? LIBAG_FLG_BINARY : LIBAG_FLG_TEXT);
+            }
+            if (numbered) {
+                end_lines = line_index_number(&lines, chunk_end) - 1;
+            }
+        } else if (binary) {
+            if (kept > 0) {
+                print_binary_file_matches(path);
+                done = TRUE;
+            }
+        } else {
+            /* Printed without the lead and the overlap, which belong to the chunks around. */
+            for (i = 0; i < kept; i++) {
+                matches[i].start -= lead;
+                matches[i].end -= lead;
+            }
+            line_index_init(&chunk_lines, buf + lead, chunk_end - lead);
+            chunk_lines.file_lines = line_index_number(&lines, lead) - 1;
+            print_chunk_matches(path, &chunk_lines, matches, kept, last);
+            end_lines = line_index_number(&chunk_lines, chunk_end - lead) - 1;
+            line_index_free(&chunk_lines);
+        }
+        line_index_free(&lines);
+
+        if (last || done) {
+            if (part != NULL) {
+                part->complete = last && !done;
+            }
+            break;
+        }
+        /* Keep the lines before the next chunk as its lead. */
+        keep_from = 0;
+        if (chunk_end > SEARCH_CHUNK_OVERLAP) {
+            nl = memchr(buf + chunk_end - SEARCH_CHUNK_OVERLAP, '\n', SEARCH_CHUNK_OVERLAP);
+            keep_from = nl != NULL ? (size_t)(nl - buf) + 1 : chunk_end;
+        }
+        if (numbered) {
+            file_lines = end_lines - simd_count(buf + keep_from, chunk_end - keep_from, '\n');
+        }
+        offset += keep_from;
+        buf_len -= keep_from;
+        if (read_chunk != NULL) {
+            memmove(read_chunk, read_chunk + keep_from, buf_len);
+        }
+        lead = chunk_end - keep_from;
+        first = FALSE;
+    }
+
+    if (part != NULL) {
+        /* Accounted for, and printed, once all the parts are searched. */
+        part->matches = total;
+        part->searched = searched;
+        goto cleanup;
+    }
+
+    if (total > 0) {
+        ctx->opts.match_found = 1;
+    } else {
+        log_debug("No match in %s", path);
+    }
+
+    if (ctx->opts.stats) {
+        pthread_mutex_lock(&ctx->stats_mtx);
+        ctx->stats.total_bytes += searched;
+        ctx->stats.total_files++;
+        ctx->stats.total_matches += total;
+        if (total > 0) {
+            ctx->stats.total_file_matches++;
+        }
+        pthread_mutex_unlock(&ctx->stats_mtx);
+    }
+
+cleanup:
+    if (locked) {
+        pthread_mutex_unlock(&print_mtx);
+    }
+    if (map != NULL) {
+        munmap(map, map_len);
+    }
+    free(read_chunk);
+    free(matches);
+    return rv;
+}
+
+/* Accounts for a split file once all its parts are searched, and hands over its matches. */
+static void finish_split(search_ctx_t *ctx, int worker_id, split_file_t *split) {
+    size_t total = 0;
+    size_t searched = 0;
+    size_t i;
+
+    for (i = 0; i < split->parts_len; i++) {
+        total += split->parts[i].matches;
+        searched += split->parts[i].searched;
+    }
+
+    if (has_ag_init) {
+        add_split_result(ctx, worker_id, split);
+    } else if (total > 0) {
+        pthread_mutex_lock(&print_mtx);
+        if (ctx->opts.print_count) {
+            print_path_count(split->path, ctx->opts.path_sep, total);
+        } else {
+            print_path(split->path, ctx->opts.path_sep);
+        }
+        pthread_mutex_unlock(&print_mtx);
+    }
+
+    if (total > 0) {
+        ctx->opts.match_found = 1;
+    } else {
+        log_debug("No match in %s", split->path);
+    }
+
+    if (ctx->opts.stats) {
+        pthread_mutex_lock(&ctx->stats_mtx);
+        ctx->stats.total_bytes += searched;
+        ctx->stats.total_files++;
+        ctx->stats.total_matches += total;
+        if (total > 0) {
+            ctx->stats.total_file_matches++;
+        }
+        pthread_mutex_unlock(&ctx->stats_mtx);
+    }
+
+    close(split->fd);
+    free(split->path);
+    free(split);
+}
+
+/* Searches a part of a split file. Whichever worker searches the last one left finishes the file. */
+static void search_part(search_ctx_t *ctx, int worker_id, split_file_t *split, size_t part) {
+    /* A stopped search only drains its queue. */
+    if (!search_cancelled(ctx)) {
+        search_chunked(ctx, worker_id, split->fd, split->f_len, split->path, split, &split->parts[part]);
+    }
+    if (__atomic_sub_fetch(&split->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        finish_split(ctx, worker_id, split);
+    }
+}
+
+/*
+ * Searches a file larger than SEARCH_CHUNK_MIN whose matches are not
+ * printed as they are found: for libag, or for -l and -c. With more than
+ * one worker, the file is split into parts of SEARCH_PART bytes, and all
+ * but the first go to the worker's deque, as work items of their own, for
+ * idle workers to steal; the first one is searched right away. The matches
+ * of every part are then handed over as a single file's, see
+ * finish_split(). The split file takes over *fd. Compressed files are left
+ * to search_stream(): for these, nothing is searched and -1 is returned.
+ */
+static int search_split(search_ctx_t *ctx, int worker_id, int *fd, const off_t f_len, const char *path) {
+    work_batch_t batch = { NULL, NULL, 0 };
+    work_queue_t *queue_item;
+    split_file_t *split;
+    size_t parts_len = 1;
+    size_t head_len;
+    ssize_t bytes_read;
+    char *head;
+    int binary;
+    size_t i;
+
+    /* Compressed and binary files are told apart by their first bytes, once for all the parts. */
+    head_len = ag_min(ag_max(ctx->opts.binary_window, 64), SEARCH_CHUNK);
+    head = ag_malloc(head_len);
+    bytes_read = pread_all(*fd, head, head_len, 0);
+    if (bytes_read < 0) {
+        log_err("Skipping %s: Error reading file: %s", path, strerror(errno));
+        free(head);
+        return 0;
+    }
+    if (ctx->opts.search_zip_files && is_zipped(head, bytes_read) != AG_NO_COMPRESSION) {
+        free(head);
+        return -1;
+    }
+    binary = is_binary((const void *)head, bytes_read, ctx->opts.binary_window);
+    free(head);
+    if (binary && !ctx->opts.search_binary_files) {
+        log_debug("File %s is binary. Skipping...", path);
+        return 0;
+    }
+
+    /* Per-file limits are easier kept by a single worker. */
+    if (pool_workers > 1 && ctx->max_files == 0 && ctx->opts.max_matches_per_file == 0) {
+        parts_len = ((uintmax_t)f_len + SEARCH_PART - 1) / SEARCH_PART;
     }
-}
-
-/* TODO: this will only match single lines. multi-line regexes silently don't match */
-void search_stream(int worker_id, FILE *stream, const char *path) {
-    char *line = NULL;
-    ssize_t line_len = 0;
-    size_t line_cap = 0;
-    size_t i;
-
-    print_init_context();
 
-    for (i = 1; (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
-        opts.stream_line_num = i;
-        search_buf(worker_id, line, line_len, path);
-        if (line[line_len - 1] == '\n') {
-            line_len--;
+    split = ag_calloc(1, sizeof(split_file_t) + parts_len * sizeof(file_part_t));
+    split->path = ag_strdup(path);
+    split->fd = *fd;
+    split->f_len = f_len;
+    split->binary = binary;
+    split->pending = parts_len;
+    split->parts_len = parts_len;
+    for (i = 0; i < parts_len; i++) {
+        split->parts[i].start = (off_t)i * SEARCH_PART;
+        split->parts[i].end = i + 1 < parts_len ? (off_t)(i + 1) * SEARCH_PART : f_len;
+    }
+    *fd = -1;
+    log_debug("Searching %s in %zu parts", path, parts_len);
+
+    for (i = 1; i < parts_len; i++) {
+        queue_item = ag_malloc(sizeof(work_queue_t));
+        queue_item->path = NULL;
+        queue_item->hint.type = 0;
+        queue_item->hint.dev = 0;
+        queue_item->dir = NULL;
+        queue_item->split = split;
+        queue_item->part = i;
+        queue_item->ctx = ctx;
+        queue_item->next = NULL;
+        if (batch.tail == NULL) {
+            batch.head = queue_item;
+        } else {
+            batch.tail->next = queue_item;
         }
-        print_trailing_context(path, line, line_len);
+        batch.tail = queue_item;
+        batch.len++;
     }
+    flush_work_items(ctx, worker_id, &batch);
 
-    free(line);
-    print_cleanup_context();
+    search_part(ctx, worker_id, split, 0);
+    return 0;
 }
+#endif
 
-void search_file(int worker_id, const char *file_full_path) {
+/*
+ * Searches a file. If the walker already saw it as a regular file (see
+ * file_hint_t), it is opened right away and checked once open, for a single
+ * fstat(); otherwise it is stat()ed first, so that we neither open devices
+ * nor wait on FIFOs.
+ */
+void search_file(search_ctx_t *ctx, int worker_id, const char *file_full_path, const file_hint_t *hint) {
     int fd = -1;
     off_t f_len = 0;
     char *buf = NULL;
     struct stat statbuf;
     int rv = 0;
+    int mapped = FALSE;
+    int binary_checked = FALSE;
+    int regular = hint != NULL && S_ISREG(hint->type);
     FILE *fp = NULL;
 
-    rv = stat(file_full_path, &statbuf);
-    if (rv != 0) {
-        log_err("Skipping %s: Error fstat()ing file.", file_full_path);
-        goto cleanup;
-    }
+    if (!regular) {
+        rv = stat(file_full_path, &statbuf);
+        if (rv != 0) {
+            log_err("Skipping %s: Error fstat()ing file.", file_full_path);
+            goto cleanup;
+        }
 
-    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
-        log_debug("Skipping %s: stdout is redirected to it", file_full_path);
-        goto cleanup;
-    }
+        if (ctx->opts.stdout_inode != 0 && ctx->opts.stdout_inode == statbuf.st_ino) {
+            log_debug("Skipping %s: stdout is redirected to it", file_full_path);
+            goto cleanup;
+        }
 
-    // handling only regular files and FIFOs
-    if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
-        log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
-        goto cleanup;
+        // handling only regular files and FIFOs
+        if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
+            log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
+            goto cleanup;
+        }
     }
 
-    fd = open(file_full_path, O_RDONLY);
+    /* Should it have become a FIFO since it was listed, do not wait for a writer. */
+    fd = open(file_full_path, regular ? O_RDONLY | O_NONBLOCK : O_RDONLY);
     if (fd < 0) {
         /* XXXX: strerror is not thread-safe */
         log_err("Skipping %s: Error opening file: %s", file_full_path, strerror(errno));
@@ -310,7 +1161,7 @@ void search_file(int worker_id, const char *file_full_path) {
         goto cleanup;
     }
 
-    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
+    if (ctx->opts.stdout_inode != 0 && ctx->opts.stdout_inode == statbuf.st_ino) {
         log_debug("Skipping %s: stdout is redirected to it", file_full_path);
         goto cleanup;
     }
@@ -321,12 +1172,20 @@ void search_file(int worker_id, const char *file_full_path) {
         goto cleanup;
     }
 
+    if (hint != NULL && hint->dev != 0 && statbuf.st_dev != hint->dev) {
+        log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", file_full_path);
+        goto cleanup;
+    }
+
     print_init_context();
 
     if (statbuf.st_mode & S_IFIFO) {
         log_debug("%s is a named pipe. stream searching", file_full_path);
+        if (regular) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        }
         fp = fdopen(fd, "r");
-        search_stream(worker_id, fp, file_full_path);
+        search_stream(ctx, worker_id, fp, file_full_path);
         fclose(fp);
         goto cleanup;
     }
@@ -334,16 +1193,28 @@ void search_file(int worker_id, const char *file_full_path) {
     f_len = statbuf.st_size;
 
     if (f_len == 0) {
-        if (opts.query[0] == '.' && opts.query_len == 1 && !opts.literal && opts.search_all_files) {
-            search_buf(worker_id, buf, f_len, file_full_path);
+        if (ctx->opts.query[0] == '.' && ctx->opts.query_len == 1 && !ctx->opts.literal && ctx->opts.search_all_files) {
+            search_buf(ctx, worker_id, buf, f_len, file_full_path, FALSE);
         } else {
             log_debug("Skipping %s: file is empty.", file_full_path);
         }
         goto cleanup;
     }
 
-    if (!opts.literal && f_len > INT_MAX) {
-        log_err("Skipping %s: pcre_exec() can't handle files larger than %i bytes.", file_full_path, INT_MAX);
+#ifndef _WIN32
+    if ((uintmax_t)f_len > SEARCH_CHUNK_MIN && !ctx->opts.invert_match && !ctx->opts.print_all_paths) {
+        if (has_ag_init || ctx->opts.print_filename_only) {
+            if (search_split(ctx, worker_id, &fd, f_len, file_full_path) == 0) {
+                goto cleanup;
+            }
+        } else if (search_chunked(ctx, worker_id, fd, f_len, file_full_path, NULL, NULL) == 0) {
+            goto cleanup;
+        }
+    }
+#endif
+
+    if (!ctx->opts.literal && !ctx->dfa && (uintmax_t)f_len > RE_MAX_SUBJECT) {
+        log_err("Skipping %s: PCRE can't handle files larger than %ju bytes.", file_full_path, (uintmax_t)RE_MAX_SUBJECT);
         goto cleanup;
     }
 
@@ -367,47 +1238,59 @@ void search_file(int worker_id, const char *file_full_path) {
     }
 #else
 
-    if (opts.mmap) {
+    if (ctx->opts.mmap && f_len >= MMAP_MIN_SIZE) {
         buf = mmap(0, f_len, PROT_READ, MAP_PRIVATE, fd, 0);
         if (buf == MAP_FAILED) {
             log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
             goto cleanup;
         }
+        mapped = TRUE;
 #if HAVE_MADVISE
         madvise(buf, f_len, MADV_SEQUENTIAL);
 #elif HAVE_POSIX_FADVISE
         posix_fadvise(fd, 0, f_len, POSIX_MADV_SEQUENTIAL);
 #endif
     } else {
-        buf = ag_malloc(f_len);
+        buf = get_read_buf(f_len);
 
         ssize_t bytes_read = 0;
 
-        if (!opts.search_binary_files) {
-            bytes_read += read(fd, buf, ag_min(f_len, 512));
+        /* Compressed files look binary: leave them to is_zipped() below. */
+        if (!ctx->opts.search_binary_files && !ctx->opts.search_zip_files) {
+            bytes_read = read_all(fd, buf, ag_min(f_len, ctx->opts.binary_window));
             // Optimization: If skipping binary files, don't read the whole buffer before checking if binary or not.
-            if (is_binary(buf, f_len)) {
+            if (bytes_read >= 0 && is_binary(buf, bytes_read, ctx->opts.binary_window)) {
                 log_debug("File %s is binary. Skipping...", file_full_path);
                 goto cleanup;
             }
+            binary_checked = TRUE;
         }
 
-        while (bytes_read < f_len) {
-            bytes_read += read(fd, buf + bytes_read, f_len);
+        if (bytes_read >= 0) {
+            ssize_t rest = read_all(fd, buf + bytes_read, f_len - bytes_read);
+            bytes_read = rest < 0 ? rest : bytes_read + rest;
         }
-        if (bytes_read != f_len) {
-            die("File %s read(): expected to read %u bytes but read %u", file_full_path, f_len, bytes_read);
+        if (bytes_read < 0) {
+            log_err("Skipping %s: Error reading file: %s", file_full_path, strerror(errno));
+            goto cleanup;
         }
+        /* The file may have shrunk since fstat(). */
+        f_len = bytes_read;
+        buf[f_len] = '\0';
     }
 #endif
 
-    if (opts.search_zip_files) {
+    if (ctx->opts.search_zip_files) {
         ag_compression_type zip_type = is_zipped(buf, f_len);
         if (zip_type != AG_NO_COMPRESSION) {
 #if HAVE_FOPENCOOKIE
             log_debug("%s is a compressed file. stream searching", file_full_path);
+            /* Reading the file left us at its end. */
+            if (!mapped) {
+                lseek(fd, 0, SEEK_SET);
+            }
             fp = decompress_open(fd, "r", zip_type);
-            search_stream(worker_id, fp, file_full_path);
+            search_stream(ctx, worker_id, fp, file_full_path);
             fclose(fp);
 #else
             int _buf_len = (int)f_len;
@@ -416,14 +1299,14 @@ void search_file(int worker_id, const char *file_full_path) {
                 log_err("Cannot decompress zipped file %s", file_full_path);
                 goto cleanup;
             }
-            search_buf(worker_id, _buf, _buf_len, file_full_path);
+            search_buf(ctx, worker_id, _buf, _buf_len, file_full_path, FALSE);
             free(_buf);
 #endif
             goto cleanup;
         }
     }
 
-    search_buf(worker_id, buf, f_len, file_full_path);
+    search_buf(ctx, worker_id, buf, f_len, file_full_path, binary_checked);
 
 cleanup:
 
@@ -432,12 +1315,10 @@ cleanup:
 #ifdef _WIN32
         UnmapViewOfFile(buf);
 #else
-        if (opts.mmap) {
-            if (buf != MAP_FAILED) {
-                munmap(buf, f_len);
-            }
+        if (mapped) {
+            munmap(buf, f_len);
         } else {
-            free(buf);
+            put_read_buf(buf);
         }
 #endif
     }
@@ -446,97 +1327,455 @@ cleanup:
     }
 }
 
-void *search_file_worker(void *i) {
+int init_work_queues(int workers_len, int use_work_stealing) {
+    int i;
+
+    work_stealing = use_work_stealing;
+    idle_workers = 0;
+    pool_workers = workers_len;
+    if (!work_stealing) {
+        return 0;
+    }
+
+    worker_deques = calloc(workers_len, sizeof(work_deque_t));
+    if (worker_deques == NULL) {
+        return -1;
+    }
+    for (i = 0; i < workers_len; i++) {
+        deque_init(&worker_deques[i]);
+    }
+    deques_len = workers_len;
+    return 0;
+}
+
+void cleanup_work_queues(void) {
+    free(worker_deques);
+    worker_deques = NULL;
+    deques_len = 0;
+}
+
+static void wake_idle_worker(void);
+static void walk_dir(search_ctx_t *ctx, int worker_id, walk_dir_t *cur_dir);
+static void release_walk_dir(walk_dir_t *dir);
+
+/* Must be called with work_queue_mtx held. */
+static void add_active_search(search_ctx_t *ctx) {
+    ctx->active = TRUE;
+    ctx->next_active = NULL;
+    if (active_searches_tail == NULL) {
+        __atomic_store_n(&active_searches, ctx, __ATOMIC_RELAXED);
+    } else {
+        active_searches_tail->next_active = ctx;
+    }
+    active_searches_tail = ctx;
+}
+
+void flush_work_items(search_ctx_t *ctx, int worker_id, work_batch_t *batch) {
     work_queue_t *queue_item;
-    int worker_id = *(int *)i;
 
-    log_debug("Worker %i started", worker_id);
+    if (batch->len == 0) {
+        return;
+    }
+
+    /* Account for the items before any worker can see them. */
+    __atomic_add_fetch(&ctx->pending_items, batch->len, __ATOMIC_SEQ_CST);
+
+    /* A worker keeps what it finds in its own deque, for idle workers
+     * to steal; whatever does not fit goes to the shared queue. */
+    if (work_stealing && worker_id < deques_len) {
+        while (batch->head != NULL) {
+            queue_item = batch->head;
+            batch->head = queue_item->next;
+            if (deque_push(&worker_deques[worker_id], queue_item)) {
+                batch->head = queue_item;
+                break;
+            }
+        }
+        wake_idle_worker();
+        if (batch->head == NULL) {
+            goto flushed;
+        }
+    }
+
+    pthread_mutex_lock(&work_queue_mtx);
+    if (ctx->work_queue_tail == NULL) {
+        ctx->work_queue = batch->head;
+    } else {
+        ctx->work_queue_tail->next = batch->head;
+    }
+    ctx->work_queue_tail = batch->tail;
+
+    if (!ctx->active) {
+        add_active_search(ctx);
+    }
+    pthread_cond_signal(&files_ready);
+    pthread_mutex_unlock(&work_queue_mtx);
+
+flushed:
+    batch->head = NULL;
+    batch->tail = NULL;
+    batch->len = 0;
+}
+
+/*
+ * Queue a file to be searched, or a directory to be walked. With work
+ * stealing, items are handed over WORK_BATCH at a time, so the walker
+ * takes the lock once per batch instead of once per file; the legacy
+ * queue hands them one by one. The caller flushes what is left.
+ */
+void queue_work_item(search_ctx_t *ctx, int worker_id, work_batch_t *batch, char *path, walk_dir_t *dir,
+                     const file_hint_t *hint) {
+    work_queue_t *queue_item = ag_malloc(sizeof(work_queue_t));
+    queue_item->path = path;
+    queue_item->hint.type = hint ? hint->type : 0;
+    queue_item->hint.dev = hint ? hint->dev : 0;
+    queue_item->dir = dir;
+    queue_item->split = NULL;
+    queue_item->part = 0;
+    queue_item->ctx = ctx;
+    queue_item->next = NULL;
+    log_debug("%s added to work queue", path);
+
+    if (batch->tail == NULL) {
+        batch->head = queue_item;
+    } else {
+        batch->tail->next = queue_item;
+    }
+    batch->tail = queue_item;
+    batch->len++;
+
+    if (!work_stealing || batch->len >= WORK_BATCH) {
+        flush_work_items(ctx, worker_id, batch);
+    }
+}
+
+/* Wait until every file queued by this search has been searched. */
+void wait_search_done(search_ctx_t *ctx) {
+    pthread_mutex_lock(&work_queue_mtx);
+    ctx->done_adding_files = TRUE;
+    while (__atomic_load_n(&ctx->pending_items, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_wait(&ctx->search_done, &work_queue_mtx);
+    }
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+/*
+ * Account for a searched file. Only the last file of a search takes
+ * the lock: once pending_items reaches zero the search may return and
+ * free its context, so that must happen while we hold work_queue_mtx.
+ */
+static void work_item_done(search_ctx_t *ctx) {
+    size_t pending = __atomic_load_n(&ctx->pending_items, __ATOMIC_RELAXED);
+
+    while (pending > 1) {
+        if (__atomic_compare_exchange_n(&ctx->pending_items, &pending, pending - 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&work_queue_mtx);
+    if (__atomic_sub_fetch(&ctx->pending_items, 1, __ATOMIC_SEQ_CST) == 0 && ctx->done_adding_files) {
+        pthread_cond_broadcast(&ctx->search_done);
+    }
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+/* Wake a sleeping worker, if any, because there is work to steal. */
+static void wake_idle_worker(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&work_queue_mtx);
+        pthread_cond_signal(&files_ready);
+        pthread_mutex_unlock(&work_queue_mtx);
+    }
+}
+
+/* Whether any worker deque still holds files. */
+static int deques_have_work(void) {
+    int i;
+    for (i = 0; i < deques_len; i++) {
+        if (deque_size(&worker_deques[i]) > 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static work_queue_t *steal_work_item(int worker_id) {
+    work_queue_t *queue_item;
+    int victim;
+    int i;
+
+    for (i = 1; i < deques_len; i++) {
+        victim = (worker_id + i) % deques_len;
+        queue_item = deque_steal(&worker_deques[victim]);
+        if (queue_item != NULL) {
+            if (deque_size(&worker_deques[victim]) > 0) {
+                wake_idle_worker();
+            }
+            return queue_item;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take files from the first active search and move that search to the
+ * end of the list, so that concurrent searches interleave instead of
+ * waiting for each other. With work stealing, up to WORK_BATCH files
+ * are moved into the room left in the worker's deque, where idle
+ * workers can steal them. Must be called with work_queue_mtx held.
+ */
+static work_queue_t *take_shared_work(int worker_id) {
+    work_queue_t *queue_item;
+    work_queue_t *extra;
+    search_ctx_t *ctx;
+    long room;
+    int taken;
+
+    ctx = active_searches;
+    __atomic_store_n(&active_searches, ctx->next_active, __ATOMIC_RELAXED);
+    if (active_searches == NULL) {
+        active_searches_tail = NULL;
+    }
+
+    queue_item = ctx->work_queue;
+    ctx->work_queue = queue_item->next;
+    if (work_stealing) {
+        room = deque_room(&worker_deques[worker_id]);
+        for (taken = 1; taken < WORK_BATCH && taken <= room && ctx->work_queue != NULL; taken++) {
+            extra = ctx->work_queue;
+            ctx->work_queue = extra->next;
+            deque_push(&worker_deques[worker_id], extra);
+        }
+    }
+
+    if (ctx->work_queue == NULL) {
+        ctx->work_queue_tail = NULL;
+        ctx->active = FALSE;
+    } else {
+        add_active_search(ctx);
+    }
+
+    if (work_stealing && __atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0 &&
+        (active_searches != NULL || deque_size(&worker_deques[worker_id]) > 0)) {
+        pthread_cond_signal(&files_ready);
+    }
+    return queue_item;
+}
+
+/*
+ * Next file for a worker: its own deque first, then the shared queue,
+ * then the other workers' deques. Sleeps while there is nothing to do
+ * and returns NULL once the workers are stopped.
+ */
+static work_queue_t *next_work_item(int worker_id) {
+    work_queue_t *queue_item;
 
-loop:
     while (TRUE) {
+        if (work_stealing) {
+            queue_item = deque_take(&worker_deques[worker_id]);
+            if (queue_item == NULL && __atomic_load_n(&active_searches, __ATOMIC_RELAXED) == NULL) {
+                queue_item = steal_work_item(worker_id);
+            }
+            if (queue_item != NULL) {
+                return queue_item;
+            }
+        }
+
         pthread_mutex_lock(&work_queue_mtx);
-        while (work_queue == NULL) {
-            if (done_adding_files) {
+        if (active_searches != NULL) {
+            queue_item = take_shared_work(worker_id);
+            pthread_mutex_unlock(&work_queue_mtx);
+            return queue_item;
+        }
+
+        /* Announce ourselves before looking at the deques one last
+         * time, so that a worker filling its deque sees us asleep. */
+        __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!deques_have_work()) {
+            if (stop_workers) {
+                __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
                 pthread_mutex_unlock(&work_queue_mtx);
-                log_debug("Worker %i done, restarting again...", worker_id);
-                if (has_ag_init) {
-                    if (stop_workers)
-                        return (NULL);
-
-                    /* Signals that my work is done and wait for the master. */
-                    pthread_barrier_wait(&worker_done);
-                    pthread_barrier_wait(&results_done);
-                    goto loop;
-                } else {
-                    return (NULL);
-                }
+                return NULL;
             }
             pthread_cond_wait(&files_ready, &work_queue_mtx);
         }
-        queue_item = work_queue;
-        work_queue = work_queue->next;
-        if (work_queue == NULL) {
-            work_queue_tail = NULL;
-        }
+        __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
         pthread_mutex_unlock(&work_queue_mtx);
+    }
+}
 
-        search_file(worker_id, queue_item->path);
+/* Walk a directory or search a file, and account for it. */
+static void run_work_item(int worker_id, work_queue_t *queue_item) {
+    /* A stopped search only drains its queue. */
+    int cancelled = search_cancelled(queue_item->ctx);
+
+    if (queue_item->dir != NULL) {
+        if (!cancelled) {
+            walk_dir(queue_item->ctx, worker_id, queue_item->dir);
+        }
+        release_walk_dir(queue_item->dir);
+    } else if (queue_item->split != NULL) {
+        search_part(queue_item->ctx, worker_id, queue_item->split, queue_item->part);
+    } else {
+        if (!cancelled) {
+            search_file(queue_item->ctx, worker_id, queue_item->path, &queue_item->hint);
+        }
         free(queue_item->path);
-        free(queue_item);
     }
+    work_item_done(queue_item->ctx);
+    free(queue_item);
 }
 
-static int check_symloop_enter(const char *path, dirkey_t *outkey) {
-#ifdef _WIN32
-    return SYMLOOP_OK;
-#else
-    struct stat buf;
-    symdir_t *item_found = NULL;
-    symdir_t *new_item = NULL;
+static int uses_uring(const work_queue_t *queue_item) {
+    /* Compressed files are read through their descriptor. */
+    return queue_item->dir == NULL && queue_item->split == NULL && queue_item->ctx->opts.io_uring && !queue_item->ctx->opts.search_zip_files;
+}
 
-    memset(outkey, 0, sizeof(dirkey_t));
-    outkey->dev = 0;
-    outkey->ino = 0;
+/*
+ * Search the file of queue_item and, with it, as many files as the
+ * worker's own deque holds (up to URING_BATCH), all loaded with a few
+ * io_uring calls. Files io_uring did not load go through search_file().
+ * Returns the item that ended the batch (a directory, or a file of a
+ * search without io_uring), for the caller to run, or NULL. Sets
+ * *ring_failed should the ring stop working.
+ */
+static work_queue_t *search_files_uring(uring_t *ring, int *ring_failed, int worker_id, work_queue_t *queue_item) {
+    work_queue_t *batch[URING_BATCH];
+    uring_file_t files[URING_BATCH];
+    uring_file_t *file_of[URING_BATCH];
+    work_queue_t *next = NULL;
+    size_t batch_len = 0;
+    size_t files_len = 0;
+    size_t i;
 
-    int res = stat(path, &buf);
-    if (res != 0) {
-        log_err("Error stat()ing: %s", path);
-        return SYMLOOP_ERROR;
+    batch[batch_len++] = queue_item;
+    while (work_stealing && batch_len < URING_BATCH) {
+        next = deque_take(&worker_deques[worker_id]);
+        if (next == NULL || !uses_uring(next)) {
+            break;
+        }
+        batch[batch_len++] = next;
+        next = NULL;
+    }
+
+    /* A stopped search only drains its queue. */
+    for (i = 0; i < batch_len; i++) {
+        file_of[i] = NULL;
+        if (!search_cancelled(batch[i]->ctx)) {
+            file_of[i] = &files[files_len++];
+            file_of[i]->path = batch[i]->path;
+            file_of[i]->skip_ino = batch[i]->ctx->opts.stdout_inode;
+            file_of[i]->dev = batch[i]->hint.dev;
+        }
+    }
+    if (files_len > 0 && uring_load(ring, files, files_len) < 0) {
+        *ring_failed = TRUE;
     }
 
-    outkey->dev = buf.st_dev;
-    outkey->ino = buf.st_ino;
+    for (i = 0; i < batch_len; i++) {
+        search_ctx_t *ctx = batch[i]->ctx;
+        uring_file_t *file = file_of[i];
 
-    HASH_FIND(hh, symhash, outkey, sizeof(dirkey_t), item_found);
-    if (item_found) {
-        return SYMLOOP_LOOP;
+        if (file != NULL && file->buf != NULL) {
+            print_init_context();
+            search_buf(ctx, worker_id, file->buf, file->len, file->path, FALSE);
+            print_cleanup_context();
+        } else if (file != NULL) {
+            search_file(ctx, worker_id, file->path, &batch[i]->hint);
+        }
+        free(batch[i]->path);
+        work_item_done(ctx);
+        free(batch[i]);
     }
+    return next;
+}
 
-    new_item = (symdir_t *)ag_malloc(sizeof(symdir_t));
-    memcpy(&new_item->key, outkey, sizeof(dirkey_t));
-    HASH_ADD(hh, symhash, key, sizeof(dirkey_t), new_item);
-    return SYMLOOP_OK;
-#endif
+void *search_file_worker(void *i) {
+    work_queue_t *queue_item;
+    int worker_id = *(int *)i;
+    uring_t *ring = NULL;
+    int ring_failed = FALSE;
+
+    log_debug("Worker %i started", worker_id);
+
+    while ((queue_item = next_work_item(worker_id)) != NULL) {
+        if (uses_uring(queue_item) && ring == NULL && !ring_failed) {
+            ring = uring_new();
+            ring_failed = (ring == NULL);
+        }
+        /* A failed ring is kept until the end, in case the kernel still uses its buffers. */
+        if (ring != NULL && !ring_failed && uses_uring(queue_item)) {
+            queue_item = search_files_uring(ring, &ring_failed, worker_id, queue_item);
+            if (queue_item == NULL) {
+                continue;
+            }
+        }
+        run_work_item(worker_id, queue_item);
+    }
+
+    uring_free(ring);
+    search_thread_cleanup();
+    re_thread_cleanup();
+    dfa_thread_cleanup();
+    log_debug("Worker %i finished", worker_id);
+    return NULL;
+}
+
+static walk_dir_t *new_walk_dir(walk_dir_t *parent, char *path, ignores *ig, const char *base_path,
+                                const int depth, dev_t original_dev) {
+    walk_dir_t *dir = ag_malloc(sizeof(walk_dir_t));
+    dir->path = path;
+    dir->ig = ig;
+    dir->base_path = base_path;
+    dir->depth = depth;
+    dir->original_dev = original_dev;
+    memset(&dir->key, 0, sizeof(dirkey_t));
+    dir->parent = parent;
+    dir->refcount = 1;
+    if (parent) {
+        __atomic_add_fetch(&parent->refcount, 1, __ATOMIC_RELAXED);
+    }
+    return dir;
+}
+
+static void release_walk_dir(walk_dir_t *dir) {
+    walk_dir_t *parent;
+
+    while (dir && __atomic_sub_fetch(&dir->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        parent = dir->parent;
+        cleanup_ignore(dir->ig);
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
 }
 
-static int check_symloop_leave(dirkey_t *dirkey) {
+/* Whether dir, open as dir_fd, is one of its own parents, i.e., we got here through a symlink loop. */
+static int check_symloop(walk_dir_t *dir, int dir_fd) {
 #ifdef _WIN32
     return SYMLOOP_OK;
 #else
-    symdir_t *item_found = NULL;
+    struct stat buf;
+    walk_dir_t *parent;
 
-    if (dirkey->dev == 0 && dirkey->ino == 0) {
+    int res = fstat(dir_fd, &buf);
+    if (res != 0) {
+        log_err("Error stat()ing: %s", dir->path);
         return SYMLOOP_ERROR;
     }
 
-    HASH_FIND(hh, symhash, dirkey, sizeof(dirkey_t), item_found);
-    if (!item_found) {
-        log_err("item not found! weird stuff...\n");
-        return SYMLOOP_ERROR;
-    }
+    dir->key.dev = buf.st_dev;
+    dir->key.ino = buf.st_ino;
 
-    HASH_DELETE(hh, symhash, item_found);
-    free(item_found);
+    for (parent = dir->parent; parent != NULL; parent = parent->parent) {
+        if (parent->key.dev == dir->key.dev && parent->key.ino == dir->key.ino) {
+            return SYMLOOP_LOOP;
+        }
+    }
     return SYMLOOP_OK;
 #endif
 }
@@ -544,8 +1783,11 @@ static int check_symloop_leave(dirkey_t *dirkey) {
 /* TODO: Append matches to some data structure instead of just printing them out.
  * Then ag can have sweet summaries of matches/files scanned/time/etc.
  */
-void search_dir(ignores *ig, const char *base_path, const char *path, const int depth,
-                dev_t original_dev) {
+static void walk_dir(search_ctx_t *ctx, int worker_id, walk_dir_t *cur_dir) {
+    const char *path = cur_dir->path;
+    const char *base_path = cur_dir->base_path;
+    const int depth = cur_dir->depth;
+    ignores *ig = cur_dir->ig;
     struct dirent **dir_list = NULL;
     struct dirent *dir = NULL;
     scandir_baton_t scandir_baton;
@@ -558,16 +1800,53 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     int i;
 
     int symres;
-    dirkey_t current_dirkey;
+    int dir_fd;
+    file_hint_t hint;
+    work_batch_t batch = { NULL, NULL, 0 };
+
+    /* Entries are stat()ed, if at all, relative to this. */
+    dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        if (errno == ENOTDIR) {
+            /* Not a directory. Probably a file. */
+            /* Printing reads the global options, and libag never prints. */
+            if (depth == 0 && ctx->opts.paths_len == 1 && !has_ag_init) {
+                /* If we're only searching one file, don't print the filename header at the top. */
+                if (opts.print_path == PATH_PRINT_DEFAULT || opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
+                    opts.print_path = PATH_PRINT_NOTHING;
+                }
+                /* If we're only searching one file and --only-matching is specified, disable line numbers too. */
+                if (opts.only_matching && opts.print_path == PATH_PRINT_NOTHING) {
+                    opts.print_line_numbers = FALSE;
+                }
+            }
+
+            /* Since the local thread can also do search, its worker_id
+             * (NUM_WORKERS) differs from the others. */
+            search_file(ctx, worker_id, path, NULL);
+        } else {
+            log_err("Error opening directory %s: %s", path, strerror(errno));
+        }
+        return;
+    }
 
-    symres = check_symloop_enter(path, &current_dirkey);
+    symres = check_symloop(cur_dir, dir_fd);
     if (symres == SYMLOOP_LOOP) {
         log_err("Recursive directory loop: %s", path);
+        close(dir_fd);
+        return;
+    }
+#ifndef _WIN32
+    /* Checked once open, rather than with an lstat() of each entry: directories here, files in search_file(). */
+    if (ctx->opts.one_dev && depth > 0 && symres == SYMLOOP_OK && cur_dir->key.dev != cur_dir->original_dev) {
+        log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", path);
+        close(dir_fd);
         return;
     }
+#endif
 
     /* find .*ignore files to load ignore patterns from */
-    for (i = 0; opts.skip_vcs_ignores ? (i == 0) : (ignore_pattern_files[i] != NULL); i++) {
+    for (i = 0; ctx->opts.skip_vcs_ignores ? (i == 0) : (ignore_pattern_files[i] != NULL); i++) {
         ignore_file = ignore_pattern_files[i];
         ag_asprintf(&dir_full_path, "%s/%s", path, ignore_file);
         load_ignore_patterns(ig, dir_full_path);
@@ -589,105 +1868,75 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     scandir_baton.base_path_len = base_path_len;
     scandir_baton.path_start = path_start;
 
-    results = ag_scandir(path, &dir_list, &filename_filter, &scandir_baton);
+    results = ag_scandir(path, dir_fd, &dir_list, &filename_filter, &scandir_baton);
     if (results == 0) {
         log_debug("No results found in directory %s", path);
         goto search_dir_cleanup;
     } else if (results == -1) {
-        if (errno == ENOTDIR) {
-            /* Not a directory. Probably a file. */
-            if (depth == 0 && opts.paths_len == 1) {
-                /* If we're only searching one file, don't print the filename header at the top. */
-                if (opts.print_path == PATH_PRINT_DEFAULT || opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
-                    opts.print_path = PATH_PRINT_NOTHING;
-                }
-                /* If we're only searching one file and --only-matching is specified, disable line numbers too. */
-                if (opts.only_matching && opts.print_path == PATH_PRINT_NOTHING) {
-                    opts.print_line_numbers = FALSE;
-                }
-            }
-
-            /* Since the local thread can also do search, we need to differentiate its
-             * worker_id from the others. */
-            search_file(NUM_WORKERS, path);
-        } else {
-            log_err("Error opening directory %s: %s", path, strerror(errno));
-        }
+        log_err("Error opening directory %s: %s", path, strerror(errno));
         goto search_dir_cleanup;
     }
 
-    int offset_vector[3];
-    int rc = 0;
-    work_queue_t *queue_item;
+    /* The filter told the type of every entry left. */
+    hint.dev = ctx->opts.one_dev ? cur_dir->original_dev : 0;
+
+    size_t offset_vector[2];
+    int queued;
 
     for (i = 0; i < results; i++) {
-        queue_item = NULL;
+        queued = FALSE;
         dir = dir_list[i];
         ag_asprintf(&dir_full_path, "%s/%s", path, dir->d_name);
-#ifndef _WIN32
-        if (opts.one_dev) {
-            struct stat s;
-            if (lstat(dir_full_path, &s) != 0) {
-                log_err("Failed to get device information for %s. Skipping...", dir->d_name);
-                goto cleanup;
-            }
-            if (s.st_dev != original_dev) {
-                log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
-                goto cleanup;
-            }
+        if (search_cancelled(ctx)) {
+            goto cleanup;
         }
-#endif
-
         /* If a link points to a directory then we need to treat it as a directory. */
-        if (!opts.follow_symlinks && is_symlink(path, dir)) {
+        if (!ctx->opts.follow_symlinks && is_symlink(path, dir)) {
             log_debug("File %s ignored becaused it's a symlink", dir->d_name);
             goto cleanup;
         }
 
         if (!is_directory(path, dir)) {
-            if (opts.file_search_regex) {
-                rc = pcre_exec(opts.file_search_regex, NULL, dir_full_path, strlen(dir_full_path),
-                               0, 0, offset_vector, 3);
-                if (rc < 0) { /* no match */
+            if (ctx->opts.file_search_regex) {
+                if (!re_match(ctx->opts.file_search_regex, NULL, dir_full_path, strlen(dir_full_path), 0,
+                              offset_vector)) { /* no match */
                     log_debug("Skipping %s due to file_search_regex.", dir_full_path);
                     goto cleanup;
-                } else if (opts.match_files) {
+                } else if (ctx->opts.match_files) {
                     log_debug("match_files: file_search_regex matched for %s.", dir_full_path);
                     pthread_mutex_lock(&print_mtx);
-                    print_path(dir_full_path, opts.path_sep);
+                    print_path(dir_full_path, ctx->opts.path_sep);
                     pthread_mutex_unlock(&print_mtx);
-                    opts.match_found = 1;
+                    ctx->opts.match_found = 1;
                     goto cleanup;
                 }
             }
 
-            queue_item = ag_malloc(sizeof(work_queue_t));
-            queue_item->path = dir_full_path;
-            queue_item->next = NULL;
-            pthread_mutex_lock(&work_queue_mtx);
-            if (work_queue_tail == NULL) {
-                work_queue = queue_item;
-            } else {
-                work_queue_tail->next = queue_item;
-            }
-            work_queue_tail = queue_item;
-            pthread_cond_signal(&files_ready);
-            pthread_mutex_unlock(&work_queue_mtx);
-            log_debug("%s added to work queue", dir_full_path);
-        } else if (opts.recurse_dirs) {
-            if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
+#ifdef HAVE_DIRENT_DTYPE
+            hint.type = DTTOIF(dir->d_type);
+#else
+            hint.type = 0;
+#endif
+            queue_work_item(ctx, worker_id, &batch, dir_full_path, NULL, &hint);
+            queued = TRUE;
+        } else if (ctx->opts.recurse_dirs) {
+            if (depth < ctx->opts.max_search_depth || ctx->opts.max_search_depth == -1) {
                 log_debug("Searching dir %s", dir_full_path);
+                /* The ignores keep a pointer to the directory name, so point
+                 * it into the path the new directory owns. */
+                const char *dir_name = dir_full_path + strlen(path) + 1;
                 ignores *child_ig;
 #ifdef HAVE_DIRENT_DNAMLEN
-                child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
+                child_ig = init_ignore(ig, dir_name, dir->d_namlen);
 #else
-                child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
+                child_ig = init_ignore(ig, dir_name, strlen(dir_name));
 #endif
-                search_dir(child_ig, base_path, dir_full_path, depth + 1,
-                           original_dev);
-                cleanup_ignore(child_ig);
+                walk_dir_t *child = new_walk_dir(cur_dir, dir_full_path, child_ig, base_path, depth + 1,
+                                                 cur_dir->original_dev);
+                queue_work_item(ctx, worker_id, &batch, dir_full_path, child, NULL);
+                queued = TRUE;
             } else {
-                if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
+                if (ctx->opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
                     /*
                      * If the user didn't intentionally specify a particular depth,
                      * this is a warning...
@@ -703,14 +1952,30 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     cleanup:
         free(dir);
         dir = NULL;
-        if (queue_item == NULL) {
+        if (!queued) {
             free(dir_full_path);
             dir_full_path = NULL;
         }
     }
 
 search_dir_cleanup:
-    check_symloop_leave(&current_dirkey);
+    flush_work_items(ctx, worker_id, &batch);
     free(dir_list);
     dir_list = NULL;
 }
+
+/*
+ * Walk path: its files and subdirectories are queued for the workers,
+ * which search the files and walk the subdirectories in parallel. ig
+ * is released once the whole tree below path has been walked, which
+ * may be after we return; wait_search_done() waits for all of it.
+ */
+void search_dir(search_ctx_t *ctx, ignores *ig, const char *base_path, const char *path, const int depth,
+                dev_t original_dev) {
+    walk_dir_t *root = new_walk_dir(NULL, ag_strdup(path), ig, base_path, depth, original_dev);
+    walk_dir(ctx, NUM_WORKERS, root);
+    release_walk_dir(root);
+    search_thread_cleanup();
+    re_thread_cleanup();
+    dfa_thread_cleanup();
+}
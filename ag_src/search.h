@@ -5,10 +5,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <pcre.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -24,34 +24,131 @@
 #endif
 
 #include "decompress.h"
+#include "deque.h"
+#include "dfa.h"
 #include "ignore.h"
 #include "log.h"
+#include "multi.h"
 #include "options.h"
 #include "print.h"
-#include "uthash.h"
+#include "uring.h"
 #include "util.h"
 
-extern size_t alpha_skip_lookup[256];
-extern size_t *find_skip_lookup;
-extern uint8_t h_table[H_SIZE] __attribute__((aligned(64)));
+struct search_ctx;
+struct walk_dir;
+struct split_file;
+struct ag_result;
 
+/*
+ * What the walker already knows of a file, so that search_file() does not
+ * stat() it before opening it: its type (S_IFREG and the like, from the
+ * directory entry, or 0 if unknown) and, with --one-device, the device it
+ * has to be on.
+ */
+typedef struct {
+    mode_t type;
+    dev_t dev;
+} file_hint_t;
+
+/* A file to search or, if dir is set, a directory to walk, or, if split is set, a part of a file. */
 struct work_queue_t {
     char *path;
+    file_hint_t hint;
+    struct walk_dir *dir;
+    struct split_file *split;
+    size_t part;
+    struct search_ctx *ctx;
     struct work_queue_t *next;
 };
 typedef struct work_queue_t work_queue_t;
 
-extern work_queue_t *work_queue;
-extern work_queue_t *work_queue_tail;
-extern int done_adding_files;
+/* Files found by the walker, queued together. */
+typedef struct {
+    work_queue_t *head;
+    work_queue_t *tail;
+    size_t len;
+} work_batch_t;
+
+/* Files moved at once between the shared queue and a worker deque. */
+#define WORK_BATCH 64
+
+/*
+ * Smallest file worth mmap()ing: below this, mmap() and munmap() (and
+ * the TLB shootdowns that come with it) cost more than a read() into a
+ * buffer we reuse.
+ */
+#ifndef MMAP_MIN_SIZE
+#define MMAP_MIN_SIZE (256 * 1024)
+#endif
+
+/*
+ * Files larger than SEARCH_CHUNK_MIN are not loaded whole, but searched
+ * SEARCH_CHUNK bytes at a time (see search_chunked()), so that a search
+ * takes the same memory whatever the size of the files, and regexes are
+ * not limited to files PCRE can take at once. Matches across chunks are
+ * found whole as long as they are shorter than SEARCH_CHUNK_OVERLAP.
+ */
+#ifndef SEARCH_CHUNK_MIN
+#define SEARCH_CHUNK_MIN (1024 * 1024 * 1024)
+#endif
+#ifndef SEARCH_CHUNK
+#define SEARCH_CHUNK (64 * 1024 * 1024)
+#endif
+#ifndef SEARCH_CHUNK_OVERLAP
+#define SEARCH_CHUNK_OVERLAP (1024 * 1024)
+#endif
+
+/*
+ * With more than one worker, these files are also split into parts of
+ * about SEARCH_PART bytes, each one a work item of its own, so that
+ * several workers search the same file at once.
+ */
+#ifndef SEARCH_PART
+#define SEARCH_PART (256 * 1024 * 1024)
+#endif
+
+/*
+ * A part of a split file. start and end are nominal: the part runs from
+ * the first line start at or past start to the first one at or past end
+ * (see part_boundary()). Line numbers of its results count from where its
+ * lead starts, lead_lines lines before the part; they are fixed up once
+ * all the parts are searched.
+ */
+typedef struct {
+    off_t start;
+    off_t end;
+    size_t lines;      /* Lines in the part */
+    size_t lead_lines;
+    size_t matches;
+    size_t searched;
+    int complete;      /* Whether it was searched to its end */
+    /* libag: results of the part, see add_part_result(). */
+    struct ag_result **results;
+    size_t nresults;
+    size_t results_cap;
+} file_part_t;
+
+/*
+ * A file searched in parts. Whichever worker searches its last part
+ * merges the results of all of them, in offset order, as a single file's.
+ */
+typedef struct split_file {
+    char *path;
+    int fd;
+    off_t f_len;
+    int binary;
+    int found;      /* Whether a part has matches */
+    size_t pending; /* Parts not searched yet */
+    size_t parts_len;
+    file_part_t parts[];
+} split_file_t;
+
+/* Shared worker pool. */
 extern int stop_workers;
+extern int work_stealing;
 extern pthread_cond_t files_ready;
-extern pthread_mutex_t stats_mtx;
 extern pthread_mutex_t work_queue_mtx;
 
-extern pthread_barrier_t worker_done;
-extern pthread_barrier_t results_done;
-
 /* For symlink loop detection */
 #define SYMLOOP_ERROR (-1)
 #define SYMLOOP_OK (0)
@@ -62,28 +159,118 @@ typedef struct {
     ino_t ino;
 } dirkey_t;
 
-typedef struct {
+/*
+ * A directory being walked. Directories are work items too, so several
+ * workers expand the tree at once. Each directory holds a reference to
+ * its parent until it is done, since both the ignore patterns and the
+ * symlink loop detection look at the whole chain of parents. Everything
+ * but refcount is read-only once the directory is queued.
+ */
+typedef struct walk_dir {
+    char *path;
+    ignores *ig;
+    const char *base_path;
+    int depth;
+    dev_t original_dev;
     dirkey_t key;
-    UT_hash_handle hh;
-} symdir_t;
+    struct walk_dir *parent;
+    int refcount;
+} walk_dir_t;
+
+/*
+ * Everything a single search touches: its own copy of the options,
+ * the compiled query and lookup tables, the ignore tree and the work
+ * queue. Nothing here is shared between two searches, so two contexts
+ * can be searched concurrently.
+ *
+ * The workers are shared by all searches: a search with queued files
+ * sits in the list of active searches, and workers take files from
+ * these searches in a round-robin fashion. The queue fields are
+ * protected by work_queue_mtx, except pending_items, which is
+ * updated atomically so that workers do not need the lock for every
+ * searched file.
+ */
+typedef struct search_ctx {
+    cli_options opts;
+
+    size_t alpha_skip_lookup[256];
+    size_t *find_skip_lookup;
+    /* Case mask of the query (or of re_literal), for case-insensitive literal searches. */
+    uint8_t *case_mask;
+    /* Literal that every match of the regex contains, if any, and whether
+     * matches never span lines, so that only lines with it need PCRE. */
+    char *re_literal;
+    size_t re_literal_len;
+    int re_literal_in_line;
+    /* Whether, without multiline, the regex can run over whole buffers (see regex_line_local()). */
+    int re_line_local;
+    /* Linear-time matcher for the regex, if it can be compiled to one. */
+    dfa_t *dfa;
+    /* Set instead of the query for multi-pattern searches. */
+    multi_pattern_t *multi;
+    uint8_t h_table[H_SIZE] __attribute__((aligned(64)));
+
+    ignores *root_ignores;
+
+    /* Set to stop the search early: its remaining items are skipped. */
+    int cancelled;
+    /* CLOCK_MONOTONIC time, in ns, after which the search stops; 0 for none. Once it
+     * passes, deadline_passed is set: unlike cancelled, it keeps the results found. */
+    long long deadline;
+    int deadline_passed;
+    /* Result budget, 0 for no limit, and how much of it was taken so far. Once
+     * spent, the search stops as if cancelled, but keeps the results found. */
+    size_t max_matches;
+    size_t max_files;
+    size_t nmatches;
+    size_t nfiles;
+    int budget_spent;
+
+    work_queue_t *work_queue;
+    work_queue_t *work_queue_tail;
+    size_t pending_items; /* Queued or being searched */
+    int done_adding_files;
+    int active;
+    struct search_ctx *next_active;
+    pthread_cond_t search_done;
+
+    ag_stats stats;
+    pthread_mutex_t stats_mtx;
+} search_ctx_t;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+} worker_t;
 
-extern symdir_t *symhash;
+void search_buf(search_ctx_t *ctx, int worker_id, const char *buf, const size_t buf_len,
+                const char *dir_full_path, const int binary_checked);
+void search_stream(search_ctx_t *ctx, int worker_id, FILE *stream, const char *path);
+void search_file(search_ctx_t *ctx, int worker_id, const char *file_full_path, const file_hint_t *hint);
 
-void search_buf(int worker_id, const char *buf, const size_t buf_len,
-                const char *dir_full_path);
-void search_stream(int worker_id, FILE *stream, const char *path);
-void search_file(int worker_id, const char *file_full_path);
+int search_cancelled(search_ctx_t *ctx);
 
+int init_work_queues(int workers_len, int use_work_stealing);
+void cleanup_work_queues(void);
+void queue_work_item(search_ctx_t *ctx, int worker_id, work_batch_t *batch, char *path, walk_dir_t *dir,
+                     const file_hint_t *hint);
+void flush_work_items(search_ctx_t *ctx, int worker_id, work_batch_t *batch);
+void wait_search_done(search_ctx_t *ctx);
 void *search_file_worker(void *i);
+/* Releases the read buffer of the calling thread. */
+void search_thread_cleanup(void);
 
-void search_dir(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+void search_dir(search_ctx_t *ctx, ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
 
 /* libag 'private' routines and variables. */
-extern int add_local_result(int worker_id, const char *file,
+extern int add_local_result(search_ctx_t *ctx, int worker_id, const char *file,
     const match_t matches[], const size_t matches_len,
-    const char *buf, int flags);
+    line_index_t *lines, int flags);
+extern int add_part_result(search_ctx_t *ctx, int worker_id, file_part_t *part,
+    const char *file, const match_t matches[], const size_t matches_len,
+    line_index_t *lines, int flags);
+extern int add_split_result(search_ctx_t *ctx, int worker_id, split_file_t *split);
 
-extern int init_local_results(int worker_id);
 extern int has_ag_init;
 
 #endif
@@ -0,0 +1,716 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Literal search kernels. The vector ones compare a whole block of
+ * candidate positions against the first and the last byte of the
+ * needle at once, and only verify the positions where both match,
+ * which are rare for anything but degenerate inputs. Whatever is
+ * left after the last full block goes through the scalar kernel.
+ */
+
+typedef const char *(*strnstr_fn)(const char *, const char *, const size_t, const size_t);
+typedef const char *(*strncasestr_fn)(const char *, const char *, const size_t, const size_t, const uint8_t *);
+typedef const char *(*teddy_fn)(const char *, const size_t, const teddy_masks_t *, unsigned *);
+typedef size_t (*count_fn)(const char *, const size_t, const char);
+typedef size_t (*text_prefix_fn)(const char *, const size_t);
+
+/*
+ * Case-insensitive variants take the lowercased needle and its case
+ * mask (see generate_case_mask()): a haystack byte c matches find[i]
+ * when (c | case_mask[i]) == find[i], which for ASCII is the same as
+ * tolower(c) == find[i] without a call or a table lookup per byte.
+ */
+static int case_eq(const char *s, const char *find, const uint8_t *case_mask, const size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((uint8_t)(s[i] | case_mask[i]) != (uint8_t)find[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* memchr (itself vectorized by most libcs) on the first byte, then memcmp. */
+static const char *strnstr_scalar(const char *s, const char *find, const size_t s_len, const size_t f_len) {
+    const char *end;
+    const char *p;
+
+    if (s_len < f_len) {
+        return NULL;
+    }
+    end = s + (s_len - f_len) + 1;
+    for (p = s; p < end; p++) {
+        p = memchr(p, find[0], end - p);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p + 1, find + 1, f_len - 1) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char *strncasestr_scalar(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                                      const uint8_t *case_mask) {
+    const uint8_t first = (uint8_t)find[0];
+    const uint8_t first_mask = case_mask[0];
+    size_t i;
+
+    if (s_len < f_len) {
+        return NULL;
+    }
+    if (first_mask == 0) {
+        /* Not a letter: memchr can find the candidates. */
+        const char *end = s + (s_len - f_len) + 1;
+        const char *p;
+        for (p = s; p < end; p++) {
+            p = memchr(p, first, end - p);
+            if (p == NULL) {
+                return NULL;
+            }
+            if (case_eq(p + 1, find + 1, case_mask + 1, f_len - 1)) {
+                return p;
+            }
+        }
+        return NULL;
+    }
+    for (i = 0; i <= s_len - f_len; i++) {
+        if ((uint8_t)(s[i] | first_mask) == first && case_eq(s + i + 1, find + 1, case_mask + 1, f_len - 1)) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+static unsigned teddy_buckets(const char *p, const teddy_masks_t *t) {
+    unsigned buckets = 0xFF;
+    size_t k;
+
+    for (k = 0; k < t->len; k++) {
+        const uint8_t c = (uint8_t)p[k];
+        buckets &= t->lo[k][c & 0xF] & t->hi[k][c >> 4];
+    }
+    return buckets;
+}
+
+static const char *teddy_scalar(const char *s, const size_t s_len, const teddy_masks_t *t, unsigned *buckets) {
+    size_t i;
+
+    if (s_len < t->len) {
+        return NULL;
+    }
+    for (i = 0; i <= s_len - t->len; i++) {
+        *buckets = teddy_buckets(s + i, t);
+        if (*buckets) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+/* memchr on each occurrence in turn. */
+static size_t count_scalar(const char *s, const size_t s_len, const char c) {
+    const char *end = s + s_len;
+    size_t count = 0;
+
+    while (s < end && (s = memchr(s, c, end - s)) != NULL) {
+        count++;
+        s++;
+    }
+    return count;
+}
+
+/* Bytes is_binary() never finds suspicious: \a to \r, and ' ' to DEL. */
+static size_t text_prefix_scalar(const char *s, const size_t s_len) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i;
+
+    for (i = 0; i < s_len; i++) {
+        if ((u[i] < 7 || u[i] > 14) && (u[i] < 32 || u[i] > 127)) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2"))) static const char *strnstr_avx2(const char *s, const char *find, const size_t s_len, const size_t f_len) {
+    size_t i = 0;
+    size_t n;
+
+    if (f_len == 1) {
+        return memchr(s, find[0], s_len);
+    }
+    if (s_len < f_len) {
+        return NULL;
+    }
+
+    const __m256i first = _mm256_set1_epi8(find[0]);
+    const __m256i last = _mm256_set1_epi8(find[f_len - 1]);
+
+    n = s_len - f_len + 1; /* Candidate positions */
+    for (; i + 32 <= n; i += 32) {
+        const __m256i b_first = _mm256_loadu_si256((const __m256i *)(s + i));
+        const __m256i b_last = _mm256_loadu_si256((const __m256i *)(s + i + f_len - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, b_first), _mm256_cmpeq_epi8(last, b_last)));
+
+        while (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos + 1, find + 1, f_len - 2) == 0) {
+                return s + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return strnstr_scalar(s + i, find, s_len - i, f_len);
+}
+
+__attribute__((target("sse2"))) static const char *strnstr_sse2(const char *s, const char *find, const size_t s_len, const size_t f_len) {
+    size_t i = 0;
+    size_t n;
+
+    if (f_len == 1) {
+        return memchr(s, find[0], s_len);
+    }
+    if (s_len < f_len) {
+        return NULL;
+    }
+
+    const __m128i first = _mm_set1_epi8(find[0]);
+    const __m128i last = _mm_set1_epi8(find[f_len - 1]);
+
+    n = s_len - f_len + 1;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i b_first = _mm_loadu_si128((const __m128i *)(s + i));
+        const __m128i b_last = _mm_loadu_si128((const __m128i *)(s + i + f_len - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, b_first), _mm_cmpeq_epi8(last, b_last)));
+
+        while (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos + 1, find + 1, f_len - 2) == 0) {
+                return s + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return strnstr_scalar(s + i, find, s_len - i, f_len);
+}
+
+__attribute__((target("avx2"))) static const char *strncasestr_avx2(const char *s, const char *find, const size_t s_len,
+                                                                    const size_t f_len, const uint8_t *case_mask) {
+    const size_t mid = f_len > 2 ? f_len - 2 : 0;
+    size_t i = 0;
+    size_t n;
+
+    if (s_len < f_len) {
+        return NULL;
+    }
+
+    const __m256i first = _mm256_set1_epi8(find[0]);
+    const __m256i first_mask = _mm256_set1_epi8((char)case_mask[0]);
+    const __m256i last = _mm256_set1_epi8(find[f_len - 1]);
+    const __m256i last_mask = _mm256_set1_epi8((char)case_mask[f_len - 1]);
+
+    n = s_len - f_len + 1;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i b_first = _mm256_loadu_si256((const __m256i *)(s + i));
+        const __m256i b_last = _mm256_loadu_si256((const __m256i *)(s + i + f_len - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, _mm256_or_si256(b_first, first_mask)),
+                             _mm256_cmpeq_epi8(last, _mm256_or_si256(b_last, last_mask))));
+
+        while (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            if (case_eq(s + pos + 1, find + 1, case_mask + 1, mid)) {
+                return s + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return strncasestr_scalar(s + i, find, s_len - i, f_len, case_mask);
+}
+
+__attribute__((target("sse2"))) static const char *strncasestr_sse2(const char *s, const char *find, const size_t s_len,
+                                                                    const size_t f_len, const uint8_t *case_mask) {
+    const size_t mid = f_len > 2 ? f_len - 2 : 0;
+    size_t i = 0;
+    size_t n;
+
+    if (s_len < f_len) {
+        return NULL;
+    }
+
+    const __m128i first = _mm_set1_epi8(find[0]);
+    const __m128i first_mask = _mm_set1_epi8((char)case_mask[0]);
+    const __m128i last = _mm_set1_epi8(find[f_len - 1]);
+    const __m128i last_mask = _mm_set1_epi8((char)case_mask[f_len - 1]);
+
+    n = s_len - f_len + 1;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i b_first = _mm_loadu_si128((const __m128i *)(s + i));
+        const __m128i b_last = _mm_loadu_si128((const __m128i *)(s + i + f_len - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, _mm_or_si128(b_first, first_mask)),
+                          _mm_cmpeq_epi8(last, _mm_or_si128(b_last, last_mask))));
+
+        while (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            if (case_eq(s + pos + 1, find + 1, case_mask + 1, mid)) {
+                return s + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return strncasestr_scalar(s + i, find, s_len - i, f_len, case_mask);
+}
+
+/*
+ * Teddy kernels: PSHUFB looks up the bucket bits of the low and the
+ * high nibble of 16 (32) bytes at once, for each fingerprint byte.
+ * The masks are 16 bytes long, which AVX2 needs in both lanes.
+ */
+__attribute__((target("avx2"))) static const char *teddy_avx2(const char *s, const size_t s_len, const teddy_masks_t *t,
+                                                              unsigned *buckets) {
+    const __m256i nibble = _mm256_set1_epi8(0xF);
+    __m256i lo[3];
+    __m256i hi[3];
+    size_t i = 0;
+    size_t k;
+    size_t n;
+
+    if (s_len < t->len) {
+        return NULL;
+    }
+    for (k = 0; k < t->len; k++) {
+        lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->lo[k]));
+        hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->hi[k]));
+    }
+
+    n = s_len - t->len + 1;
+    for (; i + 32 <= n; i += 32) {
+        __m256i res = _mm256_set1_epi8((char)0xFF);
+        for (k = 0; k < t->len; k++) {
+            const __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + k));
+            res = _mm256_and_si256(res, _mm256_shuffle_epi8(lo[k], _mm256_and_si256(b, nibble)));
+            res = _mm256_and_si256(res, _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble)));
+        }
+        const uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(res, _mm256_setzero_si256()));
+        if (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            *buckets = teddy_buckets(s + pos, t);
+            return s + pos;
+        }
+    }
+    return teddy_scalar(s + i, s_len - i, t, buckets);
+}
+
+__attribute__((target("ssse3"))) static const char *teddy_ssse3(const char *s, const size_t s_len, const teddy_masks_t *t,
+                                                                unsigned *buckets) {
+    const __m128i nibble = _mm_set1_epi8(0xF);
+    __m128i lo[3];
+    __m128i hi[3];
+    size_t i = 0;
+    size_t k;
+    size_t n;
+
+    if (s_len < t->len) {
+        return NULL;
+    }
+    for (k = 0; k < t->len; k++) {
+        lo[k] = _mm_loadu_si128((const __m128i *)t->lo[k]);
+        hi[k] = _mm_loadu_si128((const __m128i *)t->hi[k]);
+    }
+
+    n = s_len - t->len + 1;
+    for (; i + 16 <= n; i += 16) {
+        __m128i res = _mm_set1_epi8((char)0xFF);
+        for (k = 0; k < t->len; k++) {
+            const __m128i b = _mm_loadu_si128((const __m128i *)(s + i + k));
+            res = _mm_and_si128(res, _mm_shuffle_epi8(lo[k], _mm_and_si128(b, nibble)));
+            res = _mm_and_si128(res, _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(b, 4), nibble)));
+        }
+        const uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(res, _mm_setzero_si128())) & 0xFFFF;
+        if (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            *buckets = teddy_buckets(s + pos, t);
+            return s + pos;
+        }
+    }
+    return teddy_scalar(s + i, s_len - i, t, buckets);
+}
+
+/*
+ * Byte count kernels: each compare yields 0 or -1 per byte, which is
+ * subtracted from per-byte counters for up to 255 blocks, and then the
+ * counters are summed with PSADBW.
+ */
+__attribute__((target("avx2"))) static size_t count_avx2(const char *s, const size_t s_len, const char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 32 <= s_len) {
+        __m256i acc = zero;
+        size_t n;
+        for (n = 0; n < 255 && i + 32 <= s_len; n++, i += 32) {
+            const __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(b, needle));
+        }
+        acc = _mm256_sad_epu8(acc, zero);
+        const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        count += (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+    return count + count_scalar(s + i, s_len - i, c);
+}
+
+__attribute__((target("sse2"))) static size_t count_sse2(const char *s, const size_t s_len, const char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 16 <= s_len) {
+        __m128i acc = zero;
+        size_t n;
+        for (n = 0; n < 255 && i + 16 <= s_len; n++, i += 16) {
+            const __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(b, needle));
+        }
+        acc = _mm_sad_epu8(acc, zero);
+        count += (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    }
+    return count + count_scalar(s + i, s_len - i, c);
+}
+
+/*
+ * Plain text kernels: with signed compares, ' ' to DEL is c > 31, and
+ * the bytes 128 and up, being negative, fail both tests.
+ */
+__attribute__((target("avx2"))) static size_t text_prefix_avx2(const char *s, const size_t s_len) {
+    const __m256i c6 = _mm256_set1_epi8(6);
+    const __m256i c15 = _mm256_set1_epi8(15);
+    const __m256i c31 = _mm256_set1_epi8(31);
+    size_t i = 0;
+
+    for (; i + 32 <= s_len; i += 32) {
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+        const __m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(b, c6), _mm256_cmpgt_epi8(c15, b));
+        const uint32_t plain = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(b, c31), ctrl));
+        if (plain != 0xFFFFFFFF) {
+            return i + __builtin_ctz(~plain);
+        }
+    }
+    return i + text_prefix_scalar(s + i, s_len - i);
+}
+
+__attribute__((target("sse2"))) static size_t text_prefix_sse2(const char *s, const size_t s_len) {
+    const __m128i c6 = _mm_set1_epi8(6);
+    const __m128i c15 = _mm_set1_epi8(15);
+    const __m128i c31 = _mm_set1_epi8(31);
+    size_t i = 0;
+
+    for (; i + 16 <= s_len; i += 16) {
+        const __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+        const __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(b, c6), _mm_cmplt_epi8(b, c15));
+        const unsigned plain = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi8(b, c31), ctrl));
+        if (plain != 0xFFFF) {
+            return i + __builtin_ctz(~plain);
+        }
+    }
+    return i + text_prefix_scalar(s + i, s_len - i);
+}
+#endif
+
+#ifdef SIMD_NEON
+static const char *strnstr_neon(const char *s, const char *find, const size_t s_len, const size_t f_len) {
+    size_t i = 0;
+    size_t n;
+
+    if (f_len == 1) {
+        return memchr(s, find[0], s_len);
+    }
+    if (s_len < f_len) {
+        return NULL;
+    }
+
+    const uint8x16_t first = vdupq_n_u8((uint8_t)find[0]);
+    const uint8x16_t last = vdupq_n_u8((uint8_t)find[f_len - 1]);
+
+    n = s_len - f_len + 1;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t eq = vandq_u8(vceqq_u8(first, vld1q_u8((const uint8_t *)s + i)),
+                                       vceqq_u8(last, vld1q_u8((const uint8_t *)s + i + f_len - 1)));
+        /* No movemask on NEON: narrow each byte to a nibble instead. */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+        while (mask) {
+            const size_t bit = __builtin_ctzll(mask);
+            const size_t pos = i + (bit >> 2);
+            if (memcmp(s + pos + 1, find + 1, f_len - 2) == 0) {
+                return s + pos;
+            }
+            mask &= ~(0xFULL << bit);
+        }
+    }
+    return strnstr_scalar(s + i, find, s_len - i, f_len);
+}
+
+static const char *strncasestr_neon(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                                    const uint8_t *case_mask) {
+    const size_t mid = f_len > 2 ? f_len - 2 : 0;
+    size_t i = 0;
+    size_t n;
+
+    if (s_len < f_len) {
+        return NULL;
+    }
+
+    const uint8x16_t first = vdupq_n_u8((uint8_t)find[0]);
+    const uint8x16_t first_mask = vdupq_n_u8(case_mask[0]);
+    const uint8x16_t last = vdupq_n_u8((uint8_t)find[f_len - 1]);
+    const uint8x16_t last_mask = vdupq_n_u8(case_mask[f_len - 1]);
+
+    n = s_len - f_len + 1;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t b_first = vorrq_u8(vld1q_u8((const uint8_t *)s + i), first_mask);
+        const uint8x16_t b_last = vorrq_u8(vld1q_u8((const uint8_t *)s + i + f_len - 1), last_mask);
+        const uint8x16_t eq = vandq_u8(vceqq_u8(first, b_first), vceqq_u8(last, b_last));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+        while (mask) {
+            const size_t bit = __builtin_ctzll(mask);
+            const size_t pos = i + (bit >> 2);
+            if (case_eq(s + pos + 1, find + 1, case_mask + 1, mid)) {
+                return s + pos;
+            }
+            mask &= ~(0xFULL << bit);
+        }
+    }
+    return strncasestr_scalar(s + i, find, s_len - i, f_len, case_mask);
+}
+
+static const char *teddy_neon(const char *s, const size_t s_len, const teddy_masks_t *t, unsigned *buckets) {
+    const uint8x16_t nibble = vdupq_n_u8(0xF);
+    uint8x16_t lo[3];
+    uint8x16_t hi[3];
+    size_t i = 0;
+    size_t k;
+    size_t n;
+
+    if (s_len < t->len) {
+        return NULL;
+    }
+    for (k = 0; k < t->len; k++) {
+        lo[k] = vld1q_u8(t->lo[k]);
+        hi[k] = vld1q_u8(t->hi[k]);
+    }
+
+    n = s_len - t->len + 1;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t res = vdupq_n_u8(0xFF);
+        for (k = 0; k < t->len; k++) {
+            const uint8x16_t b = vld1q_u8((const uint8_t *)s + i + k);
+            res = vandq_u8(res, vqtbl1q_u8(lo[k], vandq_u8(b, nibble)));
+            res = vandq_u8(res, vqtbl1q_u8(hi[k], vshrq_n_u8(b, 4)));
+        }
+        const uint8x16_t set = vtstq_u8(res, res);
+        const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(set), 4)), 0);
+        if (mask) {
+            const size_t pos = i + (__builtin_ctzll(mask) >> 2);
+            *buckets = teddy_buckets(s + pos, t);
+            return s + pos;
+        }
+    }
+    return teddy_scalar(s + i, s_len - i, t, buckets);
+}
+
+static size_t count_neon(const char *s, const size_t s_len, const char c) {
+    const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 16 <= s_len) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        size_t n;
+        for (n = 0; n < 255 && i + 16 <= s_len; n++, i += 16) {
+            acc = vsubq_u8(acc, vceqq_u8(vld1q_u8((const uint8_t *)s + i), needle));
+        }
+        count += vaddlvq_u8(acc);
+    }
+    return count + count_scalar(s + i, s_len - i, c);
+}
+
+/* The block holding the first suspicious byte is left to the scalar kernel. */
+static size_t text_prefix_neon(const char *s, const size_t s_len) {
+    const uint8x16_t c7 = vdupq_n_u8(7);
+    const uint8x16_t c14 = vdupq_n_u8(14);
+    const uint8x16_t c32 = vdupq_n_u8(32);
+    const uint8x16_t c127 = vdupq_n_u8(127);
+    size_t i = 0;
+
+    for (; i + 16 <= s_len; i += 16) {
+        const uint8x16_t b = vld1q_u8((const uint8_t *)s + i);
+        const uint8x16_t ctrl = vandq_u8(vcgeq_u8(b, c7), vcleq_u8(b, c14));
+        const uint8x16_t text = vandq_u8(vcgeq_u8(b, c32), vcleq_u8(b, c127));
+        if (vminvq_u8(vorrq_u8(ctrl, text)) != 0xFF) {
+            break;
+        }
+    }
+    return i + text_prefix_scalar(s + i, s_len - i);
+}
+#endif
+
+static strnstr_fn resolve_strnstr(void) {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return strnstr_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return strnstr_sse2;
+    }
+#elif defined(SIMD_NEON)
+    return strnstr_neon;
+#endif
+    return strnstr_scalar;
+}
+
+const char *simd_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len) {
+    static strnstr_fn impl;
+    strnstr_fn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (fn == NULL) {
+        fn = resolve_strnstr();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn(s, find, s_len, f_len);
+}
+
+static strncasestr_fn resolve_strncasestr(void) {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return strncasestr_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return strncasestr_sse2;
+    }
+#elif defined(SIMD_NEON)
+    return strncasestr_neon;
+#endif
+    return strncasestr_scalar;
+}
+
+const char *simd_strncasestr(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                             const uint8_t *case_mask) {
+    static strncasestr_fn impl;
+    strncasestr_fn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (fn == NULL) {
+        fn = resolve_strncasestr();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn(s, find, s_len, f_len, case_mask);
+}
+
+static teddy_fn resolve_teddy(void) {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return teddy_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return teddy_ssse3;
+    }
+#elif defined(SIMD_NEON)
+    return teddy_neon;
+#endif
+    return teddy_scalar;
+}
+
+static teddy_fn get_teddy(void) {
+    static teddy_fn impl;
+    teddy_fn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (fn == NULL) {
+        fn = resolve_teddy();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn;
+}
+
+int simd_teddy_available(void) {
+    return get_teddy() != teddy_scalar;
+}
+
+const char *simd_teddy_find(const char *s, const size_t s_len, const teddy_masks_t *t, unsigned *buckets) {
+    return get_teddy()(s, s_len, t, buckets);
+}
+
+static count_fn resolve_count(void) {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return count_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return count_sse2;
+    }
+#elif defined(SIMD_NEON)
+    return count_neon;
+#endif
+    return count_scalar;
+}
+
+size_t simd_count(const char *s, const size_t s_len, const char c) {
+    static count_fn impl;
+    count_fn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (fn == NULL) {
+        fn = resolve_count();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn(s, s_len, c);
+}
+
+static text_prefix_fn resolve_text_prefix(void) {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return text_prefix_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return text_prefix_sse2;
+    }
+#elif defined(SIMD_NEON)
+    return text_prefix_neon;
+#endif
+    return text_prefix_scalar;
+}
+
+size_t simd_text_prefix(const char *s, const size_t s_len) {
+    static text_prefix_fn impl;
+    text_prefix_fn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (fn == NULL) {
+        fn = resolve_text_prefix();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn(s, s_len);
+}
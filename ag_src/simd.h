@@ -0,0 +1,57 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Vectorized search kernels. Each one picks, on first use, the best
+ * implementation the CPU supports (AVX2 or SSE2 on x86, NEON on
+ * AArch64), and falls back to plain C elsewhere.
+ */
+
+/*
+ * Case-sensitive literal search: returns the first occurrence of find
+ * (f_len >= 1 bytes) in the first s_len bytes of s, or NULL.
+ */
+const char *simd_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len);
+
+/*
+ * ASCII case-insensitive literal search: find must be lowercase and
+ * case_mask must come from generate_case_mask(find, f_len, ...).
+ */
+const char *simd_strncasestr(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                             const uint8_t *case_mask);
+
+/*
+ * Teddy multi-pattern prefilter. Each pattern is assigned one of 8
+ * buckets, and the first len (1 to 3) bytes of every pattern set the
+ * bit of its bucket in the masks of their low and high nibbles. A
+ * position is a candidate for the patterns of the buckets that are
+ * set in all of the masks of its first len bytes.
+ */
+typedef struct {
+    uint8_t lo[3][16];
+    uint8_t hi[3][16];
+    size_t len;
+} teddy_masks_t;
+
+/* Whether simd_teddy_find() is vectorized on this CPU. */
+int simd_teddy_available(void);
+
+/*
+ * Returns the first candidate position p, with p + t->len <= s + s_len,
+ * and sets *buckets to its bucket bits; or NULL if there is none.
+ */
+const char *simd_teddy_find(const char *s, const size_t s_len, const teddy_masks_t *t, unsigned *buckets);
+
+/* Returns how many times c occurs in the first s_len bytes of s. */
+size_t simd_count(const char *s, const size_t s_len, const char c);
+
+/*
+ * Returns the length of the leading run of plain text in the first
+ * s_len bytes of s: printable ASCII, DEL and the \a to \r controls.
+ */
+size_t simd_text_prefix(const char *s, const size_t s_len);
+
+#endif
@@ -0,0 +1,383 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+
+/* A phase submits at most three requests per file. */
+#define URING_ENTRIES 64
+
+/* What a completion is for: user_data is (file index << 2) | op. */
+enum {
+    OP_STATX,
+    OP_OPEN,
+    OP_READ,
+    OP_CLOSE
+};
+
+struct uring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+    int broken; /* io_uring_enter() failed: the ring is not to be used again */
+
+    /* Per file state of the batch being loaded. */
+    struct statx path_st[URING_BATCH];
+    struct statx fd_st[URING_BATCH];
+    int fds[URING_BATCH];
+    int st_res[URING_BATCH];
+    char *bufs[URING_BATCH];
+    size_t bufs_size[URING_BATCH];
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Whether the kernel knows every operation we submit. */
+static int ops_supported(int fd) {
+    static const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+    struct io_uring_probe *probe;
+    size_t probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    size_t i;
+    int supported = 1;
+
+    probe = calloc(1, probe_len);
+    if (probe == NULL) {
+        return 0;
+    }
+    if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = 0;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+uring_t *uring_new(void) {
+    struct io_uring_params p;
+    uring_t *ring;
+
+    memset(&p, 0, sizeof(p));
+    ring = calloc(1, sizeof(uring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        log_debug("io_uring unavailable: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !ops_supported(ring->fd)) {
+        log_debug("io_uring lacks the operations we need");
+        goto fail;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_len > ring->sq_len) {
+        ring->sq_len = ring->cq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto fail;
+    }
+    /* Both rings share the same mapping. */
+    ring->cq_ptr = ring->sq_ptr;
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return ring;
+
+fail:
+    uring_free(ring);
+    return NULL;
+}
+
+void uring_free(uring_t *ring) {
+    size_t i;
+
+    if (ring == NULL) {
+        return;
+    }
+    for (i = 0; i < URING_BATCH; i++) {
+        free(ring->bufs[i]);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+static struct io_uring_sqe *get_sqe(uring_t *ring, int op, size_t file, int fd, const void *addr,
+                                     unsigned len, uint64_t off) {
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = ((uint64_t)file << 2) | (uint64_t)op;
+    ring->sq_array[idx] = idx;
+    ring->queued++;
+    return sqe;
+}
+
+/*
+ * Submits the queued requests and waits for all of their completions,
+ * handing each result to the files' state. Returns -1 if io_uring_enter()
+ * fails, leaving the ring broken.
+ */
+static int run(uring_t *ring, uring_file_t *files) {
+    unsigned expected = ring->queued;
+    unsigned submitted;
+    unsigned head;
+    int rv;
+
+    if (expected == 0) {
+        return 0;
+    }
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    submitted = ring->queued;
+    ring->queued = 0;
+
+    while (expected > 0) {
+        rv = sys_io_uring_enter(ring->fd, submitted, expected, IORING_ENTER_GETEVENTS);
+        if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            log_err("io_uring_enter() failed: %s. Loading files as usual.", strerror(errno));
+            ring->broken = 1;
+            return -1;
+        }
+        if (rv > 0) {
+            submitted -= (unsigned)rv < submitted ? (unsigned)rv : submitted;
+        }
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t file = (size_t)(cqe->user_data >> 2);
+
+            switch (cqe->user_data & 3) {
+                case OP_STATX:
+                    ring->st_res[file] = cqe->res;
+                    break;
+                case OP_OPEN:
+                    ring->fds[file] = cqe->res;
+                    break;
+                case OP_READ:
+                    if (cqe->res >= 0) {
+                        files[file].len = (size_t)cqe->res;
+                        files[file].buf[files[file].len] = '\0';
+                    } else {
+                        files[file].buf = NULL;
+                    }
+                    break;
+                case OP_CLOSE:
+                    break;
+            }
+            head++;
+            expected--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Buffer i, for len bytes plus a NUL, as mmap() leaves after the end
+ * of a file: the printing code may look one byte past a match at the
+ * end. Large buffers only last until the next batch.
+ */
+static char *get_buf(uring_t *ring, const size_t i, const size_t len) {
+    if (len + 1 > ring->bufs_size[i]) {
+        free(ring->bufs[i]);
+        ring->bufs_size[i] = ag_max(len + 1, ring->bufs_size[i] * 2);
+        ring->bufs[i] = ag_malloc(ring->bufs_size[i]);
+    }
+    return ring->bufs[i];
+}
+
+/* Whether a statx() result is a file we load here. */
+static int loadable(const struct statx *st, const uring_file_t *file) {
+    return S_ISREG(st->stx_mode) && st->stx_size > 0 && st->stx_size <= URING_MAX_FILE &&
+           (file->skip_ino == 0 || (ino_t)st->stx_ino != file->skip_ino) &&
+           (file->dev == 0 || makedev(st->stx_dev_major, st->stx_dev_minor) == file->dev);
+}
+
+/*
+ * Three rounds for the whole batch: statx() the paths; open the small
+ * regular files; then, for each file opened, a chain of statx() on the
+ * descriptor (as search_file() does with fstat(), against the file
+ * being swapped in between), read() and close(), hard-linked so that
+ * the descriptor is closed whatever happens before.
+ */
+int uring_load(uring_t *ring, uring_file_t *files, const size_t files_len) {
+    struct io_uring_sqe *sqe;
+    size_t i;
+
+    if (ring->broken) {
+        goto fail;
+    }
+
+    for (i = 0; i < URING_BATCH; i++) {
+        if (ring->bufs_size[i] > URING_BUF_KEEP) {
+            free(ring->bufs[i]);
+            ring->bufs[i] = NULL;
+            ring->bufs_size[i] = 0;
+        }
+    }
+
+    for (i = 0; i < files_len; i++) {
+        files[i].buf = NULL;
+        files[i].len = 0;
+        ring->fds[i] = -1;
+        ring->st_res[i] = -1;
+        sqe = get_sqe(ring, OP_STATX, i, AT_FDCWD, files[i].path, STATX_BASIC_STATS,
+                      (uintptr_t)&ring->path_st[i]);
+        sqe->opcode = IORING_OP_STATX;
+    }
+    if (run(ring, files) < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < files_len; i++) {
+        if (ring->st_res[i] == 0 && loadable(&ring->path_st[i], &files[i])) {
+            sqe = get_sqe(ring, OP_OPEN, i, AT_FDCWD, files[i].path, 0, 0);
+            sqe->opcode = IORING_OP_OPENAT;
+            /* Should it have become a FIFO since statx(), do not wait for a writer. */
+            sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+        }
+    }
+    if (run(ring, files) < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < files_len; i++) {
+        if (ring->fds[i] < 0) {
+            continue;
+        }
+        ring->st_res[i] = -1;
+        files[i].buf = get_buf(ring, i, ring->path_st[i].stx_size);
+
+        sqe = get_sqe(ring, OP_STATX, i, ring->fds[i], "", STATX_BASIC_STATS, (uintptr_t)&ring->fd_st[i]);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->statx_flags = AT_EMPTY_PATH;
+        sqe->flags = IOSQE_IO_HARDLINK;
+
+        sqe = get_sqe(ring, OP_READ, i, ring->fds[i], files[i].buf, (unsigned)ring->path_st[i].stx_size, 0);
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_IO_HARDLINK;
+
+        sqe = get_sqe(ring, OP_CLOSE, i, ring->fds[i], NULL, 0, 0);
+        sqe->opcode = IORING_OP_CLOSE;
+    }
+    if (run(ring, files) < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < files_len; i++) {
+        if (files[i].buf == NULL) {
+            continue;
+        }
+        /* Not the file we sized the buffer for: let the caller look again. */
+        if (ring->st_res[i] != 0 || !loadable(&ring->fd_st[i], &files[i]) ||
+            ring->fd_st[i].stx_ino != ring->path_st[i].stx_ino ||
+            ring->fd_st[i].stx_dev_major != ring->path_st[i].stx_dev_major ||
+            ring->fd_st[i].stx_dev_minor != ring->path_st[i].stx_dev_minor || files[i].len == 0) {
+            files[i].buf = NULL;
+            files[i].len = 0;
+        }
+    }
+    return 0;
+
+fail:
+    for (i = 0; i < files_len; i++) {
+        files[i].buf = NULL;
+        files[i].len = 0;
+    }
+    return -1;
+}
+
+#else
+
+uring_t *uring_new(void) {
+    return NULL;
+}
+
+void uring_free(uring_t *ring) {
+    (void)ring;
+}
+
+int uring_load(uring_t *ring, uring_file_t *files, const size_t files_len) {
+    size_t i;
+
+    (void)ring;
+    for (i = 0; i < files_len; i++) {
+        files[i].buf = NULL;
+        files[i].len = 0;
+    }
+    return -1;
+}
+
+#endif
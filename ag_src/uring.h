@@ -0,0 +1,59 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Batched file loading with io_uring, on Linux: a worker hands over a
+ * batch of paths, and gets back the contents of those that are small,
+ * regular files, read with a handful of io_uring_enter() calls for
+ * the whole batch instead of stat/open/fstat/mmap/munmap/close for
+ * each file. Everything else (FIFOs, empty or large files, errors) is
+ * left to the caller's usual path, so that it is handled, and logged,
+ * exactly as before.
+ *
+ * Built with the kernel's io_uring.h only, no liburing: uring_new()
+ * returns NULL wherever io_uring or the operations we need are not
+ * available (old kernels, seccomp filters, other systems).
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+/* statx, read and close operations: kernel 5.6 and up. */
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(STATX_BASIC_STATS)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+/* Files per batch, and the largest file worth loading this way. */
+#define URING_BATCH 16
+#define URING_MAX_FILE (1024 * 1024)
+/* Read buffers up to this size are kept for the next batch. */
+#define URING_BUF_KEEP (64 * 1024)
+
+typedef struct {
+    const char *path;
+    ino_t skip_ino; /* If not 0, this inode is left to the caller */
+    dev_t dev;      /* If not 0, files on other devices are left to the caller */
+    char *buf;      /* Contents and a NUL, or NULL if not loaded */
+    size_t len;
+} uring_file_t;
+
+typedef struct uring uring_t;
+
+uring_t *uring_new(void);
+void uring_free(uring_t *ring);
+
+/*
+ * Loads what it can of up to URING_BATCH files, see above. The buffers
+ * belong to the ring, and are only valid until the next batch. Returns
+ * -1, with nothing loaded, if the ring no longer works: the files are
+ * then all left to the caller, and so should the next batches be.
+ */
+int uring_load(uring_t *ring, uring_file_t *files, const size_t files_len);
+
+#endif
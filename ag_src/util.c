@@ -4,8 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
 #include "config.h"
+#include "simd.h"
 #include "util.h"
 
 #ifdef _WIN32
@@ -22,7 +26,6 @@
     return ptr;
 
 FILE *out_fd;
-ag_stats stats;
 
 void *ag_malloc(size_t size) {
     void *ptr = malloc(size);
@@ -184,6 +187,21 @@ void generate_hash(const char *find, const size_t f_len, uint8_t *h_table, const
     }
 }
 
+/*
+ * Compact form of the upper/lower pairs in the case-insensitive skip
+ * tables: 0x20 for each letter of the (lowercase) needle, 0 for any
+ * other byte. OR-ing it into the haystack folds only ASCII letters.
+ */
+void generate_case_mask(const char *find, const size_t f_len, uint8_t **case_mask) {
+    size_t i;
+    uint8_t *cm = ag_malloc(f_len);
+    *case_mask = cm;
+
+    for (i = 0; i < f_len; i++) {
+        cm[i] = (find[i] >= 'a' && find[i] <= 'z') ? 'a' - 'A' : 0;
+    }
+}
+
 /* Boyer-Moore strstr */
 const char *boyer_moore_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len,
                                 const size_t alpha_skip_lookup[], const size_t *find_skip_lookup, const int case_insensitive) {
@@ -240,23 +258,96 @@ NO_SANITIZE_ALIGNMENT const char *hash_strnstr(const char *s, const char *find,
     return NULL;
 }
 
-size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[], size_t matches_len) {
+void line_index_init(line_index_t *lines, const char *buf, const size_t buf_len) {
+    lines->buf = buf;
+    lines->buf_len = buf_len;
+    lines->blocks = NULL;
+    lines->blocks_len = 0;
+    lines->blocks_size = 0;
+    lines->last_offset = 0;
+    lines->last_line = 1;
+    lines->line_start = 1;
+    lines->line_end = 0;
+    lines->file_offset = 0;
+    lines->file_lines = 0;
+}
+
+void line_index_free(line_index_t *lines) {
+    free(lines->blocks);
+    lines->blocks = NULL;
+    lines->blocks_len = 0;
+    lines->blocks_size = 0;
+}
+
+size_t line_index_number(line_index_t *lines, const size_t offset) {
+    const size_t block = offset / LINE_INDEX_BLOCK;
+    const size_t block_start = block * LINE_INDEX_BLOCK;
+    size_t k;
+
+    if (offset >= lines->last_offset && offset - lines->last_offset <= offset - block_start) {
+        lines->last_line += simd_count(lines->buf + lines->last_offset, offset - lines->last_offset, '\n');
+    } else {
+        if (block >= lines->blocks_len) {
+            if (block >= lines->blocks_size) {
+                lines->blocks_size = ag_max(block + 1, lines->blocks_size * 2);
+                lines->blocks = ag_realloc(lines->blocks, lines->blocks_size * sizeof(size_t));
+            }
+            for (k = lines->blocks_len; k <= block; k++) {
+                lines->blocks[k] = k == 0 ? 0
+                                          : lines->blocks[k - 1] +
+                                                simd_count(lines->buf + (k - 1) * LINE_INDEX_BLOCK, LINE_INDEX_BLOCK, '\n');
+            }
+            lines->blocks_len = block + 1;
+        }
+        lines->last_line = lines->blocks[block] + 1 + simd_count(lines->buf + block_start, offset - block_start, '\n');
+    }
+    lines->last_offset = offset;
+    return lines->file_lines + lines->last_line;
+}
+
+static void line_index_bounds(line_index_t *lines, const size_t offset) {
+    const char *nl;
+    size_t lo = 0;
+    size_t hi = lines->buf_len;
+
+    if (offset >= lines->line_start && offset <= lines->line_end) {
+        return;
+    }
+    /* No need to look past the last line: its newline bounds this one. */
+    if (lines->line_start <= lines->line_end) {
+        if (offset > lines->line_end) {
+            lo = lines->line_end + 1;
+        } else {
+            hi = lines->line_start - 1;
+        }
+    }
+    nl = memrchr(lines->buf + lo, '\n', offset - lo);
+    lines->line_start = nl ? (size_t)(nl - lines->buf) + 1 : lo;
+    nl = memchr(lines->buf + offset, '\n', hi - offset);
+    lines->line_end = nl ? (size_t)(nl - lines->buf) : hi;
+}
+
+size_t line_index_start(line_index_t *lines, const size_t offset) {
+    line_index_bounds(lines, offset);
+    return lines->line_start;
+}
+
+size_t line_index_end(line_index_t *lines, const size_t offset) {
+    line_index_bounds(lines, offset);
+    return lines->line_end;
+}
+
+size_t invert_matches(line_index_t *lines, match_t matches[], size_t matches_len) {
+    const size_t buf_len = lines->buf_len;
     size_t i;
-    size_t match_read_index = 0;
     size_t inverted_match_count = 0;
     size_t inverted_match_start = 0;
     size_t last_line_end = 0;
+    size_t offset = 0;
     int in_inverted_match = TRUE;
-    match_t next_match;
 
     log_debug("Inverting %u matches.", matches_len);
 
-    if (matches_len > 0) {
-        next_match = matches[0];
-    } else {
-        next_match.start = buf_len + 1;
-    }
-
     /* No matches, so the whole buffer is now a match. */
     if (matches_len == 0) {
         matches[0].start = 0;
@@ -264,41 +355,43 @@ size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[],
         return 1;
     }
 
-    for (i = 0; i < buf_len; i++) {
-        if (i == next_match.start) {
-            i = next_match.end - 1;
-
-            match_read_index++;
+    /* Matches are read in place, as they are never behind the inverted ones being written. */
+    for (i = 0; i <= matches_len; i++) {
+        const size_t gap_end = i < matches_len ? ag_min(matches[i].start, buf_len) : buf_len;
+        /* The last byte of the buffer ends an inverted match rather than a line. */
+        const size_t lines_end = ag_min(gap_end, buf_len - 1);
 
-            if (match_read_index < matches_len) {
-                next_match = matches[match_read_index];
+        if (i < matches_len && matches[i].start < offset) {
+            continue;
+        }
+        if (offset < lines_end && line_index_end(lines, offset) < lines_end) {
+            if (!in_inverted_match) {
+                inverted_match_start = line_index_end(lines, offset) + 1;
             }
-
-            if (in_inverted_match && last_line_end > inverted_match_start) {
+            in_inverted_match = TRUE;
+            last_line_end = line_index_start(lines, lines_end);
+        }
+        if (gap_end == buf_len) {
+            if (offset < buf_len && in_inverted_match) {
                 matches[inverted_match_count].start = inverted_match_start;
-                matches[inverted_match_count].end = last_line_end - 1;
-
+                matches[inverted_match_count].end = buf_len - 1;
                 inverted_match_count++;
             }
+            break;
+        }
 
-            in_inverted_match = FALSE;
-        } else if (i == buf_len - 1 && in_inverted_match) {
+        const size_t match_start = matches[i].start;
+        const size_t match_end = matches[i].end;
+        if (in_inverted_match && last_line_end > inverted_match_start) {
             matches[inverted_match_count].start = inverted_match_start;
-            matches[inverted_match_count].end = i;
-
+            matches[inverted_match_count].end = last_line_end - 1;
             inverted_match_count++;
-        } else if (buf[i] == '\n') {
-            last_line_end = i + 1;
-
-            if (!in_inverted_match) {
-                inverted_match_start = last_line_end;
-            }
-
-            in_inverted_match = TRUE;
         }
+        in_inverted_match = FALSE;
+        offset = match_end > match_start ? match_end : match_start;
     }
 
-    for (i = 0; i < matches_len; i++) {
+    for (i = 0; i < inverted_match_count; i++) {
         log_debug("Inverted match %i start %i end %i.", i, matches[i].start, matches[i].end);
     }
 
@@ -314,26 +407,17 @@ void realloc_matches(match_t **matches, size_t *matches_size, size_t matches_len
     *matches = ag_realloc(*matches, *matches_size * sizeof(match_t));
 }
 
-void compile_study(pcre **re, pcre_extra **re_extra, char *q, const int pcre_opts, const int study_opts) {
-    const char *pcre_err = NULL;
-    int pcre_err_offset = 0;
-
-    *re = pcre_compile(q, pcre_opts, &pcre_err, &pcre_err_offset, NULL);
-    if (*re == NULL) {
-        die("Bad regex! pcre_compile() failed at position %i: %s\nIf you meant to search for a literal string, run ag with -Q",
-            pcre_err_offset,
-            pcre_err);
-    }
-    *re_extra = pcre_study(*re, study_opts, &pcre_err);
-    if (*re_extra == NULL) {
-        log_debug("pcre_study returned nothing useful. Error: %s", pcre_err);
-    }
-}
+#define IS_PRINTABLE(c) ((c) >= 32 && (c) <= 127)
 
-/* This function is very hot. It's called on every file. */
-int is_binary(const void *buf, const size_t buf_len) {
+/*
+ * This function is very hot. It's called on every file. Only the first
+ * window bytes are looked at, and runs of plain text are skipped a
+ * vector at a time: the byte by byte walk below only starts at control
+ * bytes and non-ASCII ones.
+ */
+int is_binary(const void *buf, const size_t buf_len, const size_t window) {
     size_t suspicious_bytes = 0;
-    size_t total_bytes = buf_len > 512 ? 512 : buf_len;
+    size_t total_bytes = buf_len > window ? window : buf_len;
     const unsigned char *buf_c = buf;
     size_t i;
 
@@ -353,6 +437,13 @@ int is_binary(const void *buf, const size_t buf_len) {
     }
 
     for (i = 0; i < total_bytes; i++) {
+        /* Only worth a call if this looks like a run of text, and not the odd printable byte of binary data. */
+        if (i + 8 < total_bytes && IS_PRINTABLE(buf_c[i]) && IS_PRINTABLE(buf_c[i + 8])) {
+            i += simd_text_prefix((const char *)buf_c + i, total_bytes - i);
+            if (i == total_bytes) {
+                break;
+            }
+        }
         if (buf_c[i] == '\0') {
             /* NULL char. It's binary */
             return 1;
@@ -371,15 +462,14 @@ int is_binary(const void *buf, const size_t buf_len) {
                 }
             }
             suspicious_bytes++;
-            /* Disk IO is so slow that it's worthwhile to do this calculation after every suspicious byte. */
-            /* This is true even on a 1.6Ghz Atom with an Intel 320 SSD. */
+            /* More than 10% suspicious bytes, i.e. (suspicious_bytes * 100) / total_bytes > 10, without a division. */
             /* Read at least 32 bytes before making a decision */
-            if (i >= 32 && (suspicious_bytes * 100) / total_bytes > 10) {
+            if (i >= 32 && suspicious_bytes * 100 >= total_bytes * 11) {
                 return 1;
             }
         }
     }
-    if ((suspicious_bytes * 100) / total_bytes > 10) {
+    if (suspicious_bytes * 100 >= total_bytes * 11) {
         return 1;
     }
 
@@ -406,6 +496,228 @@ int is_regex(const char *query) {
     return (strpbrk(query, regex_chars) != NULL);
 }
 
+/*
+ * Length of the quantifier at q, 0 if there is none, or -1 if it is not one
+ * we understand. *optional is set if it allows zero repetitions.
+ */
+static int regex_quantifier(const char *q, int *optional) {
+    const char *p = q;
+
+    if (*p == '*' || *p == '?') {
+        *optional = 1;
+        p++;
+    } else if (*p == '+') {
+        *optional = 0;
+        p++;
+    } else if (*p == '{') {
+        p++;
+        if (!isdigit((unsigned char)*p)) {
+            return -1;
+        }
+        *optional = 1;
+        for (; isdigit((unsigned char)*p); p++) {
+            if (*p != '0') {
+                *optional = 0;
+            }
+        }
+        if (*p == ',') {
+            for (p++; isdigit((unsigned char)*p); p++) {
+            }
+        }
+        if (*p != '}') {
+            return -1;
+        }
+        p++;
+    } else {
+        return 0;
+    }
+    /* Lazy or possessive */
+    if (*p == '?' || *p == '+') {
+        p++;
+    }
+    return (int)(p - q);
+}
+
+/*
+ * Finds the longest run of literal bytes that every match of the regex must
+ * contain, so that buffers without it need not be searched with PCRE. Only a
+ * conservative subset of the syntax is understood: for anything else, for
+ * top-level alternations, or if the run is shorter than REGEX_LITERAL_MIN
+ * bytes, returns NULL. The literal is lowercase if case_insensitive.
+ *
+ * *in_line is set if no match can span more than one line, and if the
+ * regex matches the same way whether the subject is a whole buffer or a
+ * single line of it (so no \A, \z, etc.).
+ */
+char *regex_literal(const char *query, const int case_insensitive, int *in_line) {
+    const size_t q_len = strlen(query);
+    char *run = ag_malloc(q_len + 1);
+    char *best = ag_malloc(q_len + 1);
+    size_t run_len = 0;
+    size_t best_len = 0;
+    const char *p = query;
+    int depth = 0;
+    int optional = 0;
+    int q;
+
+    *in_line = 1;
+    while (*p != '\0') {
+        const unsigned char c = (unsigned char)*p;
+        int literal = -1; /* The byte this atom matches, if only one */
+
+        if (c < 0x20) {
+            *in_line = 0;
+        }
+        if (c == '\\') {
+            const unsigned char e = (unsigned char)p[1];
+            if (e == '\0') {
+                goto fail;
+            }
+            if (isalnum(e)) {
+                /* Escapes that match a class or an assertion; others (\x, \Q,
+                 * back references, ...) need more parsing than this. */
+                if (!strchr("dDwWsShHvVRNbBAzZG", e)) {
+                    goto fail;
+                }
+                if (!strchr("dwhNbB", e)) {
+                    *in_line = 0;
+                }
+            } else {
+                literal = e;
+            }
+            p += 2;
+        } else if (c == '[') {
+            p++;
+            if (*p == '^') {
+                *in_line = 0;
+                p++;
+            }
+            if (*p == ']') {
+                p++;
+            }
+            while (*p != '\0' && *p != ']') {
+                if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+                    const char *end = strchr(p + 2, p[1]);
+                    if (end == NULL || end[1] != ']') {
+                        goto fail;
+                    }
+                    p = end + 2;
+                } else if (*p == '\\') {
+                    if (p[1] == '\0' || p[1] == 'Q') {
+                        goto fail;
+                    }
+                    if (isalnum((unsigned char)p[1]) && !strchr("dwh", p[1])) {
+                        *in_line = 0;
+                    }
+                    p += 2;
+                } else {
+                    if ((unsigned char)*p < 0x20) {
+                        *in_line = 0;
+                    }
+                    p++;
+                }
+            }
+            if (*p != ']') {
+                goto fail;
+            }
+            p++;
+        } else if (c == '(') {
+            /* Options, lookarounds, named groups and verbs are left to PCRE. */
+            if (p[1] == '?' || p[1] == '*') {
+                goto fail;
+            }
+            depth++;
+            p++;
+            if (run_len > best_len) {
+                memcpy(best, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+            continue;
+        } else if (c == ')') {
+            if (depth == 0) {
+                goto fail;
+            }
+            depth--;
+            p++;
+        } else if (c == '|') {
+            /* Nothing is required by every branch of a top-level alternation. */
+            if (depth == 0) {
+                goto fail;
+            }
+            p++;
+            continue;
+        } else if (c == '*' || c == '+' || c == '?' || c == '{') {
+            goto fail;
+        } else if (c == '.' || c == '^' || c == '$') {
+            p++;
+        } else {
+            literal = c;
+            p++;
+        }
+
+        q = regex_quantifier(p, &optional);
+        if (q < 0) {
+            goto fail;
+        }
+        p += q;
+
+        if (depth == 0 && literal >= 0 && (q == 0 || !optional)) {
+            run[run_len++] = case_insensitive ? (char)tolower(literal) : (char)literal;
+        }
+        /* A repeated byte is required, but whatever follows it is not adjacent
+         * to the bytes before it. */
+        if (depth > 0 || literal < 0 || q > 0) {
+            if (run_len > best_len) {
+                memcpy(best, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+    }
+    if (depth != 0) {
+        goto fail;
+    }
+    if (run_len > best_len) {
+        memcpy(best, run, run_len);
+        best_len = run_len;
+    }
+    free(run);
+    if (best_len < REGEX_LITERAL_MIN) {
+        free(best);
+        return NULL;
+    }
+    best[best_len] = '\0';
+    return best;
+
+fail:
+    free(run);
+    free(best);
+    return NULL;
+}
+
+/*
+ * Whether a match of the regex that does not span lines is found the same
+ * way whether the subject is its line alone or the whole buffer: that is,
+ * whether the regex has no lookarounds, no \A, \z, \Z, \G or \K, and no
+ * options or verbs (such as (?s), which lets '.' match newlines).
+ */
+int regex_line_local(const char *query) {
+    const char *p;
+
+    for (p = query; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0' || strchr("AzZGK", p[1])) {
+                return 0;
+            }
+            p++;
+        } else if (*p == '(' && (p[1] == '*' || (p[1] == '?' && p[2] != ':'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 int is_fnmatch(const char *filename) {
     char fnmatch_chars[] = {
         '!',
@@ -467,6 +779,29 @@ int is_lowercase(const char *s) {
     return TRUE;
 }
 
+/*
+ * Fills in the type of d when readdir() could not tell it or, when
+ * following symlinks, replaces a symlink's with the type of what it points
+ * to, with a single fstatat() relative to the directory. Afterwards,
+ * is_directory(), is_symlink() and is_named_pipe() need no stat() of their
+ * own. On errors, d is left as it was.
+ */
+void resolve_dirent_type(int dir_fd, struct dirent *d, int follow_symlinks) {
+#if defined(HAVE_DIRENT_DTYPE) && !defined(_WIN32)
+    struct stat s;
+    if (d->d_type != DT_UNKNOWN && !(d->d_type == DT_LNK && follow_symlinks)) {
+        return;
+    }
+    if (fstatat(dir_fd, d->d_name, &s, follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+        d->d_type = IFTODT(s.st_mode);
+    }
+#else
+    (void)dir_fd;
+    (void)d;
+    (void)follow_symlinks;
+#endif
+}
+
 int is_directory(const char *path, const struct dirent *d) {
 #ifdef HAVE_DIRENT_DTYPE
     /* Some filesystems, e.g. ReiserFS, always return a type DT_UNKNOWN from readdir or scandir. */
@@ -624,13 +959,9 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
 }
 #endif
 
-ssize_t buf_getline(const char **line, const char *buf, const size_t buf_len, const size_t buf_offset) {
-    const char *cur = buf + buf_offset;
-    ssize_t i;
-    for (i = 0; (buf_offset + i < buf_len) && cur[i] != '\n'; i++) {
-    }
-    *line = cur;
-    return i;
+ssize_t buf_getline(const char **line, line_index_t *lines, const size_t buf_offset) {
+    *line = lines->buf + buf_offset;
+    return line_index_end(lines, buf_offset) - buf_offset;
 }
 
 #ifndef HAVE_REALPATH
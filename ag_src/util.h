@@ -2,7 +2,6 @@
 #define UTIL_H
 
 #include <dirent.h>
-#include <pcre.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,6 +9,7 @@
 
 #include "config.h"
 #include "log.h"
+#include "re.h"
 #include "options.h"
 
 extern FILE *out_fd;
@@ -39,8 +39,37 @@ char *ag_strndup(const char *s, size_t size);
 typedef struct {
     size_t start; /* Byte at which the match starts */
     size_t end;   /* and where it ends */
+    int pattern;  /* Pattern that matched, in multi-pattern searches */
 } match_t;
 
+/*
+ * Line lookups on a buffer. Line numbers count newlines with simd_count(),
+ * from the closest of the previous lookup and a checkpoint every
+ * LINE_INDEX_BLOCK bytes, and checkpoints are only counted as far as a
+ * lookup needs them. Line bounds come from memchr() and memrchr(), and
+ * the bounds of the last line looked up are kept, so walking over the
+ * matches of a long line does not scan it again for each one.
+ *
+ * Offsets are relative to buf, but line numbers are relative to the file:
+ * when buf is a chunk of it, file_lines are the lines before buf, and
+ * file_offset is where buf starts.
+ */
+#define LINE_INDEX_BLOCK 4096
+
+typedef struct {
+    const char *buf;
+    size_t buf_len;
+    size_t *blocks;      /* Newlines before each LINE_INDEX_BLOCK bytes */
+    size_t blocks_len;
+    size_t blocks_size;
+    size_t last_offset;  /* Last line number looked up, and where */
+    size_t last_line;
+    size_t line_start;   /* Last line bounds looked up (empty if start > end) */
+    size_t line_end;
+    size_t file_offset;
+    size_t file_lines;
+} line_index_t;
+
 typedef struct {
     size_t total_bytes;
     size_t total_files;
@@ -50,9 +79,6 @@ typedef struct {
     struct timeval time_end;
 } ag_stats;
 
-
-extern ag_stats stats;
-
 /* Union to translate between chars and words without violating strict aliasing */
 typedef union {
     char as_chars[sizeof(uint16_t)];
@@ -66,6 +92,7 @@ int is_prefix(const char *s, const size_t s_len, const size_t pos, const int cas
 size_t suffix_len(const char *s, const size_t s_len, const size_t pos, const int case_sensitive);
 void generate_find_skip(const char *find, const size_t f_len, size_t **skip_lookup, const int case_sensitive);
 void generate_hash(const char *find, const size_t f_len, uint8_t *H, const int case_sensitive);
+void generate_case_mask(const char *find, const size_t f_len, uint8_t **case_mask);
 
 /* max is already defined on spec-violating compilers such as MinGW */
 size_t ag_max(size_t a, size_t b);
@@ -75,13 +102,24 @@ const char *boyer_moore_strnstr(const char *s, const char *find, const size_t s_
                                 const size_t alpha_skip_lookup[], const size_t *find_skip_lookup, const int case_insensitive);
 const char *hash_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, uint8_t *h_table, const int case_sensitive);
 
-size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[], size_t matches_len);
+void line_index_init(line_index_t *lines, const char *buf, const size_t buf_len);
+void line_index_free(line_index_t *lines);
+/* Line of the byte at offset, starting at 1 (plus file_lines). */
+size_t line_index_number(line_index_t *lines, const size_t offset);
+/* Where the line of the byte at offset starts, and where its newline (or the buffer) ends. */
+size_t line_index_start(line_index_t *lines, const size_t offset);
+size_t line_index_end(line_index_t *lines, const size_t offset);
+
+size_t invert_matches(line_index_t *lines, match_t matches[], size_t matches_len);
 void realloc_matches(match_t **matches, size_t *matches_size, size_t matches_len);
-void compile_study(pcre **re, pcre_extra **re_extra, char *q, const int pcre_opts, const int study_opts);
 
 
-int is_binary(const void *buf, const size_t buf_len);
+int is_binary(const void *buf, const size_t buf_len, const size_t window);
 int is_regex(const char *query);
+/* Shortest literal worth prefiltering a regex with. */
+#define REGEX_LITERAL_MIN 3
+char *regex_literal(const char *query, const int case_insensitive, int *in_line);
+int regex_line_local(const char *query);
 int is_fnmatch(const char *filename);
 int binary_search(const char *needle, char **haystack, int start, int end);
 
@@ -90,6 +128,7 @@ int is_wordchar(char ch);
 
 int is_lowercase(const char *s);
 
+void resolve_dirent_type(int dir_fd, struct dirent *d, int follow_symlinks);
 int is_directory(const char *path, const struct dirent *d);
 int is_symlink(const char *path, const struct dirent *d);
 int is_named_pipe(const char *path, const struct dirent *d);
@@ -98,7 +137,7 @@ void die(const char *fmt, ...);
 
 void ag_asprintf(char **ret, const char *fmt, ...);
 
-ssize_t buf_getline(const char **line, const char *buf, const size_t buf_len, const size_t buf_offset);
+ssize_t buf_getline(const char **line, line_index_t *lines, const size_t buf_offset);
 
 #ifndef HAVE_FGETLN
 char *fgetln(FILE *fp, size_t *lenp);
@@ -86,6 +86,19 @@ DEFINE_GETTER_AND_SETTER(ag_config, num_workers,         int32)
 DEFINE_GETTER_AND_SETTER(ag_config, workers_behavior,    int32)
 DEFINE_GETTER_AND_SETTER(ag_config, stats,               int32)
 DEFINE_GETTER_AND_SETTER(ag_config, search_binary_files, int32)
+DEFINE_GETTER_AND_SETTER(ag_config, work_queue,          int32)
+DEFINE_GETTER_AND_SETTER(ag_config, callback_thread,     int32)
+DEFINE_GETTER_AND_SETTER(ag_config, timeout_ms,          int32)
+DEFINE_GETTER_AND_SETTER(ag_config, max_matches,         int32)
+DEFINE_GETTER_AND_SETTER(ag_config, max_files,           int32)
+DEFINE_GETTER_AND_SETTER(ag_config, match_text,          int32)
+DEFINE_GETTER_AND_SETTER(ag_config, utf8,                int32)
+DEFINE_GETTER_AND_SETTER(ag_config, match_lines,         int32)
+DEFINE_GETTER_AND_SETTER(ag_config, context_before,      int32)
+DEFINE_GETTER_AND_SETTER(ag_config, context_after,       int32)
+DEFINE_GETTER_AND_SETTER(ag_config, binary_window,       int32)
+DEFINE_GETTER_AND_SETTER(ag_config, io_uring,            int32)
+DEFINE_GETTER_AND_SETTER(ag_config, disable_multiline,   int32)
 DEFINE_STRUCT(ag_config,
 	{
 		DECLARE_NAPI_FIELD(literal),
@@ -94,7 +107,20 @@ DEFINE_STRUCT(ag_config,
 		DECLARE_NAPI_FIELD(num_workers),
 		DECLARE_NAPI_FIELD(workers_behavior),
 		DECLARE_NAPI_FIELD(stats),
-		DECLARE_NAPI_FIELD(search_binary_files)
+		DECLARE_NAPI_FIELD(search_binary_files),
+		DECLARE_NAPI_FIELD(work_queue),
+		DECLARE_NAPI_FIELD(callback_thread),
+		DECLARE_NAPI_FIELD(timeout_ms),
+		DECLARE_NAPI_FIELD(max_matches),
+		DECLARE_NAPI_FIELD(max_files),
+		DECLARE_NAPI_FIELD(match_text),
+		DECLARE_NAPI_FIELD(utf8),
+		DECLARE_NAPI_FIELD(match_lines),
+		DECLARE_NAPI_FIELD(context_before),
+		DECLARE_NAPI_FIELD(context_after),
+		DECLARE_NAPI_FIELD(binary_window),
+		DECLARE_NAPI_FIELD(io_uring),
+		DECLARE_NAPI_FIELD(disable_multiline)
 	}
 )
 
@@ -445,8 +471,12 @@ static napi_value wrap_ag_search(napi_env env, napi_callback_info info)
 			status = napi_create_sizet(env, func_ret[i]->matches[j]->byte_end,
 				&js_mat_bend);
 			if (status != napi_ok) goto out3;
-			status = napi_create_string_utf8(env, func_ret[i]->matches[j]->match,
-				NAPI_AUTO_LENGTH, &js_mat_match);
+			/* No text with LIBAG_MATCH_OFFSETS. */
+			if (func_ret[i]->matches[j]->match)
+				status = napi_create_string_utf8(env, func_ret[i]->matches[j]->match,
+					NAPI_AUTO_LENGTH, &js_mat_match);
+			else
+				status = napi_get_null(env, &js_mat_match);
 			if (status != napi_ok) goto out3;
 
 			/* Add names to them. */
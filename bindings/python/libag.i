@@ -57,6 +57,11 @@
 	$2[i] = 0;
 }
 
+/*
+ * Same for the pattern list of ag_search_multi().
+ */
+%apply (int npaths, char **target_paths) { (int nqueries, char **queries) };
+
 /*
  * Complementary typemap from the above typemap =).
  */
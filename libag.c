@@ -17,10 +17,14 @@
 #include "libag.h"
 
 #include <ctype.h>
-#include <pcre.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #ifdef _WIN32
@@ -38,17 +42,6 @@
 #include "search.h"
 #include "util.h"
 
-typedef struct {
-    pthread_t thread;
-    int id;
-} worker_t;
-
-/**
- * @brief Worker list.
- */
-static worker_t *workers = NULL;
-static int workers_len;
-
 /**
  * @brief Indicator that Ag is being used as a library.
  */
@@ -61,28 +54,179 @@ int has_ag_init;
  * on its own result list that latter will be joined in
  * a single list.
  */
-static struct thrd_result
+struct thrd_result
 {
 	size_t capacity;
 	size_t nresults;
 	struct ag_result **results;
-} thrd_rslt[NUM_WORKERS + 1];
+};
+
+/**
+ * @brief Per-thread flat result (ag_search_flat): same
+ * idea as @ref thrd_result, but kept as plain arrays,
+ * joined into a single struct ag_flat_result at the end
+ * of the search. Offsets and indexes are local to the
+ * thread until then.
+ */
+struct thrd_flat
+{
+	struct ag_flat_file *files;
+	size_t nfiles;
+	size_t files_cap;
+	struct ag_flat_match *matches;
+	size_t nmatches;
+	size_t matches_cap;
+	char *pool;
+	size_t pool_size;
+	size_t pool_cap;
+};
+
+/**
+ * @brief Chunk of result memory, see @ref result_arena.
+ */
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+};
 
 /**
- * In-memory copy of user-defined ag_config.
+ * @brief Memory for all the results of a search.
  *
- * Notes:
- * Although ag_config is almost an alias for Ag's cli_options structure,
- * it's also a good idea to keep an in-memory copy of the user-defined
- * config, since we can add our own options in it that do not depends
- * on the cli_options struct.
+ * Each worker bump-allocates the results it finds from its
+ * own list of chunks, so recording a result takes at most
+ * one allocation, and no locking. The arena belongs to the
+ * results returned by the search, and is released once all
+ * of them are freed: at once by @ref ag_free_all_results,
+ * in O(chunks), or one by one by @ref ag_free_result.
  */
-static struct ag_config config;
+struct result_arena
+{
+	struct arena_chunk *chunks[NUM_WORKERS + 1];
+	size_t live;    /* Results not freed yet.                   */
+	size_t nmapped; /* Results with their file mapped, if any.  */
+};
 
-/*
- * @brief Mutex for safe-thread search.
+/**
+ * @brief A result as allocated by libag: the public result
+ * struct, preceded by the arena it belongs to, or NULL if
+ * it was allocated on its own (streamed results, owned by
+ * the callback), and by the mapping of its file, if any
+ * (see @ref ag_result_map).
+ */
+struct result_block
+{
+	struct result_arena *arena;
+	void *map;
+	size_t map_size;
+	struct ag_result result;
+};
+
+#define RESULT_BLOCK(r) \
+	((struct result_block *)((char *)(r) - offsetof(struct result_block, result)))
+
+/* Arena chunk size and allocation alignment. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN(x) (((x) + 15) & ~(size_t)15)
+#define ARENA_CHUNK_HDR ARENA_ALIGN(sizeof(struct arena_chunk))
+
+/**
+ * @brief Results waiting for the dispatcher thread, when
+ * the search callback is not invoked by the workers
+ * (LIBAG_CB_DISPATCHER).
+ */
+struct cb_dispatch
+{
+	size_t capacity;
+	size_t nresults;
+	struct ag_result **results;
+	int done;
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+};
+
+/**
+ * @brief libag search context.
+ *
+ * A search context owns everything a search needs: the
+ * compiled query and its skip tables, the ignore tree,
+ * the work queue and the per-worker results. Since
+ * nothing here is shared, different contexts can search
+ * at the same time without blocking each other.
+ *
+ * The worker threads, on the other hand, are shared by
+ * all contexts: each queued file is tagged with its
+ * context, and each search completes as soon as its own
+ * files are searched.
+ *
+ * The legacy API (ag_search & friends) operates on a
+ * single global context, @ref global_ctx.
+ */
+struct ag_ctx
+{
+	/* Ag-side search state, must be the first member. */
+	search_ctx_t search;
+
+	/*
+	 * In-memory copy of user-defined ag_config.
+	 *
+	 * Notes:
+	 * Although ag_config is almost an alias for Ag's cli_options
+	 * structure, it's also a good idea to keep an in-memory copy of
+	 * the user-defined config, since we can add our own options in
+	 * it that do not depends on the cli_options struct.
+	 */
+	struct ag_config config;
+
+	/* Per-thread results, and the memory they are allocated from. */
+	struct thrd_result thrd_rslt[NUM_WORKERS + 1];
+	struct result_arena *arena;
+
+	/* Flat results: if set, results go to thrd_flat instead. */
+	int flat;
+	struct thrd_flat thrd_flat[NUM_WORKERS + 1];
+
+	/* Multi-pattern search: if set, searched instead of the query. */
+	char **queries;
+	int nqueries;
+
+	/* Streaming results: if set, results go to the callback. */
+	ag_result_cb callback;
+	void *userdata;
+	struct cb_dispatch dispatch;
+
+	/* Mutex for safe-thread search. */
+	pthread_mutex_t search_mtx;
+};
+
+/**
+ * @brief Global context, used by the non-ctx routines.
+ */
+static struct ag_ctx global_ctx;
+
+/**
+ * @brief Worker list, shared by all contexts.
+ */
+static worker_t *workers = NULL;
+static int workers_len;
+
+/**
+ * @brief Number of searches currently using the workers,
+ * protected by @ref pool_mtx.
+ */
+static int pool_users;
+static pthread_mutex_t pool_mtx;
+
+/**
+ * @brief Protects the global configuration from @ref ag_set_config
+ * while @ref ag_search_ts takes a copy of it. Statically initialized,
+ * as ag_set_config may be called before ag_init.
  */
-static pthread_mutex_t search_mtx;
+static pthread_mutex_t config_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int shutdown_workers(void);
 
 /*
  * ============================================================================
@@ -94,14 +238,18 @@ static pthread_mutex_t search_mtx;
  * @brief Reset the per-thread result for its default
  * values.
  *
+ * @param ctx Search context.
  * @param reset If != 0, allocates new memory for the list,
  *              if 0, do the default behavior.
  *
  * @return Return 0 if success, -1 otherwise.
  */
-static int reset_local_results(int reset)
+static int reset_local_results(struct ag_ctx *ctx, int reset)
 {
+	struct thrd_result *thrd_rslt;
 	int i;
+
+	thrd_rslt = ctx->thrd_rslt;
 	for (i = 0; i <= NUM_WORKERS; i++)
 	{
 		thrd_rslt[i].capacity = 100;
@@ -124,311 +272,2058 @@ static int reset_local_results(int reset)
 }
 
 /**
- * @brief For a given number of matches @p matches_len
- * in the current processed file @p file, save the
- * findings in the per-thread result.
+ * @brief Allocates @p size bytes from the chunks of the
+ * worker @p worker_id in the arena @p arena.
  *
+ * @param arena Result arena.
  * @param worker_id Current thread.
- * @param file Processed file with the matches found.
- * @param matches Matches list.
- * @param matches_len Matches list length.
- * @param buf File read buffer.
- * @param flags Optional flags, such as binary file indicator.
+ * @param size Allocation size.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Returns the allocated memory, or NULL if error.
  */
-int add_local_result(int worker_id, const char *file,
-	const match_t matches[], const size_t matches_len,
-	const char *buf, int flags)
+static void *arena_alloc(struct result_arena *arena, int worker_id,
+	size_t size)
 {
-	struct thrd_result *t_rslt;
-	struct ag_result **ag_rslt;
-	size_t i;
-	int idx;
-
-	if (!matches_len)
-		return (0);
+	struct arena_chunk *chunk;
+	struct arena_chunk *head;
+	size_t chunk_size;
+	void *ptr;
 
-	t_rslt  = &thrd_rslt[worker_id];
-	ag_rslt = t_rslt->results;
+	size = ARENA_ALIGN(size);
+	head = arena->chunks[worker_id];
 
-	/* Grow. */
-	if (t_rslt->nresults >= t_rslt->capacity)
+	if (!head || head->size - head->used < size)
 	{
-		ag_rslt = realloc(ag_rslt,
-			sizeof(struct ag_result *) * (t_rslt->capacity * 2));
-		if (!ag_rslt)
-			return (-1);
+		chunk_size = ARENA_CHUNK_HDR + size;
+		if (chunk_size < ARENA_CHUNK_SIZE)
+			chunk_size = ARENA_CHUNK_SIZE;
 
-		t_rslt->results   = ag_rslt;
-		t_rslt->capacity *= 2;
+		chunk = malloc(chunk_size);
+		if (!chunk)
+			return (NULL);
+
+		chunk->size = chunk_size;
+		chunk->used = ARENA_CHUNK_HDR;
+
+		/*
+		 * Big results get a chunk of their own, kept behind the
+		 * current one, so that what is left of it is not wasted.
+		 */
+		if (head && size > ARENA_CHUNK_SIZE / 4)
+		{
+			chunk->next = head->next;
+			head->next  = chunk;
+		}
+		else
+		{
+			chunk->next = head;
+			arena->chunks[worker_id] = chunk;
+		}
 	}
+	else
+		chunk = head;
 
-	idx = t_rslt->nresults;
+	ptr = (char *)chunk + chunk->used;
+	chunk->used += size;
+	return (ptr);
+}
 
-	/* Allocate and add a new result. */
-	ag_rslt[idx] = malloc(sizeof(struct ag_result));
-	if (!ag_rslt[idx])
-		return (-1);
+/**
+ * @brief Frees the arena @p arena and all its chunks.
+ *
+ * @param arena Result arena.
+ */
+static void free_arena(struct result_arena *arena)
+{
+	struct arena_chunk *chunk;
+	struct arena_chunk *next;
+	int i;
 
-	ag_rslt[idx]->file = strdup(file);
-	if (!ag_rslt[idx]->file)
-		return (-1);
+	if (!arena)
+		return;
+
+	for (i = 0; i <= NUM_WORKERS; i++)
+	{
+		for (chunk = arena->chunks[i]; chunk; chunk = next)
+		{
+			next = chunk->next;
+			free(chunk);
+		}
+	}
+	free(arena);
+}
+
+/**
+ * @brief Releases @p nresults results of the arena @p arena,
+ * freeing it once none is left.
+ *
+ * @param arena Result arena.
+ * @param nresults Number of results released.
+ */
+static void release_arena(struct result_arena *arena, size_t nresults)
+{
+	if (__atomic_sub_fetch(&arena->live, nresults, __ATOMIC_ACQ_REL))
+		return;
+	free_arena(arena);
+}
+
+/**
+ * @brief Finds the bounds of the line(s) the match @p m
+ * lies on, extended by up to @p before lines before and
+ * @p after lines after them.
+ *
+ * @param lines File read buffer lines.
+ * @param m Match.
+ * @param before Lines before.
+ * @param after Lines after.
+ * @param start Where the first line starts.
+ * @param end Where the last line ends (its newline, or
+ *            the end of the buffer).
+ */
+static void line_bounds(line_index_t *lines, const match_t *m, int before,
+	int after, size_t *start, size_t *end)
+{
+	size_t from;
 
-	ag_rslt[idx]->nmatches = matches_len;
-	ag_rslt[idx]->flags = flags;
+	/* The line of its last byte (or of its start, if empty). */
+	from = m->end > m->start ? m->end - 1 : m->start;
 
-	/* Allocate and adds the matches into the matches list. */
-	ag_rslt[idx]->matches = malloc(sizeof(struct ag_match *) * (matches_len+1));
-	if (!ag_rslt[idx]->matches)
-		return (-1);
+	*start = line_index_start(lines, m->start);
+	*end   = line_index_end(lines, from);
+
+	for (; before > 0 && *start > 0; before--)
+		*start = line_index_start(lines, *start - 1);
+	for (; after > 0 && *end + 1 < lines->buf_len; after--)
+		*end = line_index_end(lines, *end + 1);
+}
+
+/**
+ * @brief Sets the line information of each match, see
+ * struct ag_match.
+ *
+ * @param match Result matches.
+ * @param matches Matches list.
+ * @param matches_len Matches list length.
+ * @param lines File read buffer lines.
+ * @param config Search configuration.
+ * @param str Where to copy the context lines, if asked
+ *            to; must fit all of them.
+ */
+static void set_match_lines(struct ag_match *match,
+	const match_t matches[], const size_t matches_len, line_index_t *lines,
+	const struct ag_config *config, char *str)
+{
+	size_t len;
+	size_t i;
 
 	for (i = 0; i < matches_len; i++)
 	{
-		ag_rslt[idx]->matches[i] = malloc(sizeof(struct ag_match));
-		ag_rslt[idx]->matches[i]->byte_start = matches[i].start;
-		ag_rslt[idx]->matches[i]->byte_end = matches[i].end - 1;
+		line_bounds(lines, &matches[i], 0, 0, &match[i].line_start,
+			&match[i].line_end);
+
+		if (config->match_lines || config->context_before ||
+			config->context_after)
+		{
+			match[i].line_no = line_index_number(lines, matches[i].start);
+			match[i].column  = matches[i].start - match[i].line_start + 1;
+		}
 
-		/* Reserve space for the match string and copy. */
-		ag_rslt[idx]->matches[i]->match = calloc(1,
-			sizeof(char) * ((matches[i].end - matches[i].start) + 1));
+		if (!config->context_before && !config->context_after)
+			continue;
 
-		if (!ag_rslt[idx]->matches[i]->match)
-			return (-1);
+		line_bounds(lines, &matches[i], config->context_before,
+			config->context_after, &match[i].context_start,
+			&match[i].context_end);
 
-		memcpy(ag_rslt[idx]->matches[i]->match, buf + matches[i].start,
-			(matches[i].end - matches[i].start));
+		if (config->match_text == LIBAG_MATCH_OFFSETS)
+			continue;
+
+		len = match[i].context_end - match[i].context_start;
+		match[i].context = str;
+		memcpy(str, lines->buf + match[i].context_start, len);
+		str[len] = '\0';
+		str += len + 1;
 	}
-	ag_rslt[idx]->matches[matches_len] = NULL;
 
-	t_rslt->nresults++;
-	return (0);
+	/* Offsets within the file, if the buffer is a chunk of it. */
+	if (!lines->file_offset)
+		return;
+
+	for (i = 0; i < matches_len; i++)
+	{
+		match[i].line_start += lines->file_offset;
+		match[i].line_end   += lines->file_offset;
+		if (config->context_before || config->context_after)
+		{
+			match[i].context_start += lines->file_offset;
+			match[i].context_end   += lines->file_offset;
+		}
+	}
 }
 
 /**
- * @brief Join all the per-thread results into a single list
- * and returns it.
+ * @brief Allocates a new result for the file @p file and
+ * its matches.
  *
- * @param nresults_ret Number of results pointer.
+ * The result, its matches and strings are laid out in a
+ * single block, taken from the arena @p arena, or allocated
+ * on its own if @p arena is NULL.
  *
- * @return Returns all the results found.
+ * @param arena Result arena, may be NULL.
+ * @param worker_id Current thread.
+ * @param file Processed file with the matches found.
+ * @param matches Matches list.
+ * @param matches_len Matches list length.
+ * @param lines File read buffer lines.
+ * @param flags Optional flags, such as binary file indicator.
+ * @param config Search configuration: whether to copy the
+ *               match text, and which line information to set.
+ * @param multi If != 0, matches come from a multi-pattern search
+ *              and carry their pattern.
+ *
+ * @return Returns the new result, or NULL if error.
  */
-static struct ag_result **get_thrd_results(size_t *nresults_ret)
+static struct ag_result *new_result(struct result_arena *arena,
+	int worker_id, const char *file, const match_t matches[],
+	const size_t matches_len, line_index_t *lines, int flags,
+	const struct ag_config *config, int multi)
 {
-	struct ag_result **rslt;
-	size_t nresults;
-	size_t i, j, idx;
+	struct result_block *blk;
+	struct ag_result *rslt;
+	struct ag_match *match;
+	size_t file_len;
+	size_t start;
+	size_t end;
+	size_t len;
+	size_t size;
+	int offsets;
+	int context;
+	char *str;
+	size_t i;
 
-	rslt = NULL;
-	nresults = 0;
+	offsets = (config->match_text == LIBAG_MATCH_OFFSETS);
+	context = (config->context_before || config->context_after);
 
-	/* Get the results amount. */
-	for (i = 0; i <= NUM_WORKERS; i++)
-		if (thrd_rslt[i].nresults)
-			nresults += thrd_rslt[i].nresults;
+	/* Result, match pointers, matches and then the strings. */
+	file_len = strlen(file) + 1;
+	size = sizeof(struct result_block) +
+		sizeof(struct ag_match *) * (matches_len + 1) +
+		sizeof(struct ag_match) * matches_len + file_len;
 
-	/* If nothing is found, return NULL. */
-	if (!nresults)
-		goto out;
+	if (!offsets)
+	{
+		for (i = 0; i < matches_len; i++)
+		{
+			size += (matches[i].end - matches[i].start) + 1;
+			if (!context)
+				continue;
 
-	/* Allocate results. */
-	idx  = 0;
-	rslt = malloc(sizeof(struct ag_result *) * (nresults+1));
-	if (!rslt)
-		goto out;
+			line_bounds(lines, &matches[i], config->context_before,
+				config->context_after, &start, &end);
+			size += (end - start) + 1;
+		}
+	}
+
+	if (arena)
+		blk = arena_alloc(arena, worker_id, size);
+	else
+		blk = malloc(size);
+
+	if (!blk)
+		return (NULL);
+
+	blk->arena    = arena;
+	blk->map      = NULL;
+	blk->map_size = 0;
+
+	rslt = &blk->result;
+	rslt->flags    = flags;
+	rslt->nmatches = matches_len;
+	rslt->matches  = (struct ag_match **)(blk + 1);
+	rslt->matches[matches_len] = NULL;
+
+	match = (struct ag_match *)(rslt->matches + matches_len + 1);
+	str   = (char *)(match + matches_len);
+
+	rslt->file = str;
+	memcpy(str, file, file_len);
+	str += file_len;
+
+	for (i = 0; i < matches_len; i++)
+	{
+		match[i].byte_start    = lines->file_offset + matches[i].start;
+		match[i].byte_end      = lines->file_offset + matches[i].end - 1;
+		match[i].match         = NULL;
+		match[i].line_start    = 0;
+		match[i].line_end      = 0;
+		match[i].pattern       = multi ? matches[i].pattern : 0;
+		match[i].line_no       = 0;
+		match[i].column        = 0;
+		match[i].context_start = 0;
+		match[i].context_end   = 0;
+		match[i].context       = NULL;
+		rslt->matches[i]       = &match[i];
+
+		if (offsets)
+			continue;
+
+		len = matches[i].end - matches[i].start;
+		match[i].match = str;
+		memcpy(str, lines->buf + matches[i].start, len);
+		str[len] = '\0';
+		str += len + 1;
+	}
+
+	if (offsets || context || config->match_lines)
+		set_match_lines(match, matches, matches_len, lines, config, str);
 
-	/* Add the results. */
-	for (i = 0; i <= NUM_WORKERS; i++)
-		if (thrd_rslt[i].nresults)
-			for (j = 0; j < thrd_rslt[i].nresults; j++)
-				rslt[idx++] = thrd_rslt[i].results[j];
-	rslt[idx] = NULL;
-out:
-	*nresults_ret = nresults;
 	return (rslt);
 }
 
 /**
- * @brief Configure Ag for a new search.
+ * @brief Hands a new result over to the search callback,
+ * either right away (from the worker) or through the
+ * dispatcher thread.
  *
- * This should be invoked at each new search.
+ * @param ctx Search context.
+ * @param rslt Result to be delivered.
  *
  * @return Returns 0 if success, -1 otherwise.
  */
-static int setup_search(void)
+static int dispatch_result(struct ag_ctx *ctx, struct ag_result *rslt)
 {
-	int study_opts;
-	int pcre_opts;
-
-	study_opts = 0;
-	pcre_opts  = PCRE_MULTILINE;
+	struct cb_dispatch *dispatch;
+	struct ag_result **results;
+	size_t capacity;
 
-	/* Enable JIT if possible. */
-#ifdef USE_PCRE_JIT
-	int has_jit = 0;
-	pcre_config(PCRE_CONFIG_JIT, &has_jit);
-	if (has_jit)
-		study_opts |= PCRE_STUDY_JIT_COMPILE;
-#endif
+	/*
+	 * Search cancelled (not merely out of time or budget),
+	 * drop whatever is still being found.
+	 */
+	if (__atomic_load_n(&ctx->search.cancelled, __ATOMIC_RELAXED))
+	{
+		ag_free_result(rslt);
+		return (0);
+	}
 
-	/* If smart case. */
-	if (opts.casing == CASE_SMART)
+	if (ctx->config.callback_thread == LIBAG_CB_WORKERS)
 	{
-		opts.casing = is_lowercase(opts.query) ?
-			CASE_INSENSITIVE : CASE_SENSITIVE;
+		if (ctx->callback(rslt, ctx->userdata))
+			__atomic_store_n(&ctx->search.cancelled, 1, __ATOMIC_RELAXED);
+		return (0);
 	}
 
-	/* Check if regex. */
-	if (!is_regex(opts.query))
-		opts.literal = 1;
+	dispatch = &ctx->dispatch;
+	pthread_mutex_lock(&dispatch->mtx);
 
-	if (opts.literal)
-	{
-		if (opts.casing == CASE_INSENSITIVE)
+		/* Grow. */
+		if (dispatch->nresults >= dispatch->capacity)
 		{
-			/* Search routine needs the query to be lowercase */
-			char *c = opts.query;
-			for (; *c != '\0'; ++c)
-				*c = (char)tolower(*c);
+			capacity = dispatch->capacity ? dispatch->capacity * 2 : 64;
+			results  = realloc(dispatch->results,
+				sizeof(struct ag_result *) * capacity);
+			if (!results)
+			{
+				pthread_mutex_unlock(&dispatch->mtx);
+				ag_free_result(rslt);
+				return (-1);
+			}
+			dispatch->results  = results;
+			dispatch->capacity = capacity;
 		}
-		generate_alpha_skip(opts.query, opts.query_len, alpha_skip_lookup,
-			opts.casing == CASE_SENSITIVE);
-		find_skip_lookup = NULL;
-		generate_find_skip(opts.query, opts.query_len, &find_skip_lookup,
-			opts.casing == CASE_SENSITIVE);
-		generate_hash(opts.query, opts.query_len, h_table,
-			opts.casing == CASE_SENSITIVE);
-    }
-
-    /* Regex. */
-    else
-    {
-    	if (opts.casing == CASE_INSENSITIVE)
-			pcre_opts |= PCRE_CASELESS;
 
-		/* Configure regex stuff. */
-		compile_study(&opts.re, &opts.re_extra, opts.query, pcre_opts,
-			study_opts);
-	}
+		dispatch->results[dispatch->nresults++] = rslt;
+		pthread_cond_signal(&dispatch->cond);
 
+	pthread_mutex_unlock(&dispatch->mtx);
 	return (0);
 }
 
 /**
- * @brief For a given list of paths @p tpaths, generates a list
- * of paths and base paths.
+ * @brief Dispatcher thread: invokes the search callback
+ * for each result queued by the workers, one at a time,
+ * until the search is done.
  *
- * @param npaths Number of paths in @p tpaths.
- * @param tpaths Paths to be searched.
- * @param base_path Returned base paths pointer.
- * @param paths Returned paths pointer.
+ * @param arg Search context.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Always NULL.
  */
-static int prepare_paths(int npaths, char **tpaths, char **base_paths[],
-	char **paths[])
+static void *dispatch_worker(void *arg)
 {
-	int base_path_len;
-	char *base_path;
-	int path_len;
-	char *path;
+	struct cb_dispatch *dispatch;
+	struct ag_result **results;
+	struct ag_ctx *ctx;
+	size_t nresults;
 	size_t i;
 
-#ifdef PATH_MAX
-	char *tmp = NULL;
-#endif
-
-	base_path_len = 0;
-	path_len      = 0;
-	base_path     = NULL;
-	path          = NULL;
+	ctx = arg;
+	dispatch = &ctx->dispatch;
 
-	/* Multiples files and folders. */
-	if (npaths > 0)
+	pthread_mutex_lock(&dispatch->mtx);
+	while (1)
 	{
-		*paths = calloc(sizeof(char *), npaths + 1);
-		if (!*paths)
-			return (-1);
+		while (!dispatch->nresults && !dispatch->done)
+			pthread_cond_wait(&dispatch->cond, &dispatch->mtx);
 
-		*base_paths = calloc(sizeof(char *), npaths + 1);
-		if (!*base_paths)
-			return (-1);
+		if (!dispatch->nresults)
+			break;
 
-		for (i = 0; i < (size_t)npaths; i++)
-		{
-			path = strdup(tpaths[i]);
-			if (!path)
-				return (-1);
+		/*
+		 * Take everything queued so far, so that the workers
+		 * do not wait for the callback.
+		 */
+		results  = dispatch->results;
+		nresults = dispatch->nresults;
+		dispatch->results  = NULL;
+		dispatch->nresults = 0;
+		dispatch->capacity = 0;
 
-			path_len = strlen(path);
+		pthread_mutex_unlock(&dispatch->mtx);
 
-			/* Kill trailing slash. */
-			if (path_len > 1 && path[path_len - 1] == '/')
-				path[path_len - 1] = '\0';
+		for (i = 0; i < nresults; i++)
+		{
+			if (__atomic_load_n(&ctx->search.cancelled, __ATOMIC_RELAXED))
+				ag_free_result(results[i]);
+			else if (ctx->callback(results[i], ctx->userdata))
+				__atomic_store_n(&ctx->search.cancelled, 1, __ATOMIC_RELAXED);
+		}
+		free(results);
 
-			(*paths)[i] = path;
-#ifdef PATH_MAX
-			tmp = malloc(PATH_MAX);
-			if (!tmp)
-				return (-1);
+		pthread_mutex_lock(&dispatch->mtx);
+	}
+	pthread_mutex_unlock(&dispatch->mtx);
+	return (NULL);
+}
 
-			base_path = realpath(path, tmp);
-#else
-			base_path = realpath(path, NULL);
-#endif
-			if (base_path)
+/**
+ * @brief Grows @p array, of @p capacity elements of @p size
+ * bytes each, to hold at least @p needed elements.
+ *
+ * @param array Array to be grown, may be NULL.
+ * @param capacity Array capacity, updated on success.
+ * @param needed Elements needed.
+ * @param size Element size.
+ *
+ * @return Returns the (possibly moved) array, or NULL if
+ * error, in which case @p array is left untouched.
+ */
+static void *grow_array(void *array, size_t *capacity, size_t needed,
+	size_t size)
+{
+	size_t cap;
+
+	if (needed <= *capacity)
+		return (array);
+
+	cap = *capacity ? *capacity : 64;
+	while (cap < needed)
+		cap *= 2;
+
+	array = realloc(array, cap * size);
+	if (array)
+		*capacity = cap;
+	return (array);
+}
+
+/**
+ * @brief Adds the file @p file to the per-thread flat result
+ * @p flat, making room for its @p matches_len matches and
+ * their @p text_size bytes of text (NULs included).
+ *
+ * @param flat Per-thread flat result.
+ * @param file Processed file with the matches found.
+ * @param matches_len Matches list length.
+ * @param text_size Size of the match texts.
+ * @param flags Optional flags, such as binary file indicator.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int add_flat_file(struct thrd_flat *flat, const char *file,
+	const size_t matches_len, size_t text_size, int flags)
+{
+	struct ag_flat_file *ffile;
+	size_t file_len;
+	void *p;
+
+	file_len = strlen(file) + 1;
+	if (!(p = grow_array(flat->pool, &flat->pool_cap,
+		flat->pool_size + file_len + text_size, 1)))
+	{
+		return (-1);
+	}
+	flat->pool = p;
+
+	if (!(p = grow_array(flat->files, &flat->files_cap, flat->nfiles + 1,
+		sizeof(struct ag_flat_file))))
+	{
+		return (-1);
+	}
+	flat->files = p;
+
+	if (!(p = grow_array(flat->matches, &flat->matches_cap,
+		flat->nmatches + matches_len, sizeof(struct ag_flat_match))))
+	{
+		return (-1);
+	}
+	flat->matches = p;
+
+	ffile = &flat->files[flat->nfiles];
+	ffile->path        = flat->pool_size;
+	ffile->first_match = flat->nmatches;
+	ffile->nmatches    = matches_len;
+	ffile->flags       = flags;
+
+	memcpy(flat->pool + flat->pool_size, file, file_len);
+	flat->pool_size += file_len;
+	return (0);
+}
+
+/**
+ * @brief Saves the matches of the file @p file in the
+ * per-thread flat result.
+ *
+ * @param ctx Search context.
+ * @param worker_id Current thread.
+ * @param file Processed file with the matches found.
+ * @param matches Matches list.
+ * @param matches_len Matches list length.
+ * @param lines File read buffer lines.
+ * @param flags Optional flags, such as binary file indicator.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int add_flat_result(struct ag_ctx *ctx, int worker_id,
+	const char *file, const match_t matches[], const size_t matches_len,
+	line_index_t *lines, int flags)
+{
+	struct ag_flat_match *match;
+	struct thrd_flat *flat;
+	size_t text_size;
+	size_t len;
+	size_t i;
+
+	flat = &ctx->thrd_flat[worker_id];
+
+	text_size = 0;
+	for (i = 0; i < matches_len; i++)
+		text_size += (matches[i].end - matches[i].start) + 1;
+
+	if (add_flat_file(flat, file, matches_len, text_size, flags) < 0)
+		return (-1);
+
+	for (i = 0; i < matches_len; i++)
+	{
+		len   = matches[i].end - matches[i].start;
+		match = &flat->matches[flat->nmatches++];
+		match->file_id    = flat->nfiles;
+		match->byte_start = lines->file_offset + matches[i].start;
+		match->byte_end   = lines->file_offset + matches[i].end - 1;
+		match->line_no    = line_index_number(lines, matches[i].start);
+		match->match      = flat->pool_size;
+
+		memcpy(flat->pool + flat->pool_size, lines->buf + matches[i].start,
+			len);
+		flat->pool[flat->pool_size + len] = '\0';
+		flat->pool_size += len + 1;
+	}
+
+	flat->nfiles++;
+	return (0);
+}
+
+/**
+ * @brief Saves the result @p rslt in the per-thread result.
+ *
+ * @param ctx Search context.
+ * @param worker_id Current thread.
+ * @param rslt Result to be saved.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int save_result(struct ag_ctx *ctx, int worker_id,
+	struct ag_result *rslt)
+{
+	struct thrd_result *t_rslt;
+	struct ag_result **ag_rslt;
+
+	t_rslt  = &ctx->thrd_rslt[worker_id];
+	ag_rslt = t_rslt->results;
+
+	/* Grow. */
+	if (t_rslt->nresults >= t_rslt->capacity)
+	{
+		ag_rslt = realloc(ag_rslt,
+			sizeof(struct ag_result *) * (t_rslt->capacity * 2));
+		if (!ag_rslt)
+		{
+			ag_free_result(rslt);
+			return (-1);
+		}
+
+		t_rslt->results   = ag_rslt;
+		t_rslt->capacity *= 2;
+	}
+
+	ag_rslt[t_rslt->nresults++] = rslt;
+	return (0);
+}
+
+/**
+ * @brief For a given number of matches @p matches_len
+ * in the current processed file @p file, save the
+ * findings in the per-thread result, or hand them over
+ * to the search callback, if any.
+ *
+ * @param sctx Search context.
+ * @param worker_id Current thread.
+ * @param file Processed file with the matches found.
+ * @param matches Matches list.
+ * @param matches_len Matches list length.
+ * @param lines File read buffer lines.
+ * @param flags Optional flags, such as binary file indicator.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int add_local_result(search_ctx_t *sctx, int worker_id, const char *file,
+	const match_t matches[], const size_t matches_len,
+	line_index_t *lines, int flags)
+{
+	struct ag_result *rslt;
+	struct ag_ctx *ctx;
+	int multi;
+
+	if (!matches_len)
+		return (0);
+
+	ctx   = (struct ag_ctx *)sctx;
+	multi = (sctx->multi != NULL);
+
+	/* Streamed results belong to the callback, one by one. */
+	if (ctx->callback)
+	{
+		rslt = new_result(NULL, worker_id, file, matches, matches_len,
+			lines, flags, &ctx->config, multi);
+		if (!rslt)
+			return (-1);
+		return (dispatch_result(ctx, rslt));
+	}
+
+	if (ctx->flat)
+		return (add_flat_result(ctx, worker_id, file, matches, matches_len,
+			lines, flags));
+
+	rslt = new_result(ctx->arena, worker_id, file, matches, matches_len,
+		lines, flags, &ctx->config, multi);
+	if (!rslt)
+		return (-1);
+
+	return (save_result(ctx, worker_id, rslt));
+}
+
+/**
+ * @brief Saves the matches found in a chunk of the part
+ * @p part of a split file, until all the parts are
+ * searched and merged by @ref add_split_result.
+ *
+ * Each chunk becomes a result of its own, allocated on its
+ * own; line numbers still count from the lead of the part.
+ *
+ * @param sctx Search context.
+ * @param worker_id Current thread.
+ * @param part Part of the split file.
+ * @param file Processed file with the matches found.
+ * @param matches Matches list.
+ * @param matches_len Matches list length.
+ * @param lines Chunk lines.
+ * @param flags Optional flags, such as binary file indicator.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int add_part_result(search_ctx_t *sctx, int worker_id, file_part_t *part,
+	const char *file, const match_t matches[], const size_t matches_len,
+	line_index_t *lines, int flags)
+{
+	struct ag_config config;
+	struct ag_result *rslt;
+	struct ag_ctx *ctx;
+	void *p;
+
+	if (!matches_len)
+		return (0);
+
+	ctx    = (struct ag_ctx *)sctx;
+	config = ctx->config;
+
+	/* Flat results take the text and line number of each match. */
+	if (ctx->flat)
+	{
+		config.match_text     = LIBAG_MATCH_COPY;
+		config.match_lines    = 1;
+		config.context_before = 0;
+		config.context_after  = 0;
+	}
+
+	rslt = new_result(NULL, worker_id, file, matches, matches_len, lines,
+		flags, &config, sctx->multi != NULL);
+	if (!rslt)
+		return (-1);
+
+	if (!(p = grow_array(part->results, &part->results_cap,
+		part->nresults + 1, sizeof(struct ag_result *))))
+	{
+		ag_free_result(rslt);
+		return (-1);
+	}
+	part->results = p;
+	part->results[part->nresults++] = rslt;
+	return (0);
+}
+
+/**
+ * @brief Allocates a new result for the file @p file, with
+ * a copy of the matches @p matches (and of their strings),
+ * laid out like the ones of @ref new_result.
+ *
+ * @param arena Result arena, may be NULL.
+ * @param worker_id Current thread.
+ * @param file Processed file with the matches found.
+ * @param matches Matches list.
+ * @param matches_len Matches list length.
+ * @param flags Optional flags, such as binary file indicator.
+ *
+ * @return Returns the new result, or NULL if error.
+ */
+static struct ag_result *join_matches(struct result_arena *arena,
+	int worker_id, const char *file, struct ag_match **matches,
+	const size_t matches_len, int flags)
+{
+	struct result_block *blk;
+	struct ag_result *rslt;
+	struct ag_match *match;
+	size_t file_len;
+	size_t size;
+	size_t len;
+	char *str;
+	size_t i;
+
+	file_len = strlen(file) + 1;
+	size = sizeof(struct result_block) +
+		sizeof(struct ag_match *) * (matches_len + 1) +
+		sizeof(struct ag_match) * matches_len + file_len;
+
+	for (i = 0; i < matches_len; i++)
+	{
+		if (matches[i]->match)
+			size += (matches[i]->byte_end + 1 - matches[i]->byte_start) + 1;
+		if (matches[i]->context)
+			size += (matches[i]->context_end - matches[i]->context_start) + 1;
+	}
+
+	if (arena)
+		blk = arena_alloc(arena, worker_id, size);
+	else
+		blk = malloc(size);
+
+	if (!blk)
+		return (NULL);
+
+	blk->arena    = arena;
+	blk->map      = NULL;
+	blk->map_size = 0;
+
+	rslt = &blk->result;
+	rslt->flags    = flags;
+	rslt->nmatches = matches_len;
+	rslt->matches  = (struct ag_match **)(blk + 1);
+	rslt->matches[matches_len] = NULL;
+
+	match = (struct ag_match *)(rslt->matches + matches_len + 1);
+	str   = (char *)(match + matches_len);
+
+	rslt->file = str;
+	memcpy(str, file, file_len);
+	str += file_len;
+
+	for (i = 0; i < matches_len; i++)
+	{
+		match[i] = *matches[i];
+		rslt->matches[i] = &match[i];
+
+		if (matches[i]->match)
+		{
+			len = matches[i]->byte_end + 1 - matches[i]->byte_start;
+			match[i].match = str;
+			memcpy(str, matches[i]->match, len);
+			str[len] = '\0';
+			str += len + 1;
+		}
+		if (matches[i]->context)
+		{
+			len = matches[i]->context_end - matches[i]->context_start;
+			match[i].context = str;
+			memcpy(str, matches[i]->context, len);
+			str[len] = '\0';
+			str += len + 1;
+		}
+	}
+	return (rslt);
+}
+
+/**
+ * @brief Merges the results of the parts of the split file
+ * @p split, in offset order, into a single result, and
+ * saves it like @ref add_local_result does.
+ *
+ * Line numbers are made relative to the whole file. The
+ * parts after one that was not searched to its end (e.g.,
+ * stopped by the result budget) are left out, as where
+ * their lines start is not known, and a match that starts
+ * within one that ran past the end of the previous part is
+ * dropped, as a search of the whole file would not find it.
+ * The results of the parts are freed.
+ *
+ * @param sctx Search context.
+ * @param worker_id Current thread.
+ * @param split Split file, once all its parts are searched.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int add_split_result(search_ctx_t *sctx, int worker_id, split_file_t *split)
+{
+	struct ag_flat_match *fmatch;
+	struct ag_match **matches;
+	struct thrd_flat *flat;
+	struct ag_result *rslt;
+	struct ag_match *m;
+	struct ag_ctx *ctx;
+	file_part_t *part;
+	size_t matches_cap;
+	size_t matches_len;
+	size_t text_size;
+	size_t lines;
+	size_t next;
+	size_t len;
+	int complete;
+	int flags;
+	int ret;
+	size_t i, j, k;
+	void *p;
+
+	ctx         = (struct ag_ctx *)sctx;
+	flags       = split->binary ? LIBAG_FLG_BINARY : LIBAG_FLG_TEXT;
+	matches     = NULL;
+	matches_cap = 0;
+	matches_len = 0;
+	text_size   = 0;
+	lines       = 0; /* Lines before the current part. */
+	next        = 0; /* Where the next match may start.  */
+	complete    = 1;
+	ret         = 0;
+
+	for (i = 0; i < split->parts_len && complete; i++)
+	{
+		part = &split->parts[i];
+		for (j = 0; j < part->nresults; j++)
+		{
+			rslt = part->results[j];
+			if (!(p = grow_array(matches, &matches_cap,
+				matches_len + rslt->nmatches, sizeof(struct ag_match *))))
 			{
-				base_path_len = strlen(base_path);
+				ret = -1;
+				goto out;
+			}
+			matches = p;
 
-				/* Add trailing slash. */
-				if (base_path_len > 1 && base_path[base_path_len - 1] != '/')
-				{
-					base_path = ag_realloc(base_path, base_path_len + 2);
-					base_path[base_path_len] = '/';
-					base_path[base_path_len + 1] = '\0';
-				}
+			for (k = 0; k < rslt->nmatches; k++)
+			{
+				m = rslt->matches[k];
+				if (m->byte_start < next)
+					continue;
+				if (m->line_no)
+					m->line_no += lines - part->lead_lines;
+
+				next = m->byte_end + 1;
+				text_size += (m->byte_end + 1 - m->byte_start) + 1;
+				matches[matches_len++] = m;
 			}
-			(*base_paths)[i] = base_path;
 		}
+		lines   += part->lines;
+		complete = part->complete;
+	}
 
-        /* Make sure we search these paths instead of stdin. */
-		opts.search_stream = 0;
+	if (!matches_len)
+		goto out;
+
+	if (ctx->flat)
+	{
+		flat = &ctx->thrd_flat[worker_id];
+		if (add_flat_file(flat, split->path, matches_len, text_size,
+			flags) < 0)
+		{
+			ret = -1;
+			goto out;
+		}
+
+		for (i = 0; i < matches_len; i++)
+		{
+			len    = matches[i]->byte_end + 1 - matches[i]->byte_start;
+			fmatch = &flat->matches[flat->nmatches++];
+			fmatch->file_id    = flat->nfiles;
+			fmatch->byte_start = matches[i]->byte_start;
+			fmatch->byte_end   = matches[i]->byte_end;
+			fmatch->line_no    = matches[i]->line_no;
+			fmatch->match      = flat->pool_size;
+
+			memcpy(flat->pool + flat->pool_size, matches[i]->match, len);
+			flat->pool[flat->pool_size + len] = '\0';
+			flat->pool_size += len + 1;
+		}
+		flat->nfiles++;
+		goto out;
 	}
 
-	/* Use current folder. */
+	/* Streamed results belong to the callback. */
+	rslt = join_matches(ctx->callback ? NULL : ctx->arena, worker_id,
+		split->path, matches, matches_len, flags);
+	if (!rslt)
+		ret = -1;
+	else if (ctx->callback)
+		ret = dispatch_result(ctx, rslt);
 	else
+		ret = save_result(ctx, worker_id, rslt);
+
+out:
+	free(matches);
+	for (i = 0; i < split->parts_len; i++)
 	{
-		path = strdup(".");
-		if (!path)
-			return (-1);
-		*paths = malloc(sizeof(char *) * 2);
-		if (!*paths)
-			return (-1);
+		part = &split->parts[i];
+		for (j = 0; j < part->nresults; j++)
+			ag_free_result(part->results[j]);
+		free(part->results);
+		part->results  = NULL;
+		part->nresults = 0;
+	}
+	return (ret);
+}
 
-		*base_paths = malloc(sizeof(char *) * 2);
-		if (*base_paths)
-			return (-1);
+/**
+ * @brief Join all the per-thread results into a single list
+ * and returns it.
+ *
+ * @param ctx Search context.
+ * @param nresults_ret Number of results pointer.
+ *
+ * @return Returns all the results found.
+ */
+static struct ag_result **get_thrd_results(struct ag_ctx *ctx,
+	size_t *nresults_ret)
+{
+	struct thrd_result *thrd_rslt;
+	struct ag_result **rslt;
+	size_t nresults;
+	size_t i, j, idx;
 
-		(*paths)[0] = path;
+	rslt = NULL;
+	nresults = 0;
+	thrd_rslt = ctx->thrd_rslt;
+
+	/* Get the results amount. */
+	for (i = 0; i <= NUM_WORKERS; i++)
+		if (thrd_rslt[i].nresults)
+			nresults += thrd_rslt[i].nresults;
+
+	/* If nothing is found, return NULL. */
+	if (!nresults)
+		goto out;
+
+	/* Allocate results. */
+	idx  = 0;
+	rslt = malloc(sizeof(struct ag_result *) * (nresults+1));
+	if (!rslt)
+		goto out;
+
+	/* Add the results. */
+	for (i = 0; i <= NUM_WORKERS; i++)
+		if (thrd_rslt[i].nresults)
+			for (j = 0; j < thrd_rslt[i].nresults; j++)
+				rslt[idx++] = thrd_rslt[i].results[j];
+	rslt[idx] = NULL;
+out:
+	*nresults_ret = nresults;
+	return (rslt);
+}
+
+/**
+ * @brief Join all the per-thread flat results into a
+ * single flat result, allocated as a single block, and
+ * returns it.
+ *
+ * @param ctx Search context.
+ *
+ * @return Returns the flat result, or NULL if nothing is
+ * found or error.
+ */
+static struct ag_flat_result *get_flat_results(struct ag_ctx *ctx)
+{
+	struct ag_flat_result *rslt;
+	struct ag_flat_match *match;
+	struct ag_flat_file *ffile;
+	struct thrd_flat *flat;
+	size_t nfiles, nmatches, pool_size;
+	size_t i, j;
+
+	nfiles    = 0;
+	nmatches  = 0;
+	pool_size = 0;
+	for (i = 0; i <= NUM_WORKERS; i++)
+	{
+		nfiles    += ctx->thrd_flat[i].nfiles;
+		nmatches  += ctx->thrd_flat[i].nmatches;
+		pool_size += ctx->thrd_flat[i].pool_size;
+	}
+
+	/* If nothing is found, return NULL. */
+	if (!nfiles)
+		return (NULL);
+
+	rslt = malloc(sizeof(struct ag_flat_result) +
+		sizeof(struct ag_flat_file) * nfiles +
+		sizeof(struct ag_flat_match) * nmatches + pool_size);
+	if (!rslt)
+		return (NULL);
+
+	rslt->files   = (struct ag_flat_file *)(rslt + 1);
+	rslt->matches = (struct ag_flat_match *)(rslt->files + nfiles);
+	rslt->pool    = (char *)(rslt->matches + nmatches);
+	rslt->nfiles    = 0;
+	rslt->nmatches  = 0;
+	rslt->pool_size = 0;
+
+	/* Append each thread, rebasing its offsets and indexes. */
+	for (i = 0; i <= NUM_WORKERS; i++)
+	{
+		flat = &ctx->thrd_flat[i];
+
+		for (j = 0; j < flat->nfiles; j++)
+		{
+			ffile  = &rslt->files[rslt->nfiles + j];
+			*ffile = flat->files[j];
+			ffile->path        += rslt->pool_size;
+			ffile->first_match += rslt->nmatches;
+		}
+
+		for (j = 0; j < flat->nmatches; j++)
+		{
+			match  = &rslt->matches[rslt->nmatches + j];
+			*match = flat->matches[j];
+			match->file_id += rslt->nfiles;
+			match->match   += rslt->pool_size;
+		}
+
+		if (flat->pool_size)
+		{
+			memcpy(rslt->pool + rslt->pool_size, flat->pool,
+				flat->pool_size);
+		}
+
+		rslt->nfiles    += flat->nfiles;
+		rslt->nmatches  += flat->nmatches;
+		rslt->pool_size += flat->pool_size;
+	}
+	return (rslt);
+}
+
+/**
+ * @brief Frees the per-thread flat results.
+ *
+ * @param ctx Search context.
+ */
+static void reset_flat_results(struct ag_ctx *ctx)
+{
+	int i;
+	for (i = 0; i <= NUM_WORKERS; i++)
+	{
+		free(ctx->thrd_flat[i].files);
+		free(ctx->thrd_flat[i].matches);
+		free(ctx->thrd_flat[i].pool);
+		memset(&ctx->thrd_flat[i], 0, sizeof(struct thrd_flat));
+	}
+}
+
+/**
+ * @brief Checks if a given user-defined configuration
+ * @p ag_config is valid.
+ *
+ * @param ag_config User-defined configuration.
+ *
+ * @return Returns 0 if valid, -1 otherwise.
+ */
+static int check_config(const struct ag_config *ag_config)
+{
+	if (!ag_config)
+		return (-1);
+	if (ag_config->casing < 0 || ag_config->casing > 2)
+		return (-1);
+	if (ag_config->num_workers < 0 || ag_config->num_workers > NUM_WORKERS)
+		return (-1);
+	if (ag_config->work_queue < LIBAG_QUEUE_WORK_STEALING ||
+		ag_config->work_queue > LIBAG_QUEUE_LEGACY)
+	{
+		return (-1);
+	}
+	if (ag_config->callback_thread < LIBAG_CB_WORKERS ||
+		ag_config->callback_thread > LIBAG_CB_DISPATCHER)
+	{
+		return (-1);
+	}
+	if (ag_config->timeout_ms < 0)
+		return (-1);
+	if (ag_config->max_matches < 0 || ag_config->max_files < 0)
+		return (-1);
+	if (ag_config->match_text < LIBAG_MATCH_COPY ||
+		ag_config->match_text > LIBAG_MATCH_OFFSETS)
+	{
+		return (-1);
+	}
+	if (ag_config->context_before < 0 || ag_config->context_after < 0)
+		return (-1);
+	if (ag_config->binary_window < 0)
+		return (-1);
+#ifndef RE_UTF8
+	if (ag_config->utf8)
+		return (-1);
+#endif
+	return (0);
+}
+
+/**
+ * @brief Applies the user-defined configuration @p ag_config
+ * over the Ag options @p o.
+ *
+ * @param o Ag options to be changed.
+ * @param ag_config User-defined configuration.
+ */
+static void apply_config(cli_options *o, const struct ag_config *ag_config)
+{
+	o->literal = ag_config->literal;
+	o->recurse_dirs = !ag_config->disable_recurse_dir;
+	o->multiline = !ag_config->disable_multiline;
+	o->casing = ag_config->casing;
+	o->workers = ag_config->num_workers;
+	o->stats = ag_config->stats;
+	o->search_binary_files = ag_config->search_binary_files;
+	o->utf8 = ag_config->utf8;
+	o->binary_window = ag_config->binary_window ?
+		(size_t)ag_config->binary_window : DEFAULT_BINARY_WINDOW;
+	o->io_uring = ag_config->io_uring;
+}
+
+/**
+ * @brief Configure the context @p ctx for a multi-pattern
+ * search: all the patterns are literal, and are compiled
+ * into a single matcher.
+ *
+ * @param ctx Search context.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int setup_multi(struct ag_ctx *ctx)
+{
+	search_ctx_t *sctx;
+	int i;
+
+	sctx = &ctx->search;
+	sctx->opts.literal = 1;
+
+	/* Smart case: insensitive only if all patterns are lowercase. */
+	if (sctx->opts.casing == CASE_SMART)
+	{
+		sctx->opts.casing = CASE_INSENSITIVE;
+		for (i = 0; i < ctx->nqueries; i++)
+		{
+			if (!is_lowercase(ctx->queries[i]))
+			{
+				sctx->opts.casing = CASE_SENSITIVE;
+				break;
+			}
+		}
+	}
+
+	sctx->multi = multi_compile(ctx->queries, ctx->nqueries,
+		sctx->opts.casing == CASE_INSENSITIVE);
+	if (!sctx->multi)
+		return (-1);
+
+	return (0);
+}
+
+/**
+ * @brief Whether @p query has non-ASCII bytes, i.e., letters
+ * that only a UTF-8 regex folds.
+ *
+ * @param query Query.
+ *
+ * @return Returns 1 if so, 0 otherwise.
+ */
+static int has_non_ascii(const char *query)
+{
+	for (; *query != '\0'; query++)
+		if ((unsigned char)*query >= 0x80)
+			return (1);
+	return (0);
+}
+
+/**
+ * @brief Escapes the regex metacharacters of @p query, so
+ * that a regex matches it literally.
+ *
+ * @param query Query to be escaped.
+ *
+ * @return Returns the escaped query, to be released with
+ * free, or NULL if error.
+ */
+static char *escape_regex(const char *query)
+{
+	char *escaped;
+	char *e;
+
+	escaped = malloc(strlen(query) * 2 + 1);
+	if (!escaped)
+		return (NULL);
+
+	for (e = escaped; *query != '\0'; query++)
+	{
+		if (strchr("$()*+.?[\\]^{}|", *query))
+			*e++ = '\\';
+		*e++ = *query;
+	}
+	*e = '\0';
+	return (escaped);
+}
+
+/**
+ * @brief Configure the context @p ctx for a new search.
+ *
+ * This should be invoked at each new search: the global
+ * (default) options are copied into the context and then
+ * the context configuration and query are applied on top
+ * of them.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int setup_search(struct ag_ctx *ctx, const char *query)
+{
+	search_ctx_t *sctx;
+	int study_opts;
+	int re_opts;
+
+	sctx       = &ctx->search;
+	study_opts = 0;
+	re_opts    = RE_MULTILINE;
+
+	/* Options snapshot. */
+	sctx->opts = opts;
+	apply_config(&sctx->opts, &ctx->config);
+
+	/* Prepare query. */
+	sctx->opts.query = strdup(query);
+	if (!sctx->opts.query)
+		return (-1);
+	sctx->opts.query_len = strlen(query);
+
+	sctx->find_skip_lookup = NULL;
+	sctx->case_mask  = NULL;
+	sctx->multi      = NULL;
+	sctx->re_literal = NULL;
+	sctx->dfa        = NULL;
+	sctx->re_line_local = 0;
+
+	if (ctx->queries)
+		return (setup_multi(ctx));
+
+	/* Enable JIT if possible. */
+	if (re_has_jit())
+		study_opts |= RE_STUDY_JIT;
+
+	/* If smart case. */
+	if (sctx->opts.casing == CASE_SMART)
+	{
+		sctx->opts.casing = is_lowercase(sctx->opts.query) ?
+			CASE_INSENSITIVE : CASE_SENSITIVE;
+	}
+
+	/*
+	 * Case-insensitive UTF-8 searches of non-ASCII text need
+	 * PCRE to fold it: the literal kernels only fold ASCII.
+	 * Such queries stay regexes, escaped if literal.
+	 */
+	if (sctx->opts.utf8 && sctx->opts.casing == CASE_INSENSITIVE &&
+		has_non_ascii(sctx->opts.query))
+	{
+		if (sctx->opts.literal)
+		{
+			char *escaped = escape_regex(sctx->opts.query);
+			if (!escaped)
+				return (-1);
+			free(sctx->opts.query);
+			sctx->opts.query     = escaped;
+			sctx->opts.query_len = strlen(escaped);
+			sctx->opts.literal   = 0;
+		}
+	}
+
+	/* Check if regex. */
+	else if (!is_regex(sctx->opts.query))
+		sctx->opts.literal = 1;
+
+	if (sctx->opts.literal)
+	{
+		if (sctx->opts.casing == CASE_INSENSITIVE)
+		{
+			/* Search routine needs the query to be lowercase */
+			char *c = sctx->opts.query;
+			for (; *c != '\0'; ++c)
+				*c = (char)tolower(*c);
+		}
+		generate_alpha_skip(sctx->opts.query, sctx->opts.query_len,
+			sctx->alpha_skip_lookup, sctx->opts.casing == CASE_SENSITIVE);
+		generate_find_skip(sctx->opts.query, sctx->opts.query_len,
+			&sctx->find_skip_lookup, sctx->opts.casing == CASE_SENSITIVE);
+		memset(sctx->h_table, 0, sizeof(sctx->h_table));
+		generate_hash(sctx->opts.query, sctx->opts.query_len, sctx->h_table,
+			sctx->opts.casing == CASE_SENSITIVE);
+		if (sctx->opts.casing == CASE_INSENSITIVE)
+		{
+			generate_case_mask(sctx->opts.query, sctx->opts.query_len,
+				&sctx->case_mask);
+		}
+	}
+
+	/* Regex. */
+	else
+	{
+		if (sctx->opts.casing == CASE_INSENSITIVE)
+			re_opts |= RE_CASELESS;
+#ifdef RE_UTF8
+		if (sctx->opts.utf8)
+			re_opts |= RE_UTF8;
+#endif
+
+		/*
+		 * Literal prefilter, if the regex has one. The prefilter
+		 * only folds ASCII letters, unlike case-insensitive UTF-8
+		 * regexes.
+		 */
+		if (!sctx->opts.utf8 || sctx->opts.casing != CASE_INSENSITIVE)
+		{
+			sctx->re_literal = regex_literal(sctx->opts.query,
+				sctx->opts.casing == CASE_INSENSITIVE,
+				&sctx->re_literal_in_line);
+		}
+		if (sctx->re_literal)
+		{
+			sctx->re_literal_len = strlen(sctx->re_literal);
+			if (sctx->opts.casing == CASE_INSENSITIVE)
+			{
+				generate_case_mask(sctx->re_literal, sctx->re_literal_len,
+					&sctx->case_mask);
+			}
+		}
+
+		/* Configure regex stuff. */
+		compile_study(&sctx->opts.re, &sctx->opts.re_extra,
+			sctx->opts.query, re_opts, study_opts);
+
+		/* Without multiline, whether it may still run over whole buffers. */
+		sctx->re_line_local = regex_line_local(sctx->opts.query);
+
+		/*
+		 * Linear-time matcher, if the regex has no back references,
+		 * lookarounds or the like. PCRE is still compiled above, as
+		 * it validates the regex, and matches the others.
+		 */
+		if (!sctx->opts.utf8)
+		{
+			sctx->dfa = dfa_compile(sctx->opts.query,
+				sctx->opts.casing == CASE_INSENSITIVE);
+		}
+	}
+
+	return (0);
+}
+
+/**
+ * @brief Releases the per-search resources allocated
+ * by @ref setup_search.
+ *
+ * @param ctx Search context.
+ */
+static void cleanup_search(struct ag_ctx *ctx)
+{
+	search_ctx_t *sctx;
+	sctx = &ctx->search;
+
+	free(sctx->find_skip_lookup);
+	sctx->find_skip_lookup = NULL;
+	free(sctx->case_mask);
+	sctx->case_mask = NULL;
+	multi_free(sctx->multi);
+	sctx->multi = NULL;
+	free(sctx->re_literal);
+	sctx->re_literal = NULL;
+	dfa_free(sctx->dfa);
+	sctx->dfa = NULL;
+
+	free(sctx->opts.query);
+	sctx->opts.query = NULL;
+
+	if (sctx->opts.re)
+	{
+		re_free(sctx->opts.re, sctx->opts.re_extra);
+		sctx->opts.re       = NULL;
+		sctx->opts.re_extra = NULL;
+	}
+}
+
+/**
+ * @brief For a given list of paths @p tpaths, generates a list
+ * of paths and base paths.
+ *
+ * @param o Search options.
+ * @param npaths Number of paths in @p tpaths.
+ * @param tpaths Paths to be searched.
+ * @param base_path Returned base paths pointer.
+ * @param paths Returned paths pointer.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int prepare_paths(cli_options *o, int npaths, char **tpaths,
+	char **base_paths[], char **paths[])
+{
+	int base_path_len;
+	char *base_path;
+	int path_len;
+	char *path;
+	size_t i;
+
+#ifdef PATH_MAX
+	char *tmp = NULL;
+#endif
+
+	base_path_len = 0;
+	path_len      = 0;
+	base_path     = NULL;
+	path          = NULL;
+
+	/* Multiples files and folders. */
+	if (npaths > 0)
+	{
+		*paths = calloc(sizeof(char *), npaths + 1);
+		if (!*paths)
+			return (-1);
+
+		*base_paths = calloc(sizeof(char *), npaths + 1);
+		if (!*base_paths)
+			return (-1);
+
+		for (i = 0; i < (size_t)npaths; i++)
+		{
+			path = strdup(tpaths[i]);
+			if (!path)
+				return (-1);
+
+			path_len = strlen(path);
+
+			/* Kill trailing slash. */
+			if (path_len > 1 && path[path_len - 1] == '/')
+				path[path_len - 1] = '\0';
+
+			(*paths)[i] = path;
+#ifdef PATH_MAX
+			tmp = malloc(PATH_MAX);
+			if (!tmp)
+				return (-1);
+
+			base_path = realpath(path, tmp);
+#else
+			base_path = realpath(path, NULL);
+#endif
+			if (base_path)
+			{
+				base_path_len = strlen(base_path);
+
+				/* Add trailing slash. */
+				if (base_path_len > 1 && base_path[base_path_len - 1] != '/')
+				{
+					base_path = ag_realloc(base_path, base_path_len + 2);
+					base_path[base_path_len] = '/';
+					base_path[base_path_len + 1] = '\0';
+				}
+			}
+			(*base_paths)[i] = base_path;
+		}
+
+        /* Make sure we search these paths instead of stdin. */
+		o->search_stream = 0;
+	}
+
+	/* Use current folder. */
+	else
+	{
+		path = strdup(".");
+		if (!path)
+			return (-1);
+		*paths = malloc(sizeof(char *) * 2);
+		if (!*paths)
+			return (-1);
+
+		*base_paths = malloc(sizeof(char *) * 2);
+		if (*base_paths)
+			return (-1);
+
+		(*paths)[0] = path;
+
+#ifdef PATH_MAX
+		tmp = malloc(PATH_MAX);
+		if (!tmp)
+			return (-1);
+		(*base_paths)[0] = realpath(path, tmp);
+#else
+		(*base_paths)[0] = realpath(path, NULL);
+#endif
+		i = 1;
+	}
+
+	(*paths)[i] = NULL;
+    (*base_paths)[i] = NULL;
+
+    /* Set paths len. */
+    o->paths_len = npaths;
+
+    return (0);
+}
+
+/**
+ * @brief Initializes the resources that lives as long as the
+ * context @p ctx: mutexes, results and ignore tree.
+ *
+ * @param ctx Search context.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int init_ctx(struct ag_ctx *ctx)
+{
+	if (pthread_mutex_init(&ctx->search_mtx, NULL))
+		goto err1;
+	if (pthread_mutex_init(&ctx->search.stats_mtx, NULL))
+		goto err2;
+	if (pthread_cond_init(&ctx->search.search_done, NULL))
+		goto err3;
+	if (reset_local_results(ctx, 1))
+		goto err4;
+	if (pthread_mutex_init(&ctx->dispatch.mtx, NULL))
+		goto err4;
+	if (pthread_cond_init(&ctx->dispatch.cond, NULL))
+		goto err5;
+
+	ctx->search.root_ignores = init_ignore(NULL, "", 0);
+	return (0);
+err5:
+	pthread_mutex_destroy(&ctx->dispatch.mtx);
+err4:
+	reset_local_results(ctx, 0);
+	pthread_cond_destroy(&ctx->search.search_done);
+err3:
+	pthread_mutex_destroy(&ctx->search.stats_mtx);
+err2:
+	pthread_mutex_destroy(&ctx->search_mtx);
+err1:
+	return (-1);
+}
+
+/**
+ * @brief Releases the resources allocated by @ref init_ctx.
+ *
+ * @param ctx Search context.
+ */
+static void finish_ctx(struct ag_ctx *ctx)
+{
+	cleanup_ignore(ctx->search.root_ignores);
+	ctx->search.root_ignores = NULL;
+	reset_local_results(ctx, 0);
+	reset_flat_results(ctx);
+	pthread_cond_destroy(&ctx->dispatch.cond);
+	pthread_mutex_destroy(&ctx->dispatch.mtx);
+	pthread_cond_destroy(&ctx->search.search_done);
+	pthread_mutex_destroy(&ctx->search.stats_mtx);
+	pthread_mutex_destroy(&ctx->search_mtx);
+}
+
+/**
+ * @brief Start the (shared) worker threads.
+ *
+ * The amount of workers follows the global configuration.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int start_workers(void)
+{
+	int num_cores;
+	int i;
+
+	/* Check if there are workers already. */
+	if (workers)
+		return (-1);
+
+#ifdef _WIN32
+	{
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		num_cores = si.dwNumberOfProcessors;
+	}
+#else
+	num_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	/* Set worker length. */
+	workers_len = num_cores < 8 ? num_cores : 8;
+	if (global_ctx.config.literal)
+		workers_len--;
+	if (global_ctx.config.num_workers)
+		workers_len = global_ctx.config.num_workers;
+	if (workers_len < 1)
+		workers_len = 1;
+
+	stop_workers = FALSE;
+
+	/* Initialize workers & mutexes. */
+	workers = calloc(workers_len, sizeof(worker_t));
+	if (!workers)
+		return (-1);
+	if (pthread_cond_init(&files_ready, NULL))
+		goto err1;
+	if (pthread_mutex_init(&work_queue_mtx, NULL))
+		goto err2;
+	if (init_work_queues(workers_len,
+		global_ctx.config.work_queue != LIBAG_QUEUE_LEGACY))
+	{
+		goto err3;
+	}
+
+    /* Start workers and wait for something. */
+	for (i = 0; i < workers_len; i++)
+	{
+		workers[i].id = i;
+		int rv = pthread_create(&(workers[i].thread), NULL,
+			&search_file_worker, &(workers[i].id));
+
+		/* Stop gracefully already started threads. */
+		if (rv)
+		{
+			workers_len = i;
+			shutdown_workers();
+			return (-1);
+		}
+	}
+	return (0);
+err3:
+	pthread_mutex_destroy(&work_queue_mtx);
+err2:
+	pthread_cond_destroy(&files_ready);
+err1:
+	free(workers);
+	workers = NULL;
+	return (-1);
+}
+
+/**
+ * @brief Stops all workers and cleanup resources.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int shutdown_workers(void)
+{
+	int i;
+
+	/* Check if there are workers to stop. */
+	if (!workers)
+		return (-1);
+
+	/* Whatever the workers are doing, we need to stop them. */
+	pthread_mutex_lock(&work_queue_mtx);
+		stop_workers = TRUE;
+		pthread_cond_broadcast(&files_ready);
+	pthread_mutex_unlock(&work_queue_mtx);
+
+	for (i = 0; i < workers_len; i++)
+		if (pthread_join(workers[i].thread, NULL))
+			return (-1);
+
+	/* Clean resources. */
+	pthread_cond_destroy(&files_ready);
+	pthread_mutex_destroy(&work_queue_mtx);
+	cleanup_work_queues();
+	free(workers);
+	workers = NULL;
+
+	return (0);
+}
+
+/**
+ * @brief Registers a new search as a user of the workers,
+ * starting them if the global configuration says so.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int acquire_workers(void)
+{
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&pool_mtx);
+		/* Check if workers already started or I should start them. */
+		if (!workers &&
+			(global_ctx.config.workers_behavior != LIBAG_ONSEARCH_WORKERS ||
+			start_workers()))
+		{
+			ret = -1;
+		}
+		else
+			pool_users++;
+	pthread_mutex_unlock(&pool_mtx);
+	return (ret);
+}
+
+/**
+ * @brief Unregisters a search from the workers, and stop
+ * them if the global configuration says so.
+ */
+static void release_workers(void)
+{
+	pthread_mutex_lock(&pool_mtx);
+		pool_users--;
+		if (!pool_users &&
+			global_ctx.config.workers_behavior == LIBAG_ONSEARCH_WORKERS)
+		{
+			shutdown_workers();
+		}
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+/**
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx, and waits until it is done.
+ *
+ * Results are left in the per-thread results or, if the
+ * context has a callback, handed over to it.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int run_search(struct ag_ctx *ctx, char *query,
+	int npaths, char **target_paths)
+{
+	search_ctx_t *sctx;
+	char **base_paths;
+	char **paths;
+	int ret;
+	int i;
+
+	ret  = -1;
+	sctx = &ctx->search;
+
+	if (acquire_workers())
+		return (-1);
+
+	/* Reset stats. */
+	memset(&sctx->stats, 0, sizeof(sctx->stats));
+
+	/* Configure search settings. */
+	if (setup_search(ctx, query))
+		goto err1;
+
+	sctx->done_adding_files = FALSE;
+	__atomic_store_n(&sctx->cancelled, 0, __ATOMIC_RELAXED);
+
+	/* Deadline, if any. */
+	sctx->deadline = 0;
+	sctx->deadline_passed = 0;
+	if (ctx->config.timeout_ms)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sctx->deadline = (long long)now.tv_sec * 1000000000LL + now.tv_nsec +
+			(long long)ctx->config.timeout_ms * 1000000LL;
+	}
+
+	/* Result budget, if any. */
+	sctx->max_matches  = ctx->config.max_matches;
+	sctx->max_files    = ctx->config.max_files;
+	sctx->nmatches     = 0;
+	sctx->nfiles       = 0;
+	sctx->budget_spent = 0;
+
+	/* Prepare our paths and base_paths. */
+	base_paths = NULL;
+	paths = NULL;
+	prepare_paths(&sctx->opts, npaths, target_paths, &base_paths, &paths);
+
+	/* Search everything. */
+	for (i = 0; paths[i] != NULL; i++)
+	{
+		if (search_cancelled(sctx))
+			break;
+
+		log_debug("searching path %s for %s", paths[i], sctx->opts.query);
+		ignores *ig = init_ignore(sctx->root_ignores, "", 0);
+		struct stat s = { .st_dev = 0 };
+
+#ifndef _WIN32
+		/*
+		 * The device is ignored if opts.one_dev is false, so it's fine
+		 * to leave it at the default 0.
+		 */
+		if (sctx->opts.one_dev && lstat(paths[i], &s) == -1)
+		{
+			log_err("Failed to get device information for path %s. Skipping...",
+				paths[i]);
+		}
+#endif
+		/* The walk releases ig once done. */
+		search_dir(sctx, ig, base_paths[i], paths[i], 0, s.st_dev);
+	}
+
+	/* Wait for our own files only. */
+	wait_search_done(sctx);
+	ret = 0;
+
+	/* Cleanup paths. */
+	for (i = 0; paths[i] != NULL; i++)
+	{
+		free(paths[i]);
+		free(base_paths[i]);
+	}
+	free(base_paths);
+	free(paths);
+
+err1:
+	/* Cleanup query. */
+	cleanup_search(ctx);
+
+	/* Stop workers, if necessary. */
+	release_workers();
+	return (ret);
+}
+
+/**
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param nresults Pointer to number of results found.
+ *
+ * @return Returns a list of (struct ag_result*) containing all
+ * the results found, or NULL if nothing is found.
+ */
+static struct ag_result **search(struct ag_ctx *ctx, char *query,
+	int npaths, char **target_paths, size_t *nresults)
+{
+	struct result_arena *arena;
+	struct ag_result **result;
+
+	ctx->arena = calloc(1, sizeof(struct result_arena));
+	if (!ctx->arena)
+		return (NULL);
+
+	if (run_search(ctx, query, npaths, target_paths))
+	{
+		free_arena(ctx->arena);
+		ctx->arena = NULL;
+		return (NULL);
+	}
+
+	/* Work. */
+	result = get_thrd_results(ctx, nresults);
+	reset_local_results(ctx, 1);
+
+	/* The arena now belongs to the results, if any. */
+	arena = ctx->arena;
+	ctx->arena = NULL;
+
+	if (result)
+		arena->live = *nresults;
+	else
+		free_arena(arena);
+
+	return (result);
+}
+
+/**
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx, invoking @p callback for each file
+ * with matches as soon as it is searched.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param callback Result callback.
+ * @param userdata Opaque pointer passed to @p callback.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int search_cb(struct ag_ctx *ctx, char *query,
+	int npaths, char **target_paths, ag_result_cb callback,
+	void *userdata)
+{
+	struct cb_dispatch *dispatch;
+	int dispatcher;
+	int ret;
+
+	dispatch   = &ctx->dispatch;
+	dispatcher = (ctx->config.callback_thread == LIBAG_CB_DISPATCHER);
+
+	ctx->callback = callback;
+	ctx->userdata = userdata;
+
+	if (dispatcher)
+	{
+		dispatch->done = 0;
+		if (pthread_create(&dispatch->thread, NULL, dispatch_worker, ctx))
+		{
+			ctx->callback = NULL;
+			return (-1);
+		}
+	}
+
+	ret = run_search(ctx, query, npaths, target_paths);
+
+	/* Deliver what is left and wait for the dispatcher. */
+	if (dispatcher)
+	{
+		pthread_mutex_lock(&dispatch->mtx);
+			dispatch->done = 1;
+			pthread_cond_signal(&dispatch->cond);
+		pthread_mutex_unlock(&dispatch->mtx);
+		pthread_join(dispatch->thread, NULL);
+	}
+
+	ctx->callback = NULL;
+	ctx->userdata = NULL;
+	return (ret);
+}
+
+/**
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx, and returns the results in the flat
+ * format.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ *
+ * @return Returns the flat result, or NULL if nothing is found.
+ */
+static struct ag_flat_result *search_flat(struct ag_ctx *ctx,
+	char *query, int npaths, char **target_paths)
+{
+	struct ag_flat_result *result;
+
+	result = NULL;
+	ctx->flat = 1;
+
+	if (!run_search(ctx, query, npaths, target_paths))
+		result = get_flat_results(ctx);
+
+	reset_flat_results(ctx);
+	ctx->flat = 0;
+	return (result);
+}
+
+/**
+ * @brief Searches for all the @p queries at once, recursively
+ * in all @p target_paths, using the context @p ctx.
+ *
+ * @param ctx Search context.
+ * @param nqueries Number of patterns.
+ * @param queries Patterns to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param nresults Pointer to number of results found.
+ *
+ * @return Returns a list of (struct ag_result*) containing all
+ * the results found, or NULL if nothing is found.
+ */
+static struct ag_result **search_multi(struct ag_ctx *ctx, int nqueries,
+	char **queries, int npaths, char **target_paths, size_t *nresults)
+{
+	struct ag_result **result;
+
+	ctx->queries  = queries;
+	ctx->nqueries = nqueries;
+
+	result = search(ctx, queries[0], npaths, target_paths, nresults);
+
+	ctx->queries  = NULL;
+	ctx->nqueries = 0;
+	return (result);
+}
+
+/**
+ * @brief Checks the pattern list of a multi-pattern search.
+ *
+ * @param nqueries Number of patterns.
+ * @param queries Patterns to be searched.
+ *
+ * @return Returns 0 if valid, -1 otherwise.
+ */
+static int check_queries(int nqueries, char **queries)
+{
+	int i;
+
+	if (nqueries <= 0 || !queries)
+		return (-1);
 
-#ifdef PATH_MAX
-		tmp = malloc(PATH_MAX);
-		if (!tmp)
+	for (i = 0; i < nqueries; i++)
+		if (!queries[i] || queries[i][0] == '\0')
 			return (-1);
-		(*base_paths)[0] = realpath(path, tmp);
-#else
-		(*base_paths)[0] = realpath(path, NULL);
-#endif
-		i = 1;
-	}
 
-	(*paths)[i] = NULL;
-    (*base_paths)[i] = NULL;
+	return (0);
+}
 
-    /* Set paths len. */
-    opts.paths_len = npaths;
+/**
+ * @brief Fills @p ret_stats with the stats of the latest
+ * search performed by @p ctx.
+ *
+ * @param ctx Search context.
+ * @param ret_stats Stats structure to be filled.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int get_stats(struct ag_ctx *ctx, struct ag_search_stats *ret_stats)
+{
+	if (!ctx->config.stats || !ret_stats)
+		return (-1);
 
-    return (0);
+	/* ag_search_ts() may be storing its stats meanwhile. */
+	pthread_mutex_lock(&ctx->search.stats_mtx);
+		ret_stats->total_bytes = ctx->search.stats.total_bytes;
+		ret_stats->total_files = ctx->search.stats.total_files;
+		ret_stats->total_matches = ctx->search.stats.total_matches;
+		ret_stats->total_file_matches = ctx->search.stats.total_file_matches;
+	pthread_mutex_unlock(&ctx->search.stats_mtx);
+	return (0);
 }
 
 /*
@@ -447,20 +2342,11 @@ static int prepare_paths(int npaths, char **tpaths, char **base_paths[],
  */
 int ag_set_config(struct ag_config *ag_config)
 {
-	if (!ag_config)
-		return (-1);
-
-	opts.literal = ag_config->literal;
-	opts.recurse_dirs = !ag_config->disable_recurse_dir;
-	if (ag_config->casing < 0 || ag_config->casing > 2)
+	if (check_config(ag_config))
 		return (-1);
-	opts.casing = ag_config->casing;
-	if (ag_config->num_workers < 0 || ag_config->num_workers > NUM_WORKERS)
-		return (-1);
-	opts.workers = ag_config->num_workers;
-	opts.stats = ag_config->stats;
-	opts.search_binary_files = ag_config->search_binary_files;
-	memcpy(&config, ag_config, sizeof(struct ag_config));
+	pthread_mutex_lock(&config_mtx);
+		memcpy(&global_ctx.config, ag_config, sizeof(struct ag_config));
+	pthread_mutex_unlock(&config_mtx);
 	return (0);
 }
 
@@ -490,21 +2376,32 @@ int ag_init_config(struct ag_config *ag_config)
 		ag_finish();
 
 	set_log_level(LOG_LEVEL_WARN);
-	root_ignores = init_ignore(NULL, "", 0);
+	if (pthread_mutex_init(&print_mtx, NULL))
+		return (-1);
+	if (pthread_mutex_init(&pool_mtx, NULL))
+		return (-1);
 
 	out_fd = stdout;
 
 	/* Initialize default options. */
 	init_options();
 
+	/* Global context. */
+	if (init_ctx(&global_ctx))
+		return (-1);
+
 	/* User-defined options, if none, use default settings. */
 	ag_set_config(ag_config);
 
+	has_ag_init = 1;
+
 	/* Start workers. */
-	if (config.workers_behavior == LIBAG_START_WORKERS && ag_start_workers())
+	if (global_ctx.config.workers_behavior == LIBAG_START_WORKERS &&
+		start_workers())
+	{
 		return (-1);
+	}
 
-	has_ag_init = 1;
 	return (0);
 }
 
@@ -516,20 +2413,29 @@ int ag_init_config(struct ag_config *ag_config)
  *
  * @note *It is up to the user to release all the memory
  * relative to the results found. This memory can be
- * released with the use of the helper functions @ref
- * ag_free_result and @ref ag_free_all_results. For more
- * 'fine-grained' memory release, the user can manually
- * iterate over the structures and release with 'free'.
+ * released with the helper functions @ref ag_free_result
+ * and @ref ag_free_all_results (or @ref ag_free_flat_result
+ * for flat results) only: results are carved from blocks
+ * shared by their matches, so releasing any part of them
+ * with 'free' is undefined behavior.
+ *
+ * Contexts created with @ref ag_ctx_new must be released
+ * with @ref ag_ctx_free before calling this.
  */
 int ag_finish(void)
 {
+	if (!has_ag_init)
+		return (-1);
+
+	shutdown_workers();
+	finish_ctx(&global_ctx);
 	cleanup_options();
-	ag_stop_workers();
+	pthread_mutex_destroy(&pool_mtx);
+	pthread_mutex_destroy(&print_mtx);
 	has_ag_init = 0;
 	return (0);
 }
 
-
 /**
  * @brief Start the worker threads for libag.
  *
@@ -546,357 +2452,560 @@ int ag_finish(void)
  */
 int ag_start_workers(void)
 {
-	int num_cores;
-	int i;
+	int ret;
+	pthread_mutex_lock(&pool_mtx);
+		ret = start_workers();
+	pthread_mutex_unlock(&pool_mtx);
+	return (ret);
+}
 
-	/* Check if there are workers already. */
-	if (workers)
-		return (-1);
+/**
+ * @brief Stops all workers and cleanup resources.
+ *
+ * @return Returns 0 if success, -1 otherwise (including
+ * when there are searches in progress).
+ */
+int ag_stop_workers(void)
+{
+	int ret;
+
+	ret = -1;
+	pthread_mutex_lock(&pool_mtx);
+		if (!pool_users)
+			ret = shutdown_workers();
+	pthread_mutex_unlock(&pool_mtx);
+	return (ret);
+}
 
-	workers = NULL;
-	work_queue = NULL;
-	work_queue_tail = NULL;
+/**
+ * @brief Searches for @p query recursively in all @p target_paths.
+ *
+ * Thats the main routine for libag and the one that the users want
+ * to use.
+ *
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param nresults Pointer to number of results found.
+ *
+ * @return Returns a list of (struct ag_result*) containing all
+ * the results found. Please note that this result is up to the
+ * user to free, with @ref ag_free_result and @ref ag_free_all_results.
+ *
+ * If nothing is found, return NULL.
+ *
+ * @note Please note that this routine is _not_ thread-safe, and should
+ * not be called from multiples threads.
+ */
+struct ag_result **ag_search(char *query, int npaths, char **target_paths,
+	size_t *nresults)
+{
+	*nresults = 0;
 
-#ifdef _WIN32
-	{
-		SYSTEM_INFO si;
-		GetSystemInfo(&si);
-		num_cores = si.dwNumberOfProcessors;
-	}
-#else
-	num_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
-#endif
+	/* Check if libag was initialized. */
+	if (!has_ag_init)
+		return (NULL);
 
-	/* Set worker length. */
-	workers_len = num_cores < 8 ? num_cores : 8;
-	if (opts.literal)
-		workers_len--;
-	if (opts.workers)
-		workers_len = opts.workers;
-	if (workers_len < 1)
-		workers_len = 1;
+	/* Query and valid paths. */
+	if (!query || !target_paths)
+		return (NULL);
 
-	done_adding_files = FALSE;
-	stop_workers = FALSE;
+	return (search(&global_ctx, query, npaths, target_paths, nresults));
+}
 
-	/* Initialize workers & mutexes. */
-	workers = calloc(workers_len, sizeof(worker_t));
-	if (!workers)
+/**
+ * @Brief Searches for @p query recursively in all @p target_paths.
+ *
+ * This is the same behavior as the @ref ag_search routine, but thread-safe.
+ *
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param nresults Pointer to number of results found.
+ *
+ * @return Returns a list of (struct ag_result*) containing all
+ * the results found. If nothing found, NULL.
+ *
+ * @note Please note that this version is the same as ag_search() but
+ * thread-safe.
+ *
+ * Each call runs on its own temporary context (with the global
+ * configuration), sharing only the worker threads, so parallel calls
+ * to this function are also parallel. The stats of the latest
+ * finished call are available via @ref ag_get_stats.
+ */
+struct ag_result **ag_search_ts(char *query, int npaths, char **target_paths,
+	size_t *nresults)
+{
+	struct ag_result **r;
+	struct ag_config config;
+	struct ag_ctx *ctx;
+
+	/* Check if libag was initialized. */
+	if (!has_ag_init)
+		return (NULL);
+
+	/* Query and valid paths. */
+	if (!query || !target_paths || !nresults || npaths <= 0)
+		return (NULL);
+
+	*nresults = 0;
+
+	/* ag_set_config() may be changing it meanwhile. */
+	pthread_mutex_lock(&config_mtx);
+		config = global_ctx.config;
+	pthread_mutex_unlock(&config_mtx);
+
+	ctx = ag_ctx_new(&config);
+	if (!ctx)
+		return (NULL);
+
+	r = search(ctx, query, npaths, target_paths, nresults);
+
+	/* Keep ag_get_stats() working for this call. */
+	pthread_mutex_lock(&global_ctx.search.stats_mtx);
+		global_ctx.search.stats = ctx->search.stats;
+	pthread_mutex_unlock(&global_ctx.search.stats_mtx);
+
+	ag_ctx_free(ctx);
+	return (r);
+}
+
+/**
+ * @brief Searches for @p query recursively in all @p target_paths,
+ * delivering the results as they are found.
+ *
+ * Instead of returning every result at the end of the search,
+ * @p callback is invoked once for each file with matches, as
+ * soon as it is searched, either from the workers or from a
+ * dispatcher thread (see ag_config.callback_thread). Each result
+ * belongs to the callback and must be released with
+ * @ref ag_free_result.
+ *
+ * If the callback returns a non-zero value, the search stops: no
+ * more files are searched and no more results are delivered
+ * (although, with LIBAG_CB_WORKERS, other workers may already be
+ * running the callback).
+ *
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param callback Result callback.
+ * @param userdata Opaque pointer passed to @p callback.
+ *
+ * @return Returns 0 if the search completes or is stopped by
+ * the callback, -1 otherwise.
+ *
+ * @note Like @ref ag_search, this routine is _not_ thread-safe;
+ * use @ref ag_ctx_search_cb to stream several searches at once.
+ */
+int ag_search_cb(char *query, int npaths, char **target_paths,
+	ag_result_cb callback, void *userdata)
+{
+	/* Check if libag was initialized. */
+	if (!has_ag_init)
 		return (-1);
-	if (pthread_cond_init(&files_ready, NULL))
-		goto err1;
-	if (pthread_mutex_init(&print_mtx, NULL))
-		goto err2;
-	if (pthread_mutex_init(&stats_mtx, NULL))
-		goto err3;
-	if (pthread_mutex_init(&work_queue_mtx, NULL))
-		goto err4;
-	if (pthread_mutex_init(&search_mtx, NULL))
-		goto err5;
-	if (pthread_barrier_init(&worker_done, NULL, workers_len + 1))
-		goto err6;
-	if (pthread_barrier_init(&results_done, NULL, workers_len + 1))
-		goto err7;
 
-	/* Reset per-thread local results. */
-	if (reset_local_results(1))
-		goto err8;
+	/* Query, valid paths and callback. */
+	if (!query || !target_paths || !callback)
+		return (-1);
 
-    /* Start workers and wait for something. */
-	for (i = 0; i < workers_len; i++)
-	{
-		workers[i].id = i;
-		int rv = pthread_create(&(workers[i].thread), NULL, &search_file_worker,
-			&(workers[i].id));
+	return (search_cb(&global_ctx, query, npaths, target_paths, callback,
+		userdata));
+}
 
-		/* Stop gracefully already started threads. */
-		if (rv)
-		{
-			workers_len = i + 1;
-			ag_stop_workers();
-			return (-1);
-		}
-	}
+/**
+ * @brief Searches for @p query recursively in all @p target_paths,
+ * like @ref ag_search, but returns the results in the flat format:
+ * one array of files, one of matches and a single string pool.
+ *
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ *
+ * @return Returns the flat result, to be freed with
+ * @ref ag_free_flat_result, or NULL if nothing is found.
+ *
+ * @note Like @ref ag_search, this routine is _not_ thread-safe.
+ */
+struct ag_flat_result *ag_search_flat(char *query, int npaths,
+	char **target_paths)
+{
+	/* Check if libag was initialized. */
+	if (!has_ag_init)
+		return (NULL);
+
+	/* Query and valid paths. */
+	if (!query || !target_paths)
+		return (NULL);
+
+	return (search_flat(&global_ctx, query, npaths, target_paths));
+}
+
+/**
+ * @brief Searches for several fixed strings at once, recursively
+ * in all @p target_paths.
+ *
+ * The tree is walked and each file is read only once, no matter
+ * how many patterns: all of them are compiled into a single
+ * matcher. The patterns are always literal, and the casing
+ * applies to all of them (smart case means case insensitive
+ * only if every pattern is lowercase).
+ *
+ * Matches do not overlap: at each offset, the longest pattern
+ * that matches there wins, and then the first one in
+ * @p queries. The index of the pattern of each match is
+ * returned in ag_match.pattern.
+ *
+ * @param nqueries Number of patterns.
+ * @param queries Patterns to be searched, non-empty.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param nresults Pointer to number of results found.
+ *
+ * @return Returns a list of (struct ag_result*) containing all
+ * the results found, as @ref ag_search, or NULL if nothing is
+ * found.
+ *
+ * @note Like @ref ag_search, this routine is _not_ thread-safe;
+ * use @ref ag_ctx_search_multi for concurrent searches.
+ */
+struct ag_result **ag_search_multi(int nqueries, char **queries,
+	int npaths, char **target_paths, size_t *nresults)
+{
+	if (!nresults)
+		return (NULL);
+
+	*nresults = 0;
+
+	/* Check if libag was initialized. */
+	if (!has_ag_init)
+		return (NULL);
+
+	/* Queries and valid paths. */
+	if (check_queries(nqueries, queries) || !target_paths)
+		return (NULL);
+
+	return (search_multi(&global_ctx, nqueries, queries, npaths,
+		target_paths, nresults));
+}
+
+/**
+ * @brief Cancels the search in progress on the context @p ctx.
+ *
+ * The walk stops, workers skip the remaining files of the
+ * search, and files being searched are abandoned at the next
+ * check, so the search returns shortly after, with whatever
+ * was found so far. With a callback, the results not yet
+ * handed to it are dropped.
+ *
+ * @param ctx Search context, or NULL for the global context
+ * (i.e., @ref ag_search and @ref ag_search_cb).
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note This routine is meant to be called from a thread
+ * other than the one searching. A search started after the
+ * call is not affected.
+ */
+int ag_cancel(struct ag_ctx *ctx)
+{
+	/* Check if libag was initialized. */
+	if (!has_ag_init)
+		return (-1);
+
+	if (!ctx)
+		ctx = &global_ctx;
+
+	__atomic_store_n(&ctx->search.cancelled, 1, __ATOMIC_RELAXED);
 	return (0);
-err8:
-	pthread_barrier_destroy(&results_done);
-err7:
-	pthread_barrier_destroy(&worker_done);
-err6:
-	pthread_mutex_destroy(&search_mtx);
-err5:
-	pthread_mutex_destroy(&work_queue_mtx);
-err4:
-	pthread_mutex_destroy(&stats_mtx);
-err3:
-	pthread_mutex_destroy(&print_mtx);
-err2:
-	pthread_cond_destroy(&files_ready);
-err1:
-	free(workers);
-	return (-1);
 }
 
 /**
- * @brief Stops all workers and cleanup resources.
+ * @brief If stats are enabled, get the current stats for
+ * the latest @ref ag_search call.
+ *
+ * @param ret_stats Stats structure to be filled.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int ag_get_stats(struct ag_search_stats *ret_stats)
+{
+	return (get_stats(&global_ctx, ret_stats));
+}
+
+/**
+ * @brief Creates a new search context with the user-specified
+ * configuration @p ag_config.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * A context owns its own query, lookup tables, ignore tree,
+ * work queue and results, so searches in different contexts
+ * run in parallel, without any lock between them. The worker
+ * threads are shared by all contexts.
+ *
+ * @param ag_config User-defined configuration, if NULL, uses
+ *                  the default settings.
+ *
+ * @return Returns a new context if success, NULL otherwise.
+ *
+ * @note libag must be initialized (via @ref ag_init or
+ * @ref ag_init_config) before creating contexts. Since the
+ * workers are shared, the fields num_workers and
+ * workers_behavior are taken from the global configuration
+ * and ignored here.
  */
-int ag_stop_workers(void)
+struct ag_ctx *ag_ctx_new(struct ag_config *ag_config)
 {
-	int i;
+	struct ag_ctx *ctx;
 
-	/* Check if there are workers to stop. */
-	if (!workers)
-		return (-1);
+	if (!has_ag_init)
+		return (NULL);
 
-	/* Whatever the workers are doing, we need to stop them. */
-	pthread_mutex_lock(&work_queue_mtx);
-		done_adding_files = TRUE;
-		stop_workers = TRUE;
-		pthread_cond_broadcast(&files_ready);
-	pthread_mutex_unlock(&work_queue_mtx);
+	if (ag_config && check_config(ag_config))
+		return (NULL);
 
-	for (i = 0; i < workers_len; i++)
-		if (pthread_join(workers[i].thread, NULL))
-			return (-1);
+	ctx = calloc(1, sizeof(struct ag_ctx));
+	if (!ctx)
+		return (NULL);
 
-	/* Clean resources. */
-	pthread_cond_destroy(&files_ready);
-	pthread_mutex_destroy(&work_queue_mtx);
-	pthread_mutex_destroy(&print_mtx);
-	pthread_mutex_destroy(&stats_mtx);
-	pthread_mutex_destroy(&search_mtx);
-	pthread_barrier_destroy(&worker_done);
-	pthread_barrier_destroy(&results_done);
-	cleanup_ignore(root_ignores);
-	reset_local_results(0);
-	free(workers);
-	workers = NULL;
+	if (ag_config)
+		memcpy(&ctx->config, ag_config, sizeof(struct ag_config));
 
-	return (0);
+	if (init_ctx(ctx))
+	{
+		free(ctx);
+		return (NULL);
+	}
+	return (ctx);
 }
 
 /**
- * @brief Searches for @p query recursively in all @p target_paths.
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx.
  *
- * Thats the main routine for libag and the one that the users want
- * to use.
+ * This is the same as @ref ag_search, but with a private context:
+ * different contexts can be searched concurrently, from different
+ * threads. Concurrent searches on the _same_ context are serialized.
  *
+ * @param ctx Search context.
  * @param query Pattern to be searched.
  * @param npaths Number of paths to be searched.
  * @param target_paths Paths list.
  * @param nresults Pointer to number of results found.
  *
  * @return Returns a list of (struct ag_result*) containing all
- * the results found. Please note that this result is up to the
- * user to free, with @ref ag_free_result and @ref ag_free_all_results.
- *
- * If nothing is found, return NULL.
- *
- * @note Please note that this routine is _not_ thread-safe, and should
- * not be called from multiples threads.
+ * the results found. If nothing found, NULL.
  */
-struct ag_result **ag_search(char *query, int npaths, char **target_paths,
-	size_t *nresults)
+struct ag_result **ag_ctx_search(struct ag_ctx *ctx, char *query,
+	int npaths, char **target_paths, size_t *nresults)
 {
-	struct ag_result **result;
-	char **base_paths;
-	char **paths;
-	int i;
+	struct ag_result **r;
+
+	if (!nresults)
+		return (NULL);
 
-	result = NULL;
 	*nresults = 0;
 
 	/* Check if libag was initialized. */
-	if (!has_ag_init)
+	if (!has_ag_init || !ctx)
 		return (NULL);
 
 	/* Query and valid paths. */
 	if (!query || !target_paths)
 		return (NULL);
 
-	/* Check if workers already started or I should start them. */
-	if (!workers)
-	{
-		if (config.workers_behavior != LIBAG_ONSEARCH_WORKERS)
-			return (NULL);
-		if (ag_start_workers())
-			return (NULL);
-	}
-
-	/* Reset stats. */
-	if (opts.stats)
-		memset(&stats, 0, sizeof(stats));
-
-	/* Prepare query. */
-	free(opts.query);
-	opts.query = strdup(query);
-	if (!opts.query)
-		goto err1;
-	opts.query_len = strlen(query);
-
-	/* Configure search settings. */
-	opts.casing = config.casing;
-	setup_search();
-
-	/* Prepare our paths and base_paths. */
-	base_paths = NULL;
-	paths = NULL;
-	prepare_paths(npaths, target_paths, &base_paths, &paths);
-
-	/* Search everything. */
-	for (i = 0; paths[i] != NULL; i++)
-	{
-		log_debug("searching path %s for %s", paths[i], opts.query);
-		symhash = NULL;
-		ignores *ig = init_ignore(root_ignores, "", 0);
-		struct stat s = { .st_dev = 0 };
-
-#ifndef _WIN32
-		/*
-		 * The device is ignored if opts.one_dev is false, so it's fine
-		 * to leave it at the default 0.
-		 */
-		if (opts.one_dev && lstat(paths[i], &s) == -1)
-		{
-			log_err("Failed to get device information for path %s. Skipping...",
-				paths[i]);
-		}
-#endif
-		search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
-		cleanup_ignore(ig);
-	}
+	pthread_mutex_lock(&ctx->search_mtx);
+		r = search(ctx, query, npaths, target_paths, nresults);
+	pthread_mutex_unlock(&ctx->search_mtx);
+	return (r);
+}
 
-	/* Wakeup threads and let them known that work is done. */
-	pthread_mutex_lock(&work_queue_mtx);
-		done_adding_files = TRUE;
-		pthread_cond_broadcast(&files_ready);
-	pthread_mutex_unlock(&work_queue_mtx);
+/**
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx, delivering the results as they are
+ * found.
+ *
+ * This is the same as @ref ag_search_cb, but with a private
+ * context, like @ref ag_ctx_search.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ * @param callback Result callback.
+ * @param userdata Opaque pointer passed to @p callback.
+ *
+ * @return Returns 0 if the search completes or is stopped by
+ * the callback, -1 otherwise.
+ */
+int ag_ctx_search_cb(struct ag_ctx *ctx, char *query, int npaths,
+	char **target_paths, ag_result_cb callback, void *userdata)
+{
+	int ret;
 
-	/* Wait to complete. */
-	pthread_barrier_wait(&worker_done);
+	/* Check if libag was initialized. */
+	if (!has_ag_init || !ctx)
+		return (-1);
 
-	/* Work. */
-	result = get_thrd_results(nresults);
+	/* Query, valid paths and callback. */
+	if (!query || !target_paths || !callback)
+		return (-1);
 
-	/* Reset & wakeup workers again to wait for more work. */
-	reset_local_results(1);
-	done_adding_files = FALSE;
-	pthread_barrier_wait(&results_done);
+	pthread_mutex_lock(&ctx->search_mtx);
+		ret = search_cb(ctx, query, npaths, target_paths, callback, userdata);
+	pthread_mutex_unlock(&ctx->search_mtx);
+	return (ret);
+}
 
-	/* Cleanup paths. */
-	for (i = 0; paths[i] != NULL; i++)
-	{
-		free(paths[i]);
-		free(base_paths[i]);
-	}
-	free(base_paths);
-	free(paths);
-	if (find_skip_lookup)
-		free(find_skip_lookup);
+/**
+ * @brief Searches for @p query recursively in all @p target_paths
+ * using the context @p ctx, and returns the results in the flat
+ * format. See @ref ag_search_flat.
+ *
+ * @param ctx Search context.
+ * @param query Pattern to be searched.
+ * @param npaths Number of paths to be searched.
+ * @param target_paths Paths list.
+ *
+ * @return Returns the flat result, to be freed with
+ * @ref ag_free_flat_result, or NULL if nothing is found.
+ */
+struct ag_flat_result *ag_ctx_search_flat(struct ag_ctx *ctx,
+	char *query, int npaths, char **target_paths)
+{
+	struct ag_flat_result *r;
 
-	/* Cleanup query. */
-	free(opts.query);
-	opts.query = NULL;
+	/* Check if libag was initialized. */
+	if (!has_ag_init || !ctx)
+		return (NULL);
 
-err1:
-	/* Stop workers, if necessary. */
-	if (workers && config.workers_behavior == LIBAG_ONSEARCH_WORKERS)
-		if (ag_stop_workers())
-			return (NULL);
+	/* Query and valid paths. */
+	if (!query || !target_paths)
+		return (NULL);
 
-	return (result);
+	pthread_mutex_lock(&ctx->search_mtx);
+		r = search_flat(ctx, query, npaths, target_paths);
+	pthread_mutex_unlock(&ctx->search_mtx);
+	return (r);
 }
 
 /**
- * @Brief Searches for @p query recursively in all @p target_paths.
+ * @brief Searches for several fixed strings at once, recursively
+ * in all @p target_paths, using the context @p ctx. See
+ * @ref ag_search_multi.
  *
- * This is the same behavior as the @ref ag_search routine, but thread-safe.
- *
- * @param query Pattern to be searched.
+ * @param ctx Search context.
+ * @param nqueries Number of patterns.
+ * @param queries Patterns to be searched, non-empty.
  * @param npaths Number of paths to be searched.
  * @param target_paths Paths list.
  * @param nresults Pointer to number of results found.
  *
  * @return Returns a list of (struct ag_result*) containing all
  * the results found. If nothing found, NULL.
- *
- * @note Please note that this version is the same as ag_search() but
- * thread-safe.
- *
- * Also note that the thread-safe version here is the most rudimentary
- * implementation possible: just one lock on the entire function. Which
- * implies that parallel calls to this function will not be parallel, but
- * sequential.
- *
- * A more efficient implementation is needed. See the issues on GitHub for a
- * breakdown of this.
  */
-struct ag_result **ag_search_ts(char *query, int npaths, char **target_paths,
-	size_t *nresults)
+struct ag_result **ag_ctx_search_multi(struct ag_ctx *ctx, int nqueries,
+	char **queries, int npaths, char **target_paths, size_t *nresults)
 {
 	struct ag_result **r;
 
-	/* Check if libag was initialized. */
-	if (!has_ag_init)
+	if (!nresults)
 		return (NULL);
 
-	/* Query and valid paths. */
-	if (!query || !target_paths || !nresults || npaths <= 0)
+	*nresults = 0;
+
+	/* Check if libag was initialized. */
+	if (!has_ag_init || !ctx)
 		return (NULL);
 
-	/* Check if workers already started or I should start them. */
-	if (!workers)
-	{
-		if (config.workers_behavior != LIBAG_ONSEARCH_WORKERS)
-			return (NULL);
-	}
+	/* Queries and valid paths. */
+	if (check_queries(nqueries, queries) || !target_paths)
+		return (NULL);
 
-	/* Lock search. */
-	pthread_mutex_lock(&search_mtx);
-		r = ag_search(query, npaths, target_paths, nresults);
-	pthread_mutex_unlock(&search_mtx);
+	pthread_mutex_lock(&ctx->search_mtx);
+		r = search_multi(ctx, nqueries, queries, npaths, target_paths,
+			nresults);
+	pthread_mutex_unlock(&ctx->search_mtx);
 	return (r);
 }
 
 /**
- * @brief If stats are enabled, get the current stats for
- * the latest @ref ag_search call.
+ * @brief If stats are enabled for @p ctx, get the current
+ * stats for its latest @ref ag_ctx_search call.
  *
+ * @param ctx Search context.
  * @param ret_stats Stats structure to be filled.
  *
  * @return Returns 0 if success, -1 otherwise.
  */
-int ag_get_stats(struct ag_search_stats *ret_stats)
+int ag_ctx_get_stats(struct ag_ctx *ctx, struct ag_search_stats *ret_stats)
+{
+	if (!ctx)
+		return (-1);
+	return (get_stats(ctx, ret_stats));
+}
+
+/**
+ * @brief Releases all the resources belonging to the
+ * context @p ctx.
+ *
+ * @param ctx Search context.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note Results previously returned by @ref ag_ctx_search
+ * are not touched and still need to be released by the user.
+ */
+int ag_ctx_free(struct ag_ctx *ctx)
 {
-	if (!config.stats)
+	if (!ctx)
 		return (-1);
-	ret_stats->total_bytes = stats.total_bytes;
-	ret_stats->total_files = stats.total_files;
-	ret_stats->total_matches = stats.total_matches;
-	ret_stats->total_file_matches = stats.total_file_matches;
+
+	finish_ctx(ctx);
+	free(ctx);
 	return (0);
 }
 
+/**
+ * @brief Unmaps the file of the result @p blk, if mapped
+ * by @ref ag_result_map.
+ *
+ * @param blk Result block.
+ */
+static void unmap_result(struct result_block *blk)
+{
+	if (!blk->map)
+		return;
+
+	munmap(blk->map, blk->map_size);
+	blk->map = NULL;
+
+	if (blk->arena)
+		__atomic_sub_fetch(&blk->arena->nmapped, 1, __ATOMIC_RELAXED);
+}
+
 /**
  * @brief For a given @p result, free a single result from libag.
  *
  * @param result Single result.
+ *
+ * @note Results returned by a search share their memory,
+ * which is only released once all of them are freed.
  */
 void ag_free_result(struct ag_result *result)
 {
-	size_t i;
+	struct result_block *blk;
+
 	if (!result)
 		return;
-	for (i = 0; i < result->nmatches; i++)
-	{
-		free(result->matches[i]->match);
-		free(result->matches[i]);
-	}
-	free(result->matches);
-	free(result->file);
-	free(result);
+
+	blk = RESULT_BLOCK(result);
+	unmap_result(blk);
+
+	if (blk->arena)
+		release_arena(blk->arena, 1);
+	else
+		free(blk);
 }
 
 /**
@@ -908,10 +3017,154 @@ void ag_free_result(struct ag_result *result)
  */
 void ag_free_all_results(struct ag_result **results, size_t nresults)
 {
-	size_t i;
+	struct result_arena *arena;
+	size_t i, j, run;
+
 	if (!results || !nresults)
 		return;
-	for (i = 0; i < nresults; i++)
-		ag_free_result(results[i]);
+
+	/*
+	 * Results from the same search are released all at once,
+	 * so the cost is in the number of arena chunks, not in the
+	 * number of results and matches.
+	 */
+	for (i = 0; i < nresults; i += run)
+	{
+		arena = RESULT_BLOCK(results[i])->arena;
+		if (!arena)
+		{
+			unmap_result(RESULT_BLOCK(results[i]));
+			free(RESULT_BLOCK(results[i]));
+			run = 1;
+			continue;
+		}
+
+		for (run = 1; i + run < nresults; run++)
+			if (RESULT_BLOCK(results[i + run])->arena != arena)
+				break;
+
+		/* Only walk the results if some were mapped. */
+		if (__atomic_load_n(&arena->nmapped, __ATOMIC_RELAXED))
+			for (j = i; j < i + run; j++)
+				unmap_result(RESULT_BLOCK(results[j]));
+
+		release_arena(arena, run);
+	}
 	free(results);
 }
+
+/**
+ * @brief Frees a flat result returned by @ref ag_search_flat
+ * or @ref ag_ctx_search_flat.
+ *
+ * @param result Flat result.
+ */
+void ag_free_flat_result(struct ag_flat_result *result)
+{
+	/* Allocated as a single block. */
+	free(result);
+}
+
+/**
+ * @brief Maps the file of the result @p result into memory, so
+ * that the text of its matches (and lines) can be read on
+ * demand, e.g., with LIBAG_MATCH_OFFSETS.
+ *
+ * The file is mapped once, on the first call, and stays mapped
+ * until the result is freed.
+ *
+ * @param result Result whose file is mapped.
+ * @param size If not NULL, receives the mapping size.
+ *
+ * @return Returns the file contents, or NULL if error (or if
+ * the file is empty).
+ *
+ * @note The offsets of a result refer to the file as it was
+ * when searched: if it changed since, so did its contents.
+ */
+const char *ag_result_map(struct ag_result *result, size_t *size)
+{
+	struct result_block *blk;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (!result)
+		return (NULL);
+
+	blk = RESULT_BLOCK(result);
+	if (!blk->map)
+	{
+		fd = open(result->file, O_RDONLY);
+		if (fd < 0)
+			return (NULL);
+
+		if (fstat(fd, &st) < 0 || st.st_size <= 0)
+		{
+			close(fd);
+			return (NULL);
+		}
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return (NULL);
+
+		blk->map      = map;
+		blk->map_size = st.st_size;
+		if (blk->arena)
+			__atomic_add_fetch(&blk->arena->nmapped, 1, __ATOMIC_RELAXED);
+	}
+
+	if (size)
+		*size = blk->map_size;
+	return (blk->map);
+}
+
+/**
+ * @brief Reads @p len bytes at the offset @p offset of the file
+ * of the result @p result into @p buf, e.g., the text of a
+ * match or of its line, with LIBAG_MATCH_OFFSETS.
+ *
+ * Unlike @ref ag_result_map, nothing is kept: the file is
+ * opened and read on every call.
+ *
+ * @param result Result whose file is read.
+ * @param offset File offset.
+ * @param len Amount of bytes to read.
+ * @param buf Destination buffer, at least @p len bytes long.
+ *
+ * @return Returns 0 if all the @p len bytes were read, -1
+ * otherwise.
+ */
+int ag_result_read(const struct ag_result *result, size_t offset,
+	size_t len, char *buf)
+{
+	ssize_t r;
+	size_t n;
+	int fd;
+
+	if (!result || !buf)
+		return (-1);
+
+	fd = open(result->file, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+
+	for (n = 0; n < len; n += r)
+	{
+		r = pread(fd, buf + n, len - n, offset + n);
+		if (r <= 0)
+		{
+			if (r < 0 && errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			break;
+		}
+	}
+
+	close(fd);
+	return (n == len ? 0 : -1);
+}
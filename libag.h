@@ -35,6 +35,18 @@
 	#define LIBAG_MANUAL_WORKERS   1
 	#define LIBAG_ONSEARCH_WORKERS 2
 
+	/* Work queue. */
+	#define LIBAG_QUEUE_WORK_STEALING 0
+	#define LIBAG_QUEUE_LEGACY        1
+
+	/* Callback thread. */
+	#define LIBAG_CB_WORKERS    0
+	#define LIBAG_CB_DISPATCHER 1
+
+	/* Match text. */
+	#define LIBAG_MATCH_COPY    0
+	#define LIBAG_MATCH_OFFSETS 1
+
 	/* Result flags. */
 	#define LIBAG_FLG_TEXT   1
 	#define LIBAG_FLG_BINARY 2
@@ -42,6 +54,11 @@
 	/**
 	 * Structure that holds a single result, i.e: a file
 	 * that may contains multiples matches.
+	 *
+	 * Files larger than 1 GiB are searched in chunks, and
+	 * in parts, by several workers at once, but still come
+	 * as a single result. Offsets and line numbers are
+	 * always relative to the whole file.
 	 */
 	struct ag_result
 	{
@@ -51,11 +68,79 @@
 		{
 			size_t byte_start;
 			size_t byte_end;
-			char *match;
+			char *match;       /* NULL with LIBAG_MATCH_OFFSETS. */
+			/*
+			 * With LIBAG_MATCH_OFFSETS or config.match_lines only:
+			 * bounds of the line(s) the match lies on, from the
+			 * first byte of its first line up to (not including)
+			 * the newline that ends its last line, or the end of
+			 * the file.
+			 */
+			size_t line_start;
+			size_t line_end;
+			/*
+			 * With ag_search_multi: index, in its queries, of the
+			 * pattern that matched. 0 for the other searches.
+			 */
+			int pattern;
+			/*
+			 * With config.match_lines only: line of byte_start and
+			 * its column in that line (in bytes), both starting
+			 * at 1.
+			 */
+			size_t line_no;
+			size_t column;
+			/*
+			 * With config.context_before/context_after only: same
+			 * as line_start and line_end, but also spanning that
+			 * many lines before and after the match, if the file
+			 * has them. With LIBAG_MATCH_COPY, context holds a
+			 * copy of these lines, and is NULL otherwise.
+			 */
+			size_t context_start;
+			size_t context_end;
+			char *context;
 		} **matches;
 		int flags;
 	};
 
+	/**
+	 * Flat results, as returned by ag_search_flat: the same results
+	 * as ag_search, but laid out in three contiguous arrays (files,
+	 * matches and strings) instead of one object per file and per
+	 * match.
+	 *
+	 * Strings (file names and match texts) live, NUL-terminated, in a
+	 * single pool, and are referenced by their offset in it. The
+	 * matches of a file are contiguous and ordered by offset.
+	 */
+	struct ag_flat_file
+	{
+		size_t path;        /* File name offset, in pool.          */
+		size_t first_match; /* Index of its first match.           */
+		size_t nmatches;    /* Amount of matches.                  */
+		int flags;          /* LIBAG_FLG_TEXT or LIBAG_FLG_BINARY. */
+	};
+
+	struct ag_flat_match
+	{
+		size_t file_id;    /* File index, in files.              */
+		size_t byte_start; /* Same as in struct ag_match.        */
+		size_t byte_end;   /* Same as in struct ag_match.        */
+		size_t line_no;    /* Line of byte_start, starting at 1. */
+		size_t match;      /* Match text offset, in pool.        */
+	};
+
+	struct ag_flat_result
+	{
+		size_t nfiles;
+		struct ag_flat_file *files;
+		size_t nmatches;
+		struct ag_flat_match *matches;
+		size_t pool_size;
+		char *pool;
+	};
+
 	/**
 	 * @brief libag search stats
 	 *
@@ -119,7 +204,7 @@
 	 *     user.
 	 *
 	 *   - Contains a lot of options that: a) will not be supported by
-	 *     libag, such as: --color,--context,--after,--before and etc.
+	 *     libag, such as: --color,--group,--pager and etc.
 	 *     b) are not supported at the moment; allows the user to
 	 *     mistakenly think that these options are supported do not
 	 *     seems right to me.
@@ -170,8 +255,156 @@
 		 * Search binary files.
 		 */
 		int search_binary_files; /* 0 disable (default), != 0 enable. */
+		/*
+		 * How files are handed to the workers.
+		 *
+		 * LIBAG_QUEUE_WORK_STEALING 0 - each worker has its own lock-free
+		 *                               deque, fed in batches from the
+		 *                               shared queue; idle workers steal
+		 *                               from the busy ones (default).
+		 * LIBAG_QUEUE_LEGACY        1 - a single queue, locked once per
+		 *                               file.
+		 *
+		 * Like num_workers, this is a property of the workers, and is
+		 * only taken into account when they start.
+		 */
+		int work_queue;
+		/*
+		 * Thread that invokes the ag_search_cb/ag_ctx_search_cb callback.
+		 *
+		 * LIBAG_CB_WORKERS    0 - the worker that searched the file, right
+		 *                         after searching it. The callback may run
+		 *                         on several threads at once, and must be
+		 *                         thread-safe (default).
+		 * LIBAG_CB_DISPATCHER 1 - a single dispatcher thread, one result
+		 *                         at a time: the callback needs no locking
+		 *                         and a slow callback does not hold the
+		 *                         workers.
+		 */
+		int callback_thread;
+		/*
+		 * Search deadline, in milliseconds since the start of each
+		 * search. Once it passes, the search stops as if ag_cancel()
+		 * was called, but returns what was found so far: with a
+		 * callback, results already found are still delivered.
+		 *
+		 * 0 (default): no deadline.
+		 */
+		int timeout_ms;
+		/*
+		 * Maximum number of matches, over all files, that a search
+		 * returns. Once reached, the search stops: no more files are
+		 * searched, and the file that reached it keeps only the
+		 * matches that fit.
+		 *
+		 * 0 (default): no limit.
+		 */
+		int max_matches;
+		/*
+		 * Maximum number of files with matches (i.e., results) that a
+		 * search returns. Once reached, the search stops.
+		 *
+		 * 0 (default): no limit.
+		 */
+		int max_files;
+		/*
+		 * Match text in struct ag_match.
+		 *
+		 * LIBAG_MATCH_COPY    0 - each match has a copy of its text
+		 *                         (default).
+		 * LIBAG_MATCH_OFFSETS 1 - matches only carry their offsets,
+		 *                         and the offsets of their lines: no
+		 *                         text is copied while searching. The
+		 *                         text can be read later, on demand,
+		 *                         with ag_result_map/ag_result_read.
+		 *
+		 * ag_search_flat always copies the text into its pool.
+		 */
+		int match_text;
+		/*
+		 * Regex matching as UTF-8: '.' and classes match whole
+		 * characters, and case-insensitive searches also fold
+		 * non-ASCII letters. Invalid UTF-8 (e.g., in binary files)
+		 * never matches, but does not stop the search.
+		 *
+		 * Case-insensitive queries with non-ASCII letters are then
+		 * always matched as regexes, literal ones included (their
+		 * metacharacters are escaped), as only PCRE folds them.
+		 *
+		 * Only available if libag is built with PCRE2: otherwise,
+		 * ag_set_config fails if set.
+		 *
+		 * 0 disable (default), != 0 enable.
+		 */
+		int utf8;
+		/*
+		 * Line information in struct ag_match: line_no, column,
+		 * line_start and line_end of each match, worked out while
+		 * the file is still in memory. ag_search_flat ignores it,
+		 * as its matches always have their line number.
+		 *
+		 * 0 disable (default), != 0 enable.
+		 */
+		int match_lines;
+		/*
+		 * Lines of context before and after each match, as in ag's
+		 * -B and -A options: see context_start, context_end and
+		 * context in struct ag_match. Either of them implies
+		 * match_lines, and, like it, is ignored by ag_search_flat.
+		 *
+		 * 0 (default): no context.
+		 */
+		int context_before;
+		int context_after;
+		/*
+		 * How many leading bytes of each file are looked at to
+		 * tell binary files (skipped unless search_binary_files)
+		 * from text ones. A larger window catches binaries with a
+		 * text header, a smaller one makes the check cheaper.
+		 *
+		 * 0 (default): 512 bytes, as ag.
+		 */
+		int binary_window;
+		/*
+		 * Load files with io_uring (Linux 5.6+): each worker reads
+		 * a batch of small files with a few system calls for the
+		 * whole batch, rather than several calls per file. Where
+		 * io_uring is unavailable (other systems, older kernels,
+		 * seccomp filters...), files are loaded as usual.
+		 *
+		 * 0 disable (default), != 0 enable.
+		 */
+		int io_uring;
+		/*
+		 * Regex matches never span lines, as with ag's --nomultiline.
+		 * Regexes whose matches cannot span lines anyway still run
+		 * over whole files rather than once per line.
+		 *
+		 * 0 matches may span lines (default), != 0 they never do.
+		 */
+		int disable_multiline;
 	};
 
+	/**
+	 * @brief Result callback for @ref ag_search_cb and
+	 * @ref ag_ctx_search_cb, invoked once for each file with
+	 * matches, as soon as it is searched.
+	 *
+	 * The result belongs to the callback, and must be released
+	 * with @ref ag_free_result. Returning a non-zero value stops
+	 * the search.
+	 */
+	typedef int (*ag_result_cb)(struct ag_result *result, void *userdata);
+
+	/**
+	 * @brief libag search context.
+	 *
+	 * Opaque handle that owns everything a search needs, so that
+	 * searches on different contexts can run in parallel. See
+	 * @ref ag_ctx_new, @ref ag_ctx_search and @ref ag_ctx_free.
+	 */
+	struct ag_ctx;
+
 	/* Library forward declarations. */
 	extern int ag_start_workers(void);
 	extern int ag_stop_workers(void);
@@ -183,9 +416,35 @@
 		char **target_paths, size_t *nresults);
 	extern struct ag_result **ag_search_ts(char *query, int npaths,
 		char **target_paths, size_t *nresults);
+	extern int ag_search_cb(char *query, int npaths, char **target_paths,
+		ag_result_cb callback, void *userdata);
+	extern struct ag_flat_result *ag_search_flat(char *query, int npaths,
+		char **target_paths);
+	extern struct ag_result **ag_search_multi(int nqueries, char **queries,
+		int npaths, char **target_paths, size_t *nresults);
 	extern int ag_get_stats(struct ag_search_stats *ret_stats);
+	extern int ag_cancel(struct ag_ctx *ctx);
 	extern void ag_free_result(struct ag_result *result);
 	extern void ag_free_all_results(struct ag_result **results,
 		size_t nresults);
+	extern void ag_free_flat_result(struct ag_flat_result *result);
+	extern const char *ag_result_map(struct ag_result *result, size_t *size);
+	extern int ag_result_read(const struct ag_result *result, size_t offset,
+		size_t len, char *buf);
+
+	/* Search contexts. */
+	extern struct ag_ctx *ag_ctx_new(struct ag_config *ag_config);
+	extern struct ag_result **ag_ctx_search(struct ag_ctx *ctx, char *query,
+		int npaths, char **target_paths, size_t *nresults);
+	extern int ag_ctx_search_cb(struct ag_ctx *ctx, char *query, int npaths,
+		char **target_paths, ag_result_cb callback, void *userdata);
+	extern struct ag_flat_result *ag_ctx_search_flat(struct ag_ctx *ctx,
+		char *query, int npaths, char **target_paths);
+	extern struct ag_result **ag_ctx_search_multi(struct ag_ctx *ctx,
+		int nqueries, char **queries, int npaths, char **target_paths,
+		size_t *nresults);
+	extern int ag_ctx_get_stats(struct ag_ctx *ctx,
+		struct ag_search_stats *ret_stats);
+	extern int ag_ctx_free(struct ag_ctx *ctx);
 
 #endif /* LIBAG_H. */